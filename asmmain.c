@@ -7,24 +7,170 @@
 
 #include "chip8.h"
 
+/* The interpreter's default speed */
+#define DEFAULT_SPEED  1200
+
 static void usage(const char *name) {
 	printf("usage: %s [options] infile.asm\n", name);
 	printf("where options are:\n");
 	printf(" -o outfile     : Output file\n");
+	printf(" -c             : Write an object file for c8ld instead of a ROM\n");
+	printf(" -O             : Optimize the program\n");
+	printf(" -g             : Write a source map next to the output file\n");
+	printf(" -l listing     : Write a listing of the program\n");
+	printf(" -a             : Print an analysis of the program\n");
+	printf(" -s speed       : Instructions per second for the analysis (default %d)\n", DEFAULT_SPEED);
 	printf(" -v             : Verbose mode\n");
 }
 
+static void print_diags(const c8_asm_t *a) {
+	for(int i = 0; i < a->ndiags; i++) {
+		const c8_diag_t *d = &a->diags[i];
+		if(d->line)
+			fprintf(stderr, "error:%d: %s\n", d->line, d->message);
+		else
+			fprintf(stderr, "error: %s\n", d->message);
+	}
+}
+
+/* Assembles `text` into the ROM `outfile` */
+static int assemble_rom(c8_asm_t *a, const char *text, const char *outfile) {
+	static uint8_t prog[TOTAL_RAM - PROG_OFFSET];
+
+	int n = c8_assemble_r(a, text, prog, sizeof prog);
+	print_diags(a);
+	if(n < 0)
+		return 1;
+
+	c8_reset();
+	for(int i = 0; i < n; i++)
+		c8_set(PROG_OFFSET + i, prog[i]);
+
+	if(c8_verbose)
+		printf("Writing output to '%s'...\n", outfile);
+	if(!c8_save_file(outfile)) {
+		fprintf(stderr, "error: unable to write output to '%s': %s\n", outfile, strerror(errno));
+		return 1;
+	}
+	if(c8_verbose)
+		printf("Output written.\n");
+	return 0;
+}
+
+/* The name of the source map of the ROM `outfile`: its extension is
+replaced with .map */
+static char *map_name(const char *outfile) {
+	const char *base = strrchr(outfile, '/'), *ext;
+	if(!base)
+		base = outfile;
+	if(!(ext = strrchr(base, '.')))
+		ext = outfile + strlen(outfile);
+	char *name = malloc(ext - outfile + 5);
+	if(name) {
+		memcpy(name, outfile, ext - outfile);
+		strcpy(name + (ext - outfile), ".map");
+	}
+	return name;
+}
+
+/* Writes the source map, or with `text` the listing, of the program
+assembled from `infile` to `fname` */
+static int write_debug_info(c8_asm_t *a, const char *infile, const char *text, const char *fname) {
+	static char buffer[4096];
+	c8_writer_t w;
+
+	if(c8_verbose)
+		printf("Writing %s to '%s'...\n", text ? "listing" : "source map", fname);
+	FILE *f = fopen(fname, "w");
+	if(!f) {
+		fprintf(stderr, "error: unable to write to '%s': %s\n", fname, strerror(errno));
+		return 1;
+	}
+	c8_writer_file(&w, f, buffer, sizeof buffer);
+	int r = text ? c8_asm_listing(a, infile, text, &w) : c8_asm_source_map(a, infile, &w);
+	if(fclose(f) && r >= 0) {
+		fprintf(stderr, "error: unable to write to '%s': %s\n", fname, strerror(errno));
+		return 1;
+	}
+	print_diags(a);
+	return r < 0;
+}
+
+/* Assembles `text` into the object file `outfile` */
+static int assemble_object(c8_asm_t *a, const char *text, const char *outfile) {
+	c8_writer_t obj;
+
+	if(!c8_writer_buffer(&obj, NULL, 0)) {
+		fprintf(stderr, "error: out of memory\n");
+		return 1;
+	}
+
+	int n = c8_assemble_object(a, text, &obj);
+	print_diags(a);
+	if(n < 0) {
+		free(obj.buf);
+		return 1;
+	}
+
+	if(c8_verbose)
+		printf("Writing output to '%s'...\n", outfile);
+	FILE *f = fopen(outfile, "w");
+	int ok = f && fwrite(obj.buf, 1, obj.len, f) == obj.len;
+	if(f && fclose(f))
+		ok = 0;
+	if(!ok) {
+		fprintf(stderr, "error: unable to write output to '%s': %s\n", outfile, strerror(errno));
+		free(obj.buf);
+		return 1;
+	}
+	free(obj.buf);
+	if(c8_verbose)
+		printf("Output written.\n");
+	return 0;
+}
+
 int main(int argc, char *argv[]) {
 	int opt;
 	const char *infile = NULL;
-	const char *outfile = "a.ch8";
+	const char *outfile = NULL;
+	int object = 0;
+	int analyze = 0, speed = DEFAULT_SPEED;
+	int source_map = 0;
+	const char *listfile = NULL;
 	char *text;
+	c8_asm_t a;
+	static char buffer[4096];
+	c8_writer_t listing;
+
+	c8_asm_init(&a);
 
-	while((opt = getopt(argc, argv, "vo:?")) != -1) {
+	while((opt = getopt(argc, argv, "vcOgl:as:o:?")) != -1) {
 		switch(opt) {
 			case 'v': {
 				c8_verbose++;
 			} break;
+			case 'c': {
+				object = 1;
+			} break;
+			case 'O': {
+				a.optimize = 1;
+			} break;
+			case 'g': {
+				source_map = 1;
+			} break;
+			case 'l': {
+				listfile = optarg;
+			} break;
+			case 'a': {
+				analyze = 1;
+			} break;
+			case 's': {
+				speed = atoi(optarg);
+				if(speed <= 0) {
+					fprintf(stderr, "error: invalid speed '%s'\n", optarg);
+					return 1;
+				}
+			} break;
 			case 'o': {
 				outfile = optarg;
 			} break;
@@ -38,7 +184,13 @@ int main(int argc, char *argv[]) {
         usage(argv[0]);
         return 1;
     }
+	if(object && (analyze || source_map || listfile)) {
+		fprintf(stderr, "error: -a, -g and -l can't be used with -c\n");
+		return 1;
+	}
 	infile = argv[optind++];
+	if(!outfile)
+		outfile = object ? "a.o" : "a.ch8";
 
 	if(c8_verbose)
 		printf("Reading input from '%s'...\n", infile);
@@ -52,21 +204,35 @@ int main(int argc, char *argv[]) {
 	if(c8_verbose)
 		printf("Input read.\n");
 
-	c8_reset();
+	c8_writer_file(&listing, stdout, buffer, sizeof buffer);
+	a.verbose = c8_verbose;
+	a.listing = &listing;
 
-	int return_code = c8_assemble(text);
+	int return_code;
+	if(object)
+		return_code = assemble_object(&a, text, outfile);
+	else
+		return_code = assemble_rom(&a, text, outfile);
 
-	if(c8_verbose)
-		printf("Writing output to '%s'...\n", outfile);
-	if(!c8_save_file(outfile)) {
-		fprintf(stderr, "error: unable to write output to '%s': %s\n", outfile, strerror(errno));
-		return 1;
+	if(!return_code && source_map) {
+		char *mapfile = map_name(outfile);
+		if(!mapfile) {
+			fprintf(stderr, "error: out of memory\n");
+			return_code = 1;
+		} else
+			return_code = write_debug_info(&a, infile, NULL, mapfile);
+		free(mapfile);
+	}
+	if(!return_code && listfile)
+		return_code = write_debug_info(&a, infile, text, listfile);
+	if(!return_code && analyze && c8_asm_analyze(&a, speed, &listing) < 0) {
+		print_diags(&a);
+		return_code = 1;
 	}
-	if(c8_verbose)
-		printf("Output written.\n");
 
+	c8_asm_free(&a);
 	free(text);
-	if(c8_verbose)
+	if(!return_code && c8_verbose)
 		printf("Success.\n");
 
 	return return_code;
@@ -0,0 +1,247 @@
+/* Benchmark for the CHIP-8 interpreter.
+
+It runs each ROM for a number of frames, first one instruction at a time
+through `c8_step()`, then through `c8_run()`, and then through `c8_run()` with
+the JIT (where it is available) and with the trace compiler, and reports the number of dispatches per
+frame for each, along with the time taken. The runs must leave the machine in
+the same state; it is reported if they don't.
+
+It also counts the stores each ROM makes into the pages of RAM it executes,
+to show how often ROMs modify their own code.
+
+With `-r` the `c8_step()` run also records the code executed and the data
+drawn to `rom.ch8.cov`, for `c8dasm -t`.
+
+With `-p` it also profiles the pairs of instructions that the ROM
+executes, which is how the sequences that `c8_run()` fuses were chosen.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chip8.h"
+
+static int speed = 1200;
+static int frames = 3600;
+static int press_keys = 0;
+static int profile = 0;
+static int record = 0;
+
+/* Executed pairs of instructions, by the high nibbles of their opcodes */
+static uint64_t pairs[256];
+
+static uint32_t seed;
+static int bench_rand() {
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 16) & 0x7FFF;
+}
+
+static int quiet_puts(const char *s) {
+	(void)s;
+	return 0;
+}
+
+static void usage(const char *name) {
+	printf("usage: %s [options] rom.ch8 ...\n", name);
+	printf("where options are:\n");
+	printf(" -s speed       : Instructions per second (default %d)\n", speed);
+	printf(" -f frames      : Number of 60Hz frames to run (default %d)\n", frames);
+	printf(" -q quirks      : Sets the quirks\n");
+	printf(" -k             : Press random keys, to get past title screens\n");
+	printf(" -p             : Profile the pairs of instructions executed\n");
+	printf(" -r             : Record coverage to `rom.ch8.cov` for `c8dasm -t`\n");
+}
+
+/* Simulates a player pressing a random key every half second */
+static void keyboard(int frame) {
+	if(!press_keys || frame % 30)
+		return;
+	if(frame % 60)
+		c8_key_up(bench_rand() & 0x0F);
+	else
+		c8_key_down(bench_rand() & 0x0F);
+}
+
+typedef struct {
+	uint64_t instructions;
+	uint64_t dispatches;
+	uint64_t fused;
+	uint64_t native;
+	uint64_t stores;
+	uint64_t code_stores;
+	double seconds;
+	/* The machine at the end of the run */
+	chip8_t regs;
+	uint8_t pixels[128 * 64];
+} result_t;
+
+enum { STEP, RUN, JIT, TRACE };
+
+static int bench(const char *file, int mode, result_t *r) {
+	int frame, i, count, w, h, ipf = speed / 60;
+	uint16_t prev = 0;
+	clock_t start;
+
+	c8_reset();
+	if(!c8_load_file(file)) {
+		fprintf(stderr, "error: Unable to load %s\n", file);
+		return 0;
+	}
+	c8_set_tick_rate(ipf > 0 ? ipf : 1, 1);
+	memset(&c8_stats, 0, sizeof c8_stats);
+	seed = 1;
+	if(mode == JIT)
+		c8_jit_start();
+	else if(mode == TRACE)
+		c8_trace_start();
+	else if(mode == STEP && record)
+		c8_coverage_start();
+
+	start = clock();
+	for(frame = 0; frame < frames && !c8_ended(); frame++) {
+		keyboard(frame);
+		count = ipf;
+		if(mode != STEP) {
+			c8_run(count);
+		} else if(profile) {
+			for(i = 0; i < count; i++) {
+				uint16_t op = c8_opcode(c8_get_pc());
+				pairs[(prev >> 8 & 0xF0) | op >> 12]++;
+				prev = op;
+				c8_step();
+			}
+		} else {
+			for(i = 0; i < count; i++)
+				c8_step();
+		}
+	}
+	r->seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+	r->instructions = c8_cycles();
+	r->dispatches = c8_stats.dispatches;
+	r->fused = c8_stats.fused;
+	r->native = c8_stats.native;
+	r->stores = c8_stats.stores;
+	r->code_stores = c8_stats.code_stores;
+	r->regs = C8;
+	c8_resolution(&w, &h);
+	for(i = 0; i < w * h; i++)
+		r->pixels[i] = c8_get_pixel(i % w, i / w);
+	if(mode == JIT)
+		c8_jit_stop();
+	else if(mode == TRACE)
+		c8_trace_stop();
+	else if(mode == STEP && record) {
+		char cov[FILENAME_MAX];
+		c8_coverage_stop();
+		snprintf(cov, sizeof cov, "%s.cov", file);
+		if(!c8_coverage_save(cov))
+			fprintf(stderr, "error: Unable to save %s\n", cov);
+	}
+	return frame;
+}
+
+static int same(const result_t *a, const result_t *b) {
+	return a->instructions == b->instructions
+		&& !memcmp(&a->regs, &b->regs, sizeof a->regs)
+		&& !memcmp(a->pixels, b->pixels, sizeof a->pixels);
+}
+
+static void print_profile() {
+	int i, j, best;
+	uint64_t total = 0;
+	for(i = 0; i < 256; i++)
+		total += pairs[i];
+	if(!total)
+		return;
+	printf("most frequent pairs of instructions:\n");
+	for(i = 0; i < 10; i++) {
+		best = 0;
+		for(j = 1; j < 256; j++)
+			if(pairs[j] > pairs[best])
+				best = j;
+		if(!pairs[best])
+			break;
+		printf("  %Xnnn %Xnnn : %5.1f%%\n", best >> 4, best & 0xF, pairs[best] * 100.0 / total);
+		pairs[best] = 0;
+	}
+}
+
+int main(int argc, char *argv[]) {
+	int opt, n, jit_available, ret = 0, roms = 0, smc_roms = 0;
+	static result_t step, run, jit, trace;
+
+	while((opt = getopt(argc, argv, "s:f:q:kpr?")) != -1) {
+		switch(opt) {
+			case 's': speed = atoi(optarg); if(speed < 60) speed = 60; break;
+			case 'f': frames = atoi(optarg); break;
+			case 'q': c8_set_quirks(strtol(optarg, NULL, 0)); break;
+			case 'k': press_keys = 1; break;
+			case 'p': profile = 1; break;
+			case 'r': record = 1; break;
+			case '?': {
+				usage(argv[0]);
+				return 1;
+			}
+		}
+	}
+	if(optind >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	c8_puts = quiet_puts;
+	c8_rand = bench_rand;
+
+	jit_available = c8_jit_start();
+	c8_jit_stop();
+
+	for(; optind < argc; optind++) {
+		const char *file = argv[optind];
+		if(!(n = bench(file, STEP, &step)) || !bench(file, RUN, &run)) {
+			ret = 1;
+			continue;
+		}
+
+		printf("%s: %d frames, %llu instructions\n", file, n, (unsigned long long)step.instructions);
+		printf("  stores:    %llu, %llu into code\n",
+			(unsigned long long)step.stores, (unsigned long long)step.code_stores);
+		roms++;
+		if(step.code_stores)
+			smc_roms++;
+		printf("  c8_step(): %8.1f dispatches/frame, %.3fs\n",
+			(double)step.dispatches / n, step.seconds);
+		printf("  c8_run():  %8.1f dispatches/frame, %.3fs (%.1f%% fused)\n",
+			(double)run.dispatches / n, run.seconds,
+			run.dispatches ? run.fused * 100.0 / run.dispatches : 0.0);
+		if(!same(&step, &run)) {
+			printf("  error: c8_run() and c8_step() ended in different states\n");
+			ret = 1;
+		}
+		if(jit_available && bench(file, JIT, &jit)) {
+			printf("  JIT:       %8.1f dispatches/frame, %.3fs (%.1f%% native)\n",
+				(double)jit.dispatches / n, jit.seconds,
+				jit.dispatches ? jit.native * 100.0 / jit.dispatches : 0.0);
+			if(!same(&step, &jit)) {
+				printf("  error: the JIT and c8_step() ended in different states\n");
+				ret = 1;
+			}
+		}
+		if(bench(file, TRACE, &trace)) {
+			printf("  traces:    %8.1f dispatches/frame, %.3fs (%.1f%% in traces)\n",
+				(double)trace.dispatches / n, trace.seconds,
+				trace.dispatches ? trace.native * 100.0 / trace.dispatches : 0.0);
+			if(!same(&step, &trace)) {
+				printf("  error: the traces and c8_step() ended in different states\n");
+				ret = 1;
+			}
+		}
+	}
+	if(roms > 1)
+		printf("%d of %d ROMs stored into their code\n", smc_roms, roms);
+	if(profile)
+		print_profile();
+	return ret;
+}
@@ -116,16 +116,24 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdarg.h>
+#include <setjmp.h>
 #include <ctype.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#if defined(C8_MMAP) && !defined(_WIN32)
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <sys/mman.h>
+#endif
 
 #include "chip8.h"
 
 #define TOK_SIZE    64
 
-#define MAX_DEFS    512
-#define MAX_LOOKUP  2048
+#define MAX_INCLUDE_DEPTH  16
 
 c8_include_callback_t c8_include_callback = c8_load_txt;
 
@@ -150,61 +158,130 @@ typedef enum {
 	SYM_DW,
 	SYM_TEXT,
 	SYM_INCLUDE,
+	SYM_GLOBAL,
 } SYMBOL;
 
-/* List of instruction names.
-(NB Keep this list sorted because of `bsearch()`) */
-static const char *inst_names[] = {
-	"add",
-	"and",
-	"bcd",
-	"call",
-	"cls",
-	"delay",
-	"drw",
-	"exit",
-	"hex",
-	"hexx",
-	"high",
-	"jp",
-	"key",
-	"ld",
-	"low",
-	"or",
-	"ret",
-	"rnd",
-	"rstr",
-	"rstrx",
-	"scd",
-	"scl",
-	"scr",
-	"se",
-	"shl",
-	"shr",
-	"sknp",
-	"skp",
-	"sne",
-	"sound",
-	"stor",
-	"storx",
-	"sub",
-	"subn",
-	"sys",
-	"xor",
+typedef enum {
+	INST_NONE,
+	INST_ADD,
+	INST_AND,
+	INST_BCD,
+	INST_CALL,
+	INST_CLS,
+	INST_DELAY,
+	INST_DRW,
+	INST_EXIT,
+	INST_HEX,
+	INST_HEXX,
+	INST_HIGH,
+	INST_JP,
+	INST_KEY,
+	INST_LD,
+	INST_LOW,
+	INST_OR,
+	INST_RET,
+	INST_RND,
+	INST_RSTR,
+	INST_RSTRX,
+	INST_SCD,
+	INST_SCL,
+	INST_SCR,
+	INST_SE,
+	INST_SHL,
+	INST_SHR,
+	INST_SKNP,
+	INST_SKP,
+	INST_SNE,
+	INST_SOUND,
+	INST_STOR,
+	INST_STORX,
+	INST_SUB,
+	INST_SUBN,
+	INST_SYS,
+	INST_XOR,
+} INSTRUCTION;
+
+/* The instructions and keywords, in a perfect hash table: `hash_keyword()`
+gives each of them a slot of its own. If you add one, find new factors
+for which they all still get different slots. */
+#define KEYWORD_SLOTS 128
+static const struct {
+	const char *name;
+	SYMBOL sym;
+	INSTRUCTION inst;
+} keywords[KEYWORD_SLOTS] = {
+	[2] = {"dt", SYM_DT},
+	[3] = {"r", SYM_R},
+	[5] = {"sys", SYM_INSTRUCTION, INST_SYS},
+	[9] = {"text", SYM_TEXT},
+	[10] = {"add", SYM_INSTRUCTION, INST_ADD},
+	[11] = {"offset", SYM_OFFSET},
+	[16] = {"jp", SYM_INSTRUCTION, INST_JP},
+	[17] = {"global", SYM_GLOBAL},
+	[18] = {"hex", SYM_INSTRUCTION, INST_HEX},
+	[20] = {"shr", SYM_INSTRUCTION, INST_SHR},
+	[21] = {"hexx", SYM_INSTRUCTION, INST_HEXX},
+	[22] = {"call", SYM_INSTRUCTION, INST_CALL},
+	[26] = {"ld", SYM_INSTRUCTION, INST_LD},
+	[32] = {"ret", SYM_INSTRUCTION, INST_RET},
+	[33] = {"high", SYM_INSTRUCTION, INST_HIGH},
+	[41] = {"sound", SYM_INSTRUCTION, INST_SOUND},
+	[44] = {"hf", SYM_HF},
+	[45] = {"exit", SYM_INSTRUCTION, INST_EXIT},
+	[49] = {"key", SYM_INSTRUCTION, INST_KEY},
+	[51] = {"scr", SYM_INSTRUCTION, INST_SCR},
+	[55] = {"f", SYM_F},
+	[56] = {"xor", SYM_INSTRUCTION, INST_XOR},
+	[63] = {"define", SYM_DEFINE},
+	[65] = {"st", SYM_ST},
+	[66] = {"k", SYM_K},
+	[67] = {"skp", SYM_INSTRUCTION, INST_SKP},
+	[68] = {"sknp", SYM_INSTRUCTION, INST_SKNP},
+	[70] = {"bcd", SYM_INSTRUCTION, INST_BCD},
+	[72] = {"low", SYM_INSTRUCTION, INST_LOW},
+	[75] = {"scl", SYM_INSTRUCTION, INST_SCL},
+	[76] = {"delay", SYM_INSTRUCTION, INST_DELAY},
+	[80] = {"rstrx", SYM_INSTRUCTION, INST_RSTRX},
+	[83] = {"or", SYM_INSTRUCTION, INST_OR},
+	[84] = {"cls", SYM_INSTRUCTION, INST_CLS},
+	[85] = {"sub", SYM_INSTRUCTION, INST_SUB},
+	[88] = {"and", SYM_INSTRUCTION, INST_AND},
+	[89] = {"dw", SYM_DW},
+	[95] = {"stor", SYM_INSTRUCTION, INST_STOR},
+	[96] = {"include", SYM_INCLUDE},
+	[98] = {"subn", SYM_INSTRUCTION, INST_SUBN},
+	[102] = {"sne", SYM_INSTRUCTION, INST_SNE},
+	[107] = {"scd", SYM_INSTRUCTION, INST_SCD},
+	[108] = {"shl", SYM_INSTRUCTION, INST_SHL},
+	[112] = {"i", SYM_I},
+	[113] = {"drw", SYM_INSTRUCTION, INST_DRW},
+	[115] = {"b", SYM_B},
+	[116] = {"db", SYM_DB},
+	[118] = {"storx", SYM_INSTRUCTION, INST_STORX},
+	[120] = {"se", SYM_INSTRUCTION, INST_SE},
+	[121] = {"rstr", SYM_INSTRUCTION, INST_RSTR},
+	[127] = {"rnd", SYM_INSTRUCTION, INST_RND},
 };
-/* TIL https://stackoverflow.com/a/15824981/115589 */
-static int inst_cmp(const void *s1, const void *s2) {
-  const char *key = s1;
-  const char * const *arg = s2;
-  return strcmp(key, *arg);
+
+static unsigned hash_keyword(const char *token, size_t len) {
+	const uint8_t *t = (const uint8_t *)token;
+	return ((t[0] * 13) ^ (t[1] * 69) ^ (t[len - 1] << 2) ^ len) & (KEYWORD_SLOTS - 1);
 }
 
+typedef struct c8_asm_state Assembler;
+
 typedef struct {
+	Assembler *as;
 	const char * in;
 	const char * last;
+	const char * line;  /* Where the current line starts */
 	SYMBOL sym;
+	INSTRUCTION inst;  /* Which one if `sym` is SYM_INSTRUCTION */
 	int linenum;
 	char token[TOK_SIZE];
+	int expr;  /* The compiled expression if `sym` is SYM_NUMBER, else -1 */
+	int depth; /* How deeply the file is included */
+	int file;  /* 0 for the text being assembled, else 1 + its index in `includes` */
 } Stepper;
 
 #define BITNESS_BITMASK 0b0011
@@ -231,45 +308,281 @@ typedef struct {
 	uint16_t value;
 } Emitted;
 
-/* Generated instructions before binary output */
-static struct {
-	struct {
-		uint8_t byte;
-		EMITTED_TYPE type;
-		int linenum;
-		char expression[TOK_SIZE];
-	} bytes[TOTAL_RAM];
-
-	uint16_t next_instr; /* Address of next instruction */
-	uint16_t max_instr;  /* Largest instruction address for output */
-} program;
-
-/* Lookup table for labels for JP and CALL instructions */
-static struct {
-	char label[TOK_SIZE];
+/* Bytes whose value comes from an expression that can only be
+evaluated once all the labels are known. `has_fixup` marks their
+addresses so that bytes emitted over them can cancel them. */
+typedef struct {
 	uint16_t addr;
-} lookup[MAX_LOOKUP];
-static int n_lookup;
-
-/* Lookup table for DEFINE identifier value statements */
-static struct {
-	char name[TOK_SIZE];
-	SYMBOL type;
-	char value[TOK_SIZE];
-} defs[MAX_DEFS];
-static int n_defs;
-
-static void exit_error(const char *msg, ...) {
-	char buffer[MAX_MESSAGE_TEXT];
+	EMITTED_TYPE type; /* CONTINUED if it has been cancelled */
+	int linenum, column;
+	int expr;
+	const char *file;  /* The object file it comes from in c8_link() */
+} Fixup;
+
+/* Symbol table for labels and DEFINE identifier value statements.
+Symbols are kept in `symbols` and referred to by their index in it;
+`table` is an open addressing hash table of those indexes plus one
+(0 marks an empty slot) that grows as needed. The names and the values
+of definitions are interned in `strings` and referred to by their
+offset in it. */
+typedef struct {
+	int name;
+	uint32_t hash;
+	int addr;     /* The label's address, or -1 if it isn't a label */
+	int global;   /* Nonzero if other units can use the label */
+	int defined;  /* Nonzero if it was DEFINEd... */
+	SYMBOL type;  /* ...to a value of this type */
+	int value;
+	int expr;     /* The compiled value if it is a SYM_NUMBER */
+} Symbol;
+
+/* Compiled expressions.
+Expressions are compiled to Reverse Polish Notation when they are
+parsed, and evaluated once all the labels are known. An expression
+is the index of its first `Op` in `code` and runs until an OP_END.
+Binary operators are stored as their first character, and unary
+operators with bit 7 set, like on the parser's operator stack. */
+enum {
+	OP_END,
+	OP_NUMBER,
+	OP_SYMBOL,
+};
+
+typedef struct {
+	unsigned char op;
+	int value;  /* The number, or the symbol's index in `symbols` */
+} Op;
+
+/* Files that have been included. The text of the files that are read
+with c8_load_txt() is kept between calls to c8_assemble_r(), and only
+read again if the file changes. */
+#ifdef __linux__
+#  define MTIME_NS(st)  ((st).st_mtim.tv_nsec)
+#else
+#  define MTIME_NS(st)  0L
+#endif
+
+typedef struct {
+	char *path;      /* The canonical path, or the name for other callbacks */
+	time_t mtime;
+	long mtime_ns, size;
+	char *text;      /* NULL if the file isn't kept */
+	size_t mapped;   /* The length of the mapping if `text` is mmap()ed */
+	unsigned pass;   /* The last assembly that included it */
+} Include;
+
+/* The private part of a `c8_asm_t`. The arrays are kept between
+calls to c8_assemble_r(), and grow as needed. */
+struct c8_asm_state {
+	c8_asm_t *a;
+
+	/* Generated instructions before binary output */
+	struct {
+		uint8_t bytes[TOTAL_RAM + 1];
+
+		uint16_t next_instr; /* Address of next instruction */
+		uint16_t max_instr;  /* Largest instruction address for output */
+	} program;
+
+	Fixup *fixups;
+	int n_fixups, fixups_size;
+	uint8_t has_fixup[TOTAL_RAM/8];
+
+	/* Where the instructions start, and whether `offset` moved any of them */
+	uint8_t is_instr[TOTAL_RAM/8];
+	bool moved;
+	/* Whether the `global` labels can be used by other units, in an
+	object file */
+	bool exported;
+	/* Whether `program` holds what c8_assemble_r() produced */
+	bool assembled;
+
+	/* The line and the file (like `Stepper.file`) each byte comes
+	from, for the source map; line 0 if it wasn't assembled from source */
+	int src_line[TOTAL_RAM];
+	int src_file[TOTAL_RAM];
+
+	/* The optimizer's maps of the program */
+	int fixup_at[TOTAL_RAM];
+	uint8_t opt_flags[TOTAL_RAM];
+	uint16_t new_addr[TOTAL_RAM + 1];
+
+	Symbol *symbols;
+	int n_symbols, symbols_size;
+
+	int *table;
+	int table_size;
+
+	char *strings;
+	int strings_len, strings_size;
+
+	Op *code;
+	int n_code, code_size;
+
+	/* The parser's operator stack and the evaluator's value stack */
+	unsigned char *operators;
+	int operators_size;
+	int *values;
+	int values_size;
+
+	/* The text of the expression being parsed */
+	char *arith_text;
+	int arith_text_size;
+
+	/* The file being parsed, or NULL while the labels are resolved */
+	Stepper *stepper;
+	/* Where the fixup being resolved comes from */
+	int linenum, column;
+	const char *file;
+
+	/* The symbols of an object file, by their index in it */
+	int *ids;
+	int ids_size;
+
+	/* Where exit_error() goes back to in c8_assemble_r() */
+	jmp_buf on_error;
+
+	/* The text of the files being included that aren't kept in
+	`includes`, freed if there's an error */
+	char *included[MAX_INCLUDE_DEPTH];
+	int n_included;
+
+	Include *includes;
+	int n_includes, includes_size;
+	unsigned pass;   /* Counts the assemblies, for `include once` */
+};
+
+/* The column of the current token */
+static int column(const Stepper *stepper) {
+	return stepper->last ? stepper->last - stepper->line + 1 : 0;
+}
+
+/* Adds a diagnostic about the current token, or the fixup being resolved */
+static void report(Assembler *as, const char *msg, va_list arg) {
+	c8_asm_t *a = as->a;
+	if(a->ndiags == a->diags_size) {
+		int size = a->diags_size ? a->diags_size << 1 : 8;
+		c8_diag_t *diags = realloc(a->diags, size * sizeof *diags);
+		if(!diags)
+			return;
+		a->diags = diags;
+		a->diags_size = size;
+	}
+	c8_diag_t *d = &a->diags[a->ndiags++];
+	if(as->stepper) {
+		d->line = as->stepper->linenum;
+		d->column = column(as->stepper);
+		d->file = NULL;
+	} else {
+		d->line = as->linenum;
+		d->column = as->column;
+		d->file = as->file;
+	}
+	vsnprintf(d->message, sizeof d->message, msg, arg);
+}
+
+static void error(Assembler *as, const char *msg, ...) {
+	va_list arg;
+	va_start(arg, msg);
+	report(as, msg, arg);
+	va_end(arg);
+}
+
+/* Reports an error and abandons the assembly */
+static void exit_error(Assembler *as, const char *msg, ...) {
 	if(msg) {
 		va_list arg;
-		va_start (arg, msg);
-		vsnprintf (buffer, MAX_MESSAGE_TEXT - 1, msg, arg);
-		va_end (arg);
-		c8_message("%s", buffer);
+		va_start(arg, msg);
+		report(as, msg, arg);
+		va_end(arg);
 	}
-	exit(1);
+	longjmp(as->on_error, 1);
 }
+
+/* FNV-1a */
+static uint32_t hash_name(const char *name) {
+	uint32_t h = 2166136261u;
+	while(*name)
+		h = (h ^ (uint8_t)*name++) * 16777619u;
+	return h;
+}
+
+/* Makes sure that the array `p` of `*size` elements has room for `need` */
+static void *reserve(Assembler *as, void *p, int *size, int need, size_t elem) {
+	if(need <= *size)
+		return p;
+	int n = *size ? *size : 64;
+	while(n < need)
+		n <<= 1;
+	p = realloc(p, n * elem);
+	if(!p)
+		exit_error(as, "out of memory");
+	*size = n;
+	return p;
+}
+
+static int intern(Assembler *as, const char *str) {
+	int len = strlen(str) + 1;
+	as->strings = reserve(as, as->strings, &as->strings_size, as->strings_len + len, 1);
+	memcpy(as->strings + as->strings_len, str, len);
+	as->strings_len += len;
+	return as->strings_len - len;
+}
+
+static void clear_symbols(Assembler *as) {
+	if(as->table)
+		memset(as->table, 0, as->table_size * sizeof *as->table);
+	as->n_symbols = 0;
+	as->strings_len = 0;
+	as->n_code = 0;
+}
+
+/* Doubles the hash table, keeping it at most half full */
+static void grow_table(Assembler *as) {
+	int size = as->table_size ? as->table_size << 1 : 256;
+	int *t = calloc(size, sizeof *t);
+	if(!t)
+		exit_error(as, "out of memory");
+	for(int i = 0; i < as->n_symbols; i++) {
+		int j = as->symbols[i].hash & (size - 1);
+		while(t[j])
+			j = (j + 1) & (size - 1);
+		t[j] = i + 1;
+	}
+	free(as->table);
+	as->table = t;
+	as->table_size = size;
+}
+
+/* Finds the symbol called `name`, adding it if `create` is set.
+The returned pointer is only valid until the next symbol is added. */
+static Symbol *find_symbol(Assembler *as, const char *name, int create) {
+	uint32_t hash = hash_name(name);
+	int i = 0;
+	if(as->table_size) {
+		for(i = hash & (as->table_size - 1); as->table[i]; i = (i + 1) & (as->table_size - 1)) {
+			Symbol *sym = &as->symbols[as->table[i] - 1];
+			if(sym->hash == hash && !strcmp(as->strings + sym->name, name))
+				return sym;
+		}
+	}
+	if(!create)
+		return NULL;
+
+	if(2 * (as->n_symbols + 1) > as->table_size) {
+		grow_table(as);
+		for(i = hash & (as->table_size - 1); as->table[i]; i = (i + 1) & (as->table_size - 1));
+	}
+	as->symbols = reserve(as, as->symbols, &as->symbols_size, as->n_symbols + 1, sizeof *as->symbols);
+	Symbol *sym = &as->symbols[as->n_symbols];
+	memset(sym, 0, sizeof *sym);
+	sym->name = intern(as, name);
+	sym->hash = hash;
+	sym->addr = -1;
+	as->table[i] = ++as->n_symbols;
+	return sym;
+}
+
 static bool is_arith(char c){
 	switch (c){
 		case '0' ... '9':
@@ -339,28 +652,33 @@ static int get_base(const char * a){
 	else
 		return 0;
 }
-static int parse_int(char **expression, const int linenum){
+static int parse_int(Assembler *as, const char **expression){
 	int base = get_base(*expression);
 	if(base <= 0)
-		exit_error("error:%d: Invalid Immediate\n", linenum);
+		exit_error(as, "Invalid Immediate");
 	if (base!=10)
 		(*expression)++;
-	return (int)strtol(*expression, expression, base);
+	return (int)strtol(*expression, (char **)expression, base);
 }
 
-static void copy_arithmetic_expression(char * buffer, const char ** in){
-
+/* Copies the expression at `in` after `prefix` into `arith_text` */
+static char *copy_arithmetic_expression(Assembler *as, const char *prefix, const char ** in){
+	int len = strlen(prefix);
+	as->arith_text = reserve(as, as->arith_text, &as->arith_text_size, len + 1, 1);
+	strcpy(as->arith_text, prefix);
 	while (**in && **in != ',' && **in !='\n' && **in !=';'){
 		if (**in == ' ') {
 			(*in)++;
 			continue;
 		}
-		(*buffer++)=(*(*in)++);
+		as->arith_text = reserve(as, as->arith_text, &as->arith_text_size, len + 2, 1);
+		as->arith_text[len++]=(*(*in)++);
 	}
-	*buffer='\0';
+	as->arith_text[len]='\0';
+	return as->arith_text;
 }
 
-static  int apply_unary_op (const unsigned char op, const  int val, const int linenum){
+static  int apply_unary_op (Assembler *as, const unsigned char op, const  int val){
 	switch (op)
 	{
 	case '+' | 0x80:
@@ -371,13 +689,12 @@ static  int apply_unary_op (const unsigned char op, const  int val, const int li
 		return ~val;
 
 	default:
-		exit_error("error:%d: Invalid Arithmetic Expression\n",linenum);
+		exit_error(as, "Invalid Arithmetic Expression");
 	}
 	/*unreachable*/
 	return -1;
 }
-#define STACK_HEIGHT 64
-static  int apply_binary_op(const  int l_op, const char op, const  int r_op, const int linenum){
+static  int apply_binary_op(Assembler *as, const  int l_op, const char op, const  int r_op){
 
 	switch (op)
 	{
@@ -388,6 +705,8 @@ static  int apply_binary_op(const  int l_op, const char op, const  int r_op, con
 	case '*':
 		return l_op*r_op;
 	case '/':
+		if(!r_op)
+			exit_error(as, "Division by zero");
 		return l_op/r_op;
 	case '|':
 		return l_op|r_op;
@@ -400,32 +719,73 @@ static  int apply_binary_op(const  int l_op, const char op, const  int r_op, con
 	case '>':
 		return l_op>>r_op;
 	default:
-		exit_error("error:%d: Invalid Arithmetic Expression\n",linenum);
+		exit_error(as, "Invalid Arithmetic Expression");
 	}
 	/*unreachable*/
 	return -1;
 
 }
 
-static int evaluate_arithmetic_expression(char *expression, const int linenum){
+typedef struct {
+	Assembler *as;
+	int start;   /* Where the expression starts in `code` */
+	int depth;   /* Height of the value stack when it is evaluated */
+} Compiler;
+
+static void compile_op(Compiler *c, unsigned char op, int value) {
+	Assembler *as = c->as;
+	as->code = reserve(as, as->code, &as->code_size, as->n_code + 1, sizeof *as->code);
+	as->code[as->n_code].op = op;
+	as->code[as->n_code++].value = value;
+}
+
+static void compile_value(Compiler *c, unsigned char op, int value) {
+	Assembler *as = c->as;
+	compile_op(c, op, value);
+	as->values = reserve(as, as->values, &as->values_size, ++c->depth, sizeof *as->values);
+}
 
-	struct {
-		unsigned char stack[STACK_HEIGHT];
-		unsigned char *top;
-	} operators;
-// GCC doesn't like that `operators.top` points to before `operators.stack`
-// but upon reviewing it, I decided it is fine.
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Warray-bounds"
-	operators.top = operators.stack - 1;
-#pragma GCC diagnostic pop
-	struct {
-		int stack[STACK_HEIGHT];
-		int *top;
-	} figures;
+/* Constants are folded as they are compiled */
+static bool is_constant(const Compiler *c, int i) {
+	const Assembler *as = c->as;
+	return as->n_code - i >= c->start && as->code[as->n_code - i].op == OP_NUMBER;
+}
 
-	*figures.stack = 0;
-	figures.top = figures.stack;
+static void compile_unary(Compiler *c, unsigned char op) {
+	Assembler *as = c->as;
+	if(c->depth < 1)
+		exit_error(as, "Invalid Arithmetic Expression");
+	if(is_constant(c, 1))
+		as->code[as->n_code - 1].value = apply_unary_op(as, op, as->code[as->n_code - 1].value);
+	else
+		compile_op(c, op, 0);
+}
+
+static void compile_binary(Compiler *c, unsigned char op) {
+	Assembler *as = c->as;
+	if(c->depth < 2 || !op || !strchr("+-*/|&^<>", op))
+		exit_error(as, "Invalid Arithmetic Expression");
+	c->depth--;
+	if(is_constant(c, 1) && is_constant(c, 2)) {
+		as->code[as->n_code - 2].value = apply_binary_op(as, as->code[as->n_code - 2].value, op, as->code[as->n_code - 1].value);
+		as->n_code--;
+	} else if(op == '+' && is_constant(c, 2) && !as->code[as->n_code - 2].value && as->code[as->n_code - 1].op == OP_SYMBOL) {
+		/* The parser adds a lot of `0 + x` */
+		as->code[as->n_code - 2] = as->code[as->n_code - 1];
+		as->n_code--;
+	} else
+		compile_op(c, op, 0);
+}
+
+/* Compiles `expression` and returns its index in `code` */
+static int compile_expression(Assembler *as, const char *expression){
+
+	Compiler c = {as, as->n_code, 0};
+	int top = -1; /* Top of the `operators` stack */
+#define push_operator(op) \
+	(as->operators = reserve(as, as->operators, &as->operators_size, top + 2, 1), as->operators[++top] = (op))
+
+	compile_value(&c, OP_NUMBER, 0);
 	bool is_prev_figure = true;
 	bool is_first_char_of_clause = true;
 	while (*expression){
@@ -437,126 +797,154 @@ static int evaluate_arithmetic_expression(char *expression, const int linenum){
 			continue;
 		} else if(*expression == '(') {
 			//if it's the first char I want to make sure it doesn't try to "bracket" the initial 0
-			if(is_first_char_of_clause) *(++operators.top)='+';
-			*(++operators.top)=*expression;
-			*(++figures.top)=0;
+			if(is_first_char_of_clause) push_operator('+');
+			push_operator(*expression);
+			compile_value(&c, OP_NUMBER, 0);
 			is_prev_figure=true;
 			expression++;
 			is_first_char_of_clause=true;
 		} else if(*expression == ')') {
-			while((*operators.top) != '(')
-			{
-				if (operators.top<operators.stack)
-					exit_error("error:%d: Unbalanced Brackets\n", linenum);
-				const  int r_op = *(figures.top--);
-				const  int l_op = *(figures.top--);
-				const unsigned char op = *(operators.top--);
-				*(++figures.top)=apply_binary_op(l_op, op, r_op,linenum);
+			for(;;) {
+				if (top < 0)
+					exit_error(as, "Unbalanced Brackets");
+				if (as->operators[top] == '(')
+					break;
+				compile_binary(&c, as->operators[top--]);
 			}
 			is_prev_figure=true;
-			operators.top--;
+			top--;
 			expression++;
 			is_first_char_of_clause=false;
 		} else if (is_unary_operator(expression) && (!is_prev_figure || is_first_char_of_clause)){
-			if (is_first_char_of_clause) *(++operators.top) = '+';
-			*(++operators.top)=((unsigned char) *expression)|0x80;
+			if (is_first_char_of_clause) push_operator('+');
+			push_operator(((unsigned char) *expression)|0x80);
 			is_prev_figure=false;
 			expression++;
 			is_first_char_of_clause=false;
 		} else if (((prec=get_precedence(expression))>0) | ((base=get_base(expression))>0)){
-			unsigned char operator_extended[2]={*operators.top,*operators.top};
-			while(
-				figures.top>=figures.stack &&
-				is_prev_figure &&
-				prec > 0 &&
-				get_precedence((char *)operator_extended)>prec
-			){
-				const  int r_op = *(figures.top--);
-				const  int l_op = *(figures.top--);
-				const unsigned char op = *(operators.top--);
-				*(++figures.top) = apply_binary_op(l_op, op, r_op,linenum);
-				memset(operator_extended,*operators.top, 2);
+			while(top >= 0 && is_prev_figure && prec > 0) {
+				char operator_extended[2]={as->operators[top],as->operators[top]};
+				if(get_precedence(operator_extended) <= prec)
+					break;
+				compile_binary(&c, as->operators[top--]);
 			}
 			if (base>0){
 				if(is_prev_figure) {
-					*(++operators.top)='+';
+					push_operator('+');
 				}
-				*(++figures.top)=parse_int(&expression, linenum);
+				compile_value(&c, OP_NUMBER, parse_int(as, &expression));
 				is_prev_figure=true;
-				if (*operators.top&0x80){
-					(*figures.top) = apply_unary_op(*operators.top, *figures.top, linenum);
-					operators.top--;
-				}
-
-
+				if (top >= 0 && as->operators[top]&0x80)
+					compile_unary(&c, as->operators[top--]);
 			} else {
 				if (is_first_char_of_clause)
-					exit_error("error:%d: Invalid Arithmetic Expression\n", linenum);
-				*(++operators.top)=*expression;
+					exit_error(as, "Invalid Arithmetic Expression");
+				push_operator(*expression);
 				expression++;
 				if (*expression=='>' || *expression=='<') expression++;
 				is_prev_figure=false;
-
 			}
 			is_first_char_of_clause=false;
 		} else {
-			bool success = false;
-			char buffer[64];
-			char * bufptr=buffer;
-			while ((*expression) && (!ispunct(*expression) || *expression == '_'))
-				*bufptr++=*expression++;
-			*bufptr='\0';
-			for(int i = 0; i < n_lookup; i++) {
-				if(!strcmp(lookup[i].label, buffer)) {
-					if(is_prev_figure) {
-						*(++operators.top)='+';
-					}
-					*(++figures.top)=lookup[i].addr;
-					if (*operators.top&0x80){
-						(*figures.top) = apply_unary_op(*operators.top, *figures.top, linenum);
-						operators.top--;
-					}
-					success=true;
-					is_first_char_of_clause=false;
-					is_prev_figure=true;
-					break;
-				}
+			char buffer[TOK_SIZE];
+			int len = 0;
+			while ((*expression) && (!ispunct(*expression) || *expression == '_')) {
+				if(len == TOK_SIZE - 1)
+					exit_error(as, "token too long (max:%d).", TOK_SIZE-1);
+				buffer[len++]=tolower(*expression++);
 			}
-			if(!success) exit_error("error:%d: Invalid Identifier %s in arithmetic expression\n", linenum, buffer);
+			buffer[len]='\0';
+			if(!len)
+				exit_error(as, "Invalid Identifier %s in arithmetic expression", buffer);
+			Symbol *sym = find_symbol(as, buffer, 1);
+			if(is_prev_figure) {
+				push_operator('+');
+			}
+			compile_value(&c, OP_SYMBOL, sym - as->symbols);
+			if (top >= 0 && as->operators[top]&0x80)
+				compile_unary(&c, as->operators[top--]);
+			is_first_char_of_clause=false;
+			is_prev_figure=true;
 		}
 	}
+#undef push_operator
 
-	while(operators.top>=operators.stack){
+	while(top >= 0)
+		compile_binary(&c, as->operators[top--]);
+	compile_op(&c, OP_END, 0);
+	return c.start;
+}
 
-		if (operators.top<operators.stack)
-			exit_error("error%d: Unbalanced Brackets\n", linenum);
-		const  int r_op = *(figures.top--);
-		const  int l_op = *(figures.top--);
-		const unsigned char op = *(operators.top--);
-		*(++figures.top)=apply_binary_op(l_op, op, r_op,linenum);
+/* Evaluates the expression at `expr` in `code`.
+If it refers to labels that aren't defined (yet) they are reported
+and it returns false. */
+static bool evaluate(Assembler *as, int expr, int *result) {
+	int *sp = as->values;
+	bool defined = true;
+	for(const Op *op = &as->code[expr]; op->op != OP_END; op++) {
+		switch(op->op) {
+		case OP_NUMBER:
+			*sp++ = op->value;
+			break;
+		case OP_SYMBOL: {
+			const Symbol *sym = &as->symbols[op->value];
+			if(sym->addr < 0) {
+				error(as, "Invalid Identifier %s in arithmetic expression", as->strings + sym->name);
+				defined = false;
+			}
+			*sp++ = sym->addr;
+		} break;
+		case '+'|0x80:
+		case '-'|0x80:
+		case '~'|0x80:
+			if(defined)
+				sp[-1] = apply_unary_op(as, op->op, sp[-1]);
+			break;
+		default:
+			sp--;
+			if(defined)
+				sp[-1] = apply_binary_op(as, sp[-1], op->op, sp[0]);
+			break;
+		}
 	}
-	return *figures.stack;
-
+	*result = as->values[0];
+	return defined;
 }
 
 static void emit_b(const Stepper * stepper, uint8_t byte, const EMITTED_TYPE type) {
-	if(program.next_instr >= TOTAL_RAM)
-		exit_error("error: program too large\n");
-
-	program.bytes[program.next_instr].linenum = stepper->linenum;
-	program.bytes[program.next_instr].type=type;
+	Assembler *as = stepper->as;
+	if(as->program.next_instr >= TOTAL_RAM)
+		exit_error(as, "program too large");
+
+	uint16_t addr = as->program.next_instr;
+	if(as->has_fixup[addr >> 3] & (1 << (addr & 7))) {
+		for(int i = as->n_fixups - 1; i >= 0; i--)
+			if(as->fixups[i].addr == addr)
+				as->fixups[i].type = CONTINUED;
+		as->has_fixup[addr >> 3] &= ~(1 << (addr & 7));
+	}
 
-	if (type & EXPRESSION_BITMASK)
-		strcpy(program.bytes[program.next_instr].expression, stepper->token);
+	if (type & EXPRESSION_BITMASK) {
+		as->fixups = reserve(as, as->fixups, &as->fixups_size, as->n_fixups + 1, sizeof *as->fixups);
+		as->fixups[as->n_fixups].addr = addr;
+		as->fixups[as->n_fixups].type = type;
+		as->fixups[as->n_fixups].linenum = stepper->linenum;
+		as->fixups[as->n_fixups].column = column(stepper);
+		as->fixups[as->n_fixups].file = NULL;
+		as->fixups[as->n_fixups++].expr = stepper->expr >= 0 ? stepper->expr : compile_expression(as, stepper->token);
+		as->has_fixup[addr >> 3] |= 1 << (addr & 7);
+	}
 
-	program.bytes[program.next_instr++].byte = byte;
-	if(program.next_instr > program.max_instr)
-		program.max_instr = program.next_instr;
+	as->src_line[addr] = stepper->linenum;
+	as->src_file[addr] = stepper->file;
+	as->program.bytes[as->program.next_instr++] = byte;
+	if(as->program.next_instr > as->program.max_instr)
+		as->program.max_instr = as->program.next_instr;
 }
 
 static void emit(const Stepper * stepper, const Emitted emitted){
 	if (emitted.type == CONTINUED)
-		exit_error("Continued is reserved\n");
+		exit_error(stepper->as, "Continued is reserved");
 	else if (emitted.type & EMIT8_BITMASK) {
 		emit_b(stepper, emitted.value & 0xff, emitted.type);
 	} else {
@@ -579,36 +967,52 @@ static inline void emit_e(const Stepper * stepper, uint16_t word, size_t nibble_
 	emit(stepper, e);
 }
 
-static void add_label(const char *label, const int linenum) {
-	if(n_lookup == MAX_LOOKUP)
-		exit_error("error: too many entries in lookup\n");
-	for(int i = 0; i < n_lookup; i++)
-		if(!strcmp(lookup[i].label, label))
-			exit_error("error:%d: duplicate label '%s'\n", linenum, label);
-	strcpy(lookup[n_lookup].label, label);
-	lookup[n_lookup].addr = program.next_instr;
-	n_lookup++;
+static int add_label(Assembler *as, const char *label) {
+	Symbol *sym = find_symbol(as, label, 1);
+	if(sym->addr >= 0)
+		exit_error(as, "duplicate label '%s'", label);
+	sym->addr = as->program.next_instr;
+	return sym->name;
 }
 
 static void add_definition(const Stepper * stepper, char *name) {
-	if(n_defs == MAX_DEFS)
-		exit_error("error:%d: too many definitions\n", stepper->linenum);
-	strcpy(defs[n_defs].name, name);
-	defs[n_defs].type = stepper->sym;
-	strcpy(defs[n_defs].value,stepper->token);
-	n_defs++;
+	Assembler *as = stepper->as;
+	Symbol *sym = find_symbol(as, name, 1);
+	if(sym->defined)
+		return;
+	int value = intern(as, stepper->token);
+	sym->defined = 1;
+	sym->type = stepper->sym;
+	sym->value = value;
+	sym->expr = stepper->expr;
+}
+
+/* Makes the expression `text` the current symbol; the token only
+keeps as much of it as fits, for error messages */
+static void number(Stepper *stepper, char *text) {
+	stepper->sym = SYM_NUMBER;
+	stepper->expr = compile_expression(stepper->as, text);
+	int len = strlen(text);
+	if(len >= TOK_SIZE)
+		len = TOK_SIZE - 1;
+	memcpy(stepper->token, text, len);
+	stepper->token[len] = '\0';
 }
 
 static int nextsym(Stepper * stepper) {
+	Assembler *as = stepper->as;
 	char *tok = stepper->token;
 
 	stepper->sym = SYM_END;
+	stepper->expr = -1;
 	*tok = '\0';
 
 scan_start:
 	while(isspace(*stepper->in)) {
-		if(*stepper->in == '\n')
+		if(*stepper->in == '\n') {
 			stepper->linenum++;
+			stepper->line = stepper->in + 1;
+		}
 		stepper->in++;
 	}
 
@@ -626,78 +1030,41 @@ scan_start:
 		while(isalnum(*stepper->in) || *stepper->in == '_') {
 			*tok++ = tolower(*stepper->in++);
 			if(tok - stepper->token >= TOK_SIZE) {
-				exit_error("error:%d: token too long (max:%d).\n", stepper->linenum, TOK_SIZE-1);
+				exit_error(as, "token too long (max:%d).", TOK_SIZE-1);
 			}
 		}
 		*tok = '\0';
-		if(bsearch(stepper->token, inst_names,  (sizeof inst_names)/(sizeof inst_names[0]), sizeof inst_names[0], inst_cmp)) {
-			stepper->sym = SYM_INSTRUCTION;
-		} else if(stepper->sym != SYM_INSTRUCTION) {
-			if(stepper->token[0] == 'v' && isxdigit(stepper->token[1]) && !stepper->token[2])
-				stepper->sym = SYM_REGISTER;
-			else if(!strcmp(stepper->token, "i"))
-				stepper->sym = SYM_I;
-			else if(!strcmp(stepper->token, "dt"))
-				stepper->sym = SYM_DT;
-			else if(!strcmp(stepper->token, "st"))
-				stepper->sym = SYM_ST;
-			else if(!strcmp(stepper->token, "k"))
-				stepper->sym = SYM_K;
-			else if(!strcmp(stepper->token, "f"))
-				stepper->sym = SYM_F;
-			else if(!strcmp(stepper->token, "b"))
-				stepper->sym = SYM_B;
-			else if(!strcmp(stepper->token, "hf"))
-				stepper->sym = SYM_HF;
-			else if(!strcmp(stepper->token, "r"))
-				stepper->sym = SYM_R;
-			else if(!strcmp(stepper->token, "define"))
-				stepper->sym = SYM_DEFINE;
-			else if(!strcmp(stepper->token, "offset"))
-				stepper->sym = SYM_OFFSET;
-			else if(!strcmp(stepper->token, "db"))
-				stepper->sym = SYM_DB;
-			else if(!strcmp(stepper->token, "dw"))
-				stepper->sym = SYM_DW;
-			else if(!strcmp(stepper->token, "text"))
-				stepper->sym = SYM_TEXT;
-			else if(!strcmp(stepper->token, "include"))
-				stepper->sym = SYM_INCLUDE;
-			else {
-				if (is_arith(*stepper->in)){
-					char arith_exp[64];
-					copy_arithmetic_expression(arith_exp, &stepper->in);
-					strcat (stepper->token,arith_exp);
-					stepper->sym=SYM_NUMBER;
-
-				} else {
-					stepper->sym = SYM_IDENTIFIER;
-					for(int i = 0; i < n_defs; i++) {
-						if(!strcmp(defs[i].name, stepper->token)) {
-							stepper->sym = defs[i].type;
-							strcpy(stepper->token, defs[i].value);
-							break;
-						}
-					}
-				}
-
-			}
+		unsigned slot = hash_keyword(stepper->token, tok - stepper->token);
+		if(keywords[slot].name && !strcmp(keywords[slot].name, stepper->token)) {
+			stepper->sym = keywords[slot].sym;
+			stepper->inst = keywords[slot].inst;
+		} else if(stepper->token[0] == 'v' && isxdigit(stepper->token[1]) && !stepper->token[2]) {
+			stepper->sym = SYM_REGISTER;
+		} else if (is_arith(*stepper->in)){
+			number(stepper, copy_arithmetic_expression(as, stepper->token, &stepper->in));
+		} else {
+			Symbol *def = find_symbol(as, stepper->token, 0);
+			if(def && def->defined) {
+				stepper->sym = def->type;
+				strcpy(stepper->token, as->strings + def->value);
+				stepper->expr = def->expr;
+			} else
+				stepper->sym = SYM_IDENTIFIER;
 		}
 	} else if(is_arith(*stepper->in) ) {
-		copy_arithmetic_expression(stepper->token, &stepper->in);
-		stepper->sym = SYM_NUMBER;
+		number(stepper, copy_arithmetic_expression(as, "", &stepper->in));
 	} else if(*stepper->in == '\"') {
 		stepper->in++;
 		for(;;) {
 			if(!*stepper->in || strchr("\r\n", *stepper->in))
-				exit_error("error:%d: unterminated string literal\n", stepper->linenum);
+				exit_error(as, "unterminated string literal");
 			if(*stepper->in == '\"') break;
 			if(*stepper->in == '\\') {
 				switch(*(++stepper->in)) {
 					case '\r':
 					case '\n':
 					case '\0':
-						exit_error("error:%d: bad escape in string literal\n", stepper->linenum);
+						exit_error(as, "bad escape in string literal");
 					case 'a': *tok++ = '\a'; break;
 					case 'b': *tok++ = '\b'; break;
 					case 'e': *tok++ = 0x1B; break;
@@ -714,7 +1081,7 @@ scan_start:
 				*tok++ = *(stepper->in++);
 
 			if(tok - stepper->token >= TOK_SIZE) {
-				exit_error("error:%d: string too long (max:%d).\n", stepper->linenum, TOK_SIZE-1);
+				exit_error(as, "string too long (max:%d).", TOK_SIZE-1);
 			}
 		}
 		*tok = '\0';
@@ -729,17 +1096,19 @@ scan_start:
 	return stepper->sym;
 }
 
-void expect(Stepper * stepper, int what) {
+static void expect(Stepper * stepper, int what) {
+	Assembler *as = stepper->as;
 	SYMBOL sym = nextsym(stepper);
 	if(sym != what)
-		exit_error("error:%d: '%c' expected (got %d)\n", stepper->linenum, what, sym);
+		exit_error(as, "'%c' expected (got %d)", what, sym);
 	nextsym(stepper);
 }
 
 static int get_register(const Stepper * stepper) {
+	Assembler *as = stepper->as;
 	int reg = stepper->token[1];
 	if(stepper->sym != SYM_REGISTER)
-		exit_error("error:%d: register expected\n", stepper->linenum);
+		exit_error(as, "register expected");
 	assert(isxdigit(reg));
 	if(reg >= 'a') {
 		reg = reg - 'a' + 0xA;
@@ -750,83 +1119,1321 @@ static int get_register(const Stepper * stepper) {
 	return reg;
 }
 
-static int get_num(char *token, size_t nibble_count, const int linenum) {
-	int a = evaluate_arithmetic_expression(token, linenum);
+static int check_range(Assembler *as, int a, size_t nibble_count) {
 	int bound=1<<(4*nibble_count);
-	if(a < -(bound/2) || a > (bound-1)){
-		char format[128];
-		sprintf(format,"error:%%d: number %%d takes more than %zd nibbles (%%0%zdX)\n",nibble_count,nibble_count);
-		exit_error(format, linenum, a, a);
-	}
+	if(a < -(bound/2) || a > (bound-1))
+		exit_error(as, "number %d takes more than %zd nibbles (%0*X)", a, nibble_count, (int)nibble_count, a);
 	return a&(bound-1);
 }
 
+static int get_num(Assembler *as, int expr, size_t nibble_count) {
+	int a;
+	if(!evaluate(as, expr, &a))
+		exit_error(as, NULL);
+	return check_range(as, a, nibble_count);
+}
+
 static int c8_assemble_internal(Stepper *stepper);
 
-int c8_assemble(const char *text) {
+static void unload_include(Include *inc) {
+#if defined(C8_MMAP) && !defined(_WIN32)
+	if(inc->mapped) {
+		munmap(inc->text, inc->mapped);
+		inc->text = NULL;
+		inc->mapped = 0;
+		return;
+	}
+#endif
+	free(inc->text);
+	inc->text = NULL;
+}
 
-	if(c8_verbose) c8_message("Assembling...\n");
+/* Reads the file `inc`. With C8_MMAP it is mapped instead, if its size
+isn't a multiple of the page size so that it is followed by a NUL. */
+static void load_include(Assembler *as, Include *inc) {
+#if defined(C8_MMAP) && !defined(_WIN32)
+	long page = sysconf(_SC_PAGESIZE);
+	if(inc->size > 0 && page > 0 && inc->size % page) {
+		int fd = open(inc->path, O_RDONLY);
+		if(fd >= 0) {
+			void *p = mmap(NULL, inc->size, PROT_READ, MAP_PRIVATE, fd, 0);
+			close(fd);
+			if(p != MAP_FAILED) {
+				inc->text = p;
+				inc->mapped = inc->size;
+				return;
+			}
+		}
+	}
+#endif
+	inc->text = c8_load_txt(inc->path);
+}
 
-	program.max_instr = 0;
+/* Finds the text of the file `name` for an `include` directive.
+Files read with c8_load_txt() are looked up by their canonical path, and
+read again the first time they are included in an assembly if they have
+changed since. The text of other files goes in `included`. */
+static Include *find_include(Assembler *as, const char *name, const char **text) {
+	c8_asm_t *a = as->a;
+	char *path;
+	struct stat st;
+	bool cached = a->include == c8_load_txt;
+
+	if(cached) {
+#ifdef _WIN32
+		path = _fullpath(NULL, name, 0);
+#else
+		path = realpath(name, NULL);
+#endif
+		if(!path || stat(path, &st)) {
+			free(path);
+			exit_error(as, "couldn't read %s", name);
+		}
+	} else if(!(path = strdup(name)))
+		exit_error(as, "out of memory");
+
+	Include *inc = NULL;
+	for(int i = 0; i < as->n_includes && !inc; i++)
+		if(!strcmp(as->includes[i].path, path))
+			inc = &as->includes[i];
+	if(inc) {
+		free(path);
+	} else {
+		as->includes = reserve(as, as->includes, &as->includes_size, as->n_includes + 1, sizeof *as->includes);
+		inc = &as->includes[as->n_includes++];
+		memset(inc, 0, sizeof *inc);
+		inc->path = path;
+	}
 
-	static Stepper theStepper;
-	Stepper *stepper = &theStepper;
+	if(!cached) {
+		char *intext = a->include(name);
+		if(!intext)
+			exit_error(as, "couldn't read %s", name);
+		as->included[as->n_included++] = intext;
+		*text = intext;
+		return inc;
+	}
 
-	stepper->in = text;
-	stepper->linenum = 1;
-	stepper->last = NULL;
+	/* The text can't change while it is being assembled */
+	if(inc->pass != as->pass && (inc->mtime != st.st_mtime || inc->mtime_ns != MTIME_NS(st) || inc->size != (long)st.st_size))
+		unload_include(inc);
+	if(!inc->text) {
+		inc->mtime = st.st_mtime;
+		inc->mtime_ns = MTIME_NS(st);
+		inc->size = st.st_size;
+		load_include(as, inc);
+		if(!inc->text)
+			exit_error(as, "couldn't read %s", name);
+	}
+	*text = inc->text;
+	return inc;
+}
 
-	memset(program.bytes, 0, sizeof program);
-	program.next_instr = 512;
+void c8_asm_init(c8_asm_t *a) {
+	memset(a, 0, sizeof *a);
+	a->include = c8_include_callback;
+}
 
-	n_lookup = 0;
-	n_defs = 0;
+void c8_asm_free(c8_asm_t *a) {
+	Assembler *as = a->state;
+	if(as) {
+		free(as->fixups);
+		free(as->symbols);
+		free(as->table);
+		free(as->strings);
+		free(as->code);
+		free(as->operators);
+		free(as->values);
+		free(as->arith_text);
+		free(as->ids);
+		for(int i = 0; i < as->n_includes; i++) {
+			free(as->includes[i].path);
+			unload_include(&as->includes[i]);
+		}
+		free(as->includes);
+		free(as);
+	}
+	free(a->diags);
+	a->state = NULL;
+	a->diags = NULL;
+	a->ndiags = a->diags_size = 0;
+}
 
-	int r = c8_assemble_internal(stepper);
-	if(r)
-		return r;
+/* Gets `a` ready for a new program; returns NULL if out of memory */
+static Assembler *begin(c8_asm_t *a) {
+	a->ndiags = 0;
+	if(!a->state && !(a->state = calloc(1, sizeof *a->state))) {
+		c8_diag_t *d = realloc(a->diags, sizeof *d);
+		if(d) {
+			d->line = d->column = 0;
+			d->file = NULL;
+			strcpy(d->message, "out of memory");
+			a->diags = d;
+			a->ndiags = a->diags_size = 1;
+		}
+		return NULL;
+	}
+	Assembler *as = a->state;
+	as->a = a;
+
+	memset(as->program.bytes, 0, as->program.max_instr + 1);
+	memset(as->src_line, 0, as->program.max_instr * sizeof *as->src_line);
+	as->program.max_instr = 0;
+	as->program.next_instr = 512;
+
+	as->n_fixups = 0;
+	memset(as->has_fixup, 0, sizeof as->has_fixup);
+	memset(as->is_instr, 0, sizeof as->is_instr);
+	as->moved = false;
+	as->exported = false;
+	as->assembled = false;
+
+	clear_symbols(as);
+	as->n_included = 0;
+	as->pass++;
+	as->stepper = NULL;
+	as->file = NULL;
+	return as;
+}
 
-	if(c8_verbose)
-		c8_message("Resolving labels...\n");
+/* Fills in the values of the fixups */
+static void resolve(Assembler *as) {
+	/* All the undefined labels are reported before giving up */
+	int undefined = 0;
+	for(int i = 0; i < as->n_fixups; i++) {
+		const Fixup *f = &as->fixups[i];
+		int result;
+		if(f->type == CONTINUED || f->addr < PROG_OFFSET)
+			continue;
+		as->linenum = f->linenum;
+		as->column = f->column;
+		as->file = f->file;
+		if(!evaluate(as, f->expr, &result)) {
+			undefined++;
+			continue;
+		}
+		result = check_range(as, result, (f->type & BITNESS_BITMASK)+1);
+		if (f->type & EMIT8_BITMASK) {
+			as->program.bytes[f->addr] |= result &0xff;
+		} else {
+			as->program.bytes[f->addr] |= result >> 8;
+			as->program.bytes[f->addr+1] |= result & 0xff;
+		}
+	}
+	if(undefined)
+		exit_error(as, NULL);
+	as->linenum = as->column = 0;
+	as->file = NULL;
+}
 
-	size_t n = PROG_OFFSET;
-	bool success=false;
-	for(int i = PROG_OFFSET; i < program.max_instr; i++) {
-		uint16_t result=0;
-		if(program.bytes[i].type & EXPRESSION_BITMASK) {
-			result = get_num(program.bytes[i].expression, (program.bytes[i].type & BITNESS_BITMASK)+1,program.bytes[i].linenum);
+/* The number of bytes from PROG_OFFSET that make up the program */
+static int program_length(const Assembler *as) {
+	int n = 0;
+	if(as->program.max_instr > PROG_OFFSET)
+		n = as->program.max_instr - PROG_OFFSET;
+	//Stupid Off by one
+	if (as->program.max_instr >= PROG_OFFSET && as->program.max_instr < TOTAL_RAM && as->program.bytes[as->program.max_instr] != 0)
+		n++;
+	return n;
+}
 
-		}
-		if ((program.bytes[i].type != CONTINUED) && (program.bytes[i].type & EMIT8_BITMASK)) {
-			program.bytes[i].byte |= result &0xff;
+/* The peephole optimizer.
+It works on the emitted bytes before the labels are resolved, so the
+opcodes are known but not the operands that come from expressions.
+Instructions are only removed if nothing can refer to their addresses:
+the program mustn't use `offset`, and addresses must only be given as
+plain labels. Those that follow a skip are left alone, since a skip
+has to skip the same thing after the optimization. In an object file
+the `global` labels may be used by another unit in any way, so they are
+all treated as data references. */
+enum {
+	OPT_LABEL = 1,     /* A label points at the byte */
+	OPT_DATA_REF = 2,  /* ...and is used other than as a jump target */
+	OPT_FIXED = 4,     /* The byte follows such a label, so it mustn't move */
+	OPT_DEAD = 8,      /* The byte is removed */
+};
+
+#define MAX_JUMP_THREADING  16
+#define MAX_OPT_PASSES      8
+
+static bool is_instr(const Assembler *as, int addr) {
+	return addr >= PROG_OFFSET && addr < TOTAL_RAM && (as->is_instr[addr >> 3] & (1 << (addr & 7)));
+}
+
+static bool is_plain_symbol(const Assembler *as, int expr) {
+	return as->code[expr].op == OP_SYMBOL && as->code[expr + 1].op == OP_END;
+}
+
+static bool is_number(const Assembler *as, int expr) {
+	return as->code[expr].op == OP_NUMBER && as->code[expr + 1].op == OP_END;
+}
+
+/* The expression of the instruction at `addr`, or -1 if it has none */
+static int operand(const Assembler *as, int addr) {
+	int f = as->fixup_at[addr];
+	return f < 0 ? -1 : as->fixups[f].expr;
+}
+
+static bool follows_skip(const Assembler *as, int addr) {
+	if(!is_instr(as, addr - 2))
+		return false;
+	switch(as->program.bytes[addr - 2] >> 4) {
+	case 0x3: case 0x4: case 0x5: case 0x9: case 0xE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool is_unconditional(const Assembler *as, int addr) {
+	const uint8_t *b = &as->program.bytes[addr];
+	if((b[0] >> 4) == 0x1 || (b[0] >> 4) == 0xB)
+		return true;
+	return as->fixup_at[addr] < 0 && b[0] == 0x00 && (b[1] == 0xEE || b[1] == 0xFD);
+}
+
+/* Builds the maps of the program. Returns false if instructions can't
+be removed. */
+/* Marks the label at `addr` as used as data, and the bytes after it as fixed */
+static void fix_label(Assembler *as, int addr) {
+	as->opt_flags[addr] |= OPT_DATA_REF;
+	do
+		as->opt_flags[addr++] |= OPT_FIXED;
+	while(addr < as->program.max_instr && !(as->opt_flags[addr] & OPT_LABEL));
+}
+
+static bool map_program(Assembler *as) {
+	bool movable = !as->moved;
+	memset(as->opt_flags, 0, sizeof as->opt_flags);
+	for(int i = 0; i < TOTAL_RAM; i++)
+		as->fixup_at[i] = -1;
+
+	for(int i = 0; i < as->n_symbols; i++)
+		if(as->symbols[i].addr >= 0 && as->symbols[i].addr < TOTAL_RAM)
+			as->opt_flags[as->symbols[i].addr] |= OPT_LABEL;
+	if(as->exported)
+		for(int i = 0; i < as->n_symbols; i++)
+			if(as->symbols[i].global && as->symbols[i].addr >= 0 && as->symbols[i].addr < TOTAL_RAM)
+				fix_label(as, as->symbols[i].addr);
+
+	for(int i = 0; i < as->n_fixups; i++) {
+		const Fixup *f = &as->fixups[i];
+		if(f->type == CONTINUED)
+			continue;
+		as->fixup_at[f->addr] = i;
+		uint8_t op = as->program.bytes[f->addr] >> 4;
+		bool address = (f->type & BITNESS_BITMASK) >= 2;
+		bool jump = is_instr(as, f->addr) && (op == 0x1 || op == 0x2);
+		if(is_plain_symbol(as, f->expr)) {
+			/* `ld i`, `jp v0` and data may use the bytes after the label
+			as a table, or even modify the code there */
+			int addr = as->symbols[as->code[f->expr].value].addr;
+			if(addr < 0 || jump)
+				continue;
+			fix_label(as, addr);
+		} else if(address) {
+			movable = false;
 		} else {
-			program.bytes[i].byte |= result >> 8;
-			program.bytes[i+1].byte |= result & 0xff;
+			for(const Op *o = &as->code[f->expr]; o->op != OP_END; o++)
+				if(o->op == OP_SYMBOL)
+					movable = false;
 		}
+	}
+	return movable;
+}
 
-		if(c8_verbose > 1) {
+static bool same_operand(const Assembler *as, int a, int b) {
+	return a == b || (as->code[a].op == as->code[b].op && as->code[a].value == as->code[b].value
+		&& as->code[a + 1].op == OP_END && as->code[b + 1].op == OP_END);
+}
+
+/* Points jumps and calls to jumps at the final destination */
+static bool thread_jump(Assembler *as, int addr) {
+	uint8_t op = as->program.bytes[addr] >> 4;
+	int expr = operand(as, addr);
+	if((op != 0x1 && op != 0x2) || expr < 0 || !is_plain_symbol(as, expr))
+		return false;
+	int target = expr;
+	for(int n = 0; n < MAX_JUMP_THREADING && is_plain_symbol(as, target); n++) {
+		int dest = as->symbols[as->code[target].value].addr, next;
+		if(dest < 0 || dest == addr || !is_instr(as, dest) || (as->opt_flags[dest] & OPT_DATA_REF)
+				|| (as->program.bytes[dest] >> 4) != 0x1 || (next = operand(as, dest)) < 0
+				|| !(is_plain_symbol(as, next) || is_number(as, next)))
+			break;
+		target = next;
+	}
+	if(same_operand(as, target, expr))
+		return false;
+	as->fixups[as->fixup_at[addr]].expr = target;
+	return true;
+}
+
+static void remove_instr(Assembler *as, int addr) {
+	as->opt_flags[addr] |= OPT_DEAD;
+	as->opt_flags[addr + 1] |= OPT_DEAD;
+}
+
+/* `call x` followed by `ret` becomes `jp x` */
+static bool tail_call(Assembler *as, int addr, bool movable) {
+	int next = addr + 2;
+	if((as->program.bytes[addr] >> 4) != 0x2 || operand(as, addr) < 0 || follows_skip(as, addr)
+			|| !is_instr(as, next) || (as->opt_flags[next] & (OPT_LABEL | OPT_FIXED | OPT_DEAD))
+			|| as->fixup_at[next] >= 0 || as->program.bytes[next] != 0x00 || as->program.bytes[next + 1] != 0xEE)
+		return false;
+	as->program.bytes[addr] = 0x10 | (as->program.bytes[addr] & 0x0F);
+	/* Otherwise the `ret` is left behind, where it is never reached */
+	if(movable)
+		remove_instr(as, next);
+	return true;
+}
+
+/* `ld Vx, a` followed by `add Vx, b` becomes `ld Vx, a+b` */
+static bool fold_add(Assembler *as, int addr) {
+	int next = addr + 2;
+	int a = operand(as, addr), b;
+	if((as->program.bytes[addr] >> 4) != 0x6 || a < 0 || !is_number(as, a) || follows_skip(as, addr)
+			|| !is_instr(as, next) || (as->opt_flags[next] & (OPT_LABEL | OPT_FIXED | OPT_DEAD))
+			|| as->program.bytes[next] != (0x70 | (as->program.bytes[addr] & 0x0F))
+			|| (b = operand(as, next)) < 0 || !is_number(as, b))
+		return false;
+	int x = as->code[a].value, y = as->code[b].value;
+	if(x < -128 || x > 0xFF || y < -128 || y > 0xFF)
+		return false;
+	Compiler c = {as, as->n_code, 0};
+	compile_value(&c, OP_NUMBER, (x + y) & 0xFF);
+	compile_op(&c, OP_END, 0);
+	as->fixups[as->fixup_at[addr]].expr = c.start;
+	remove_instr(as, next);
+	return true;
+}
+
+/* Removes the instructions after an unconditional jump that no label
+points at */
+static bool remove_unreachable(Assembler *as, int addr) {
+	if(!is_unconditional(as, addr) || follows_skip(as, addr) || (as->opt_flags[addr] & OPT_DEAD))
+		return false;
+	bool removed = false;
+	for(int next = addr + 2; is_instr(as, next) && !(as->opt_flags[next] & (OPT_LABEL | OPT_FIXED)); next += 2) {
+		if(!(as->opt_flags[next] & OPT_DEAD)) {
+			remove_instr(as, next);
+			removed = true;
+		}
+	}
+	return removed;
+}
+
+/* Closes the gaps left by the removed instructions */
+static void compact(Assembler *as) {
+	uint8_t instrs[TOTAL_RAM/8] = {0};
+	int to = PROG_OFFSET;
+	for(int from = PROG_OFFSET; from <= as->program.max_instr; from++) {
+		as->new_addr[from] = to;
+		if(from < as->program.max_instr && !(as->opt_flags[from] & OPT_DEAD)) {
+			if(is_instr(as, from))
+				instrs[to >> 3] |= 1 << (to & 7);
+			as->src_line[to] = as->src_line[from];
+			as->src_file[to] = as->src_file[from];
+			as->program.bytes[to++] = as->program.bytes[from];
+		}
+	}
+	memset(as->program.bytes + to, 0, as->program.max_instr + 1 - to);
+	memset(as->src_line + to, 0, (as->program.max_instr - to) * sizeof *as->src_line);
+	memcpy(as->is_instr, instrs, sizeof instrs);
+
+	for(int i = 0; i < as->n_symbols; i++)
+		if(as->symbols[i].addr >= PROG_OFFSET && as->symbols[i].addr <= as->program.max_instr)
+			as->symbols[i].addr = as->new_addr[as->symbols[i].addr];
+	for(int i = 0; i < as->n_fixups; i++) {
+		Fixup *f = &as->fixups[i];
+		if(f->type == CONTINUED)
+			continue;
+		if(as->opt_flags[f->addr] & OPT_DEAD)
+			f->type = CONTINUED;
+		else
+			f->addr = as->new_addr[f->addr];
+	}
+	as->program.next_instr = as->new_addr[as->program.next_instr];
+	as->program.max_instr = to;
+}
+
+static void optimize(Assembler *as) {
+	int size = as->program.max_instr;
+	bool changed = true;
+	for(int pass = 0; changed && pass < MAX_OPT_PASSES; pass++) {
+		bool movable = map_program(as), removed = false;
+		changed = false;
+		for(int addr = PROG_OFFSET; addr < as->program.max_instr; addr++) {
+			if(!is_instr(as, addr) || (as->opt_flags[addr] & OPT_DEAD))
+				continue;
+			changed |= thread_jump(as, addr);
+			changed |= tail_call(as, addr, movable);
+			if(movable) {
+				removed |= fold_add(as, addr);
+				removed |= remove_unreachable(as, addr);
+			}
+		}
+		if(removed || (changed && movable)) {
+			compact(as);
+			changed = true;
+		}
+	}
+	if(as->a->verbose)
+		c8_message("Optimized; %d bytes saved.\n", size - as->program.max_instr);
+}
+
+/* Copies the program to `out` and writes the listing */
+static int output(Assembler *as, uint8_t *out, size_t size) {
+	c8_asm_t *a = as->a;
+	size_t n = program_length(as);
+	if(n > size)
+		exit_error(as, "program too large for the output buffer");
+	memcpy(out, as->program.bytes + PROG_OFFSET, n);
+
+	bool success=false;
+	if(a->verbose > 1) {
+		for(int i = PROG_OFFSET; i < as->program.max_instr; i++) {
 			if(!(i & 0x01))
-				c8_message("%03X: %02X", i, program.bytes[i].byte);
+				c8_write(a->listing, "%03X: %02X", i, as->program.bytes[i]);
 			else
-				c8_message("%02X\n", program.bytes[i].byte);
+				c8_write(a->listing, "%02X\n", as->program.bytes[i]);
 		}
+		if(success)
+			c8_write(a->listing, "\n");
+		c8_writer_flush(a->listing);
+	}
+	return n;
+}
+
+int c8_assemble_r(c8_asm_t *a, const char *text, uint8_t *out, size_t size) {
 
-		c8_set(n++, program.bytes[i].byte);
+	Assembler *as = begin(a);
+	if(!as)
+		return -1;
+
+	if(a->verbose) c8_message("Assembling...\n");
+
+	Stepper stepper = {.as = as, .in = text, .line = text, .linenum = 1};
+
+	if(setjmp(as->on_error)) {
+		while(as->n_included > 0)
+			free(as->included[--as->n_included]);
+		return -1;
 	}
-	//Stupid Off by one
-	if (program.max_instr < TOTAL_RAM && program.bytes[program.max_instr].byte != 0){
-		c8_set(n++, program.bytes[program.max_instr].byte);
+
+	c8_assemble_internal(&stepper);
+	as->stepper = NULL;
+
+	if(a->optimize)
+		optimize(as);
+
+	if(a->verbose)
+		c8_message("Resolving labels...\n");
+
+	resolve(as);
+	int n = output(as, out, size);
+
+	if(a->verbose) c8_message("Assembled; %d bytes.\n", as->program.max_instr - PROG_OFFSET);
+
+	as->assembled = true;
+	return n;
+}
+
+/* Analysis of the assembled program, on the control flow graph that
+the disassembler finds in it */
+typedef struct {
+	int addr;
+	int sym;
+} Label;
+
+typedef struct {
+	Assembler *as;
+	c8_cfg_t *cfg;
+	c8_writer_t *out;
+	Label *labels;  /* Sorted by address */
+	int nlabels;
+	int *longest;   /* The longest path from each block, or one of: */
+	bool *loops;    /* Whether that path goes through a loop */
+	bool *exits;    /* Whether it gets to the end of the subroutine */
+	int *depth;     /* The length of the path to each block being followed */
+	int *cycle;     /* The longest loop back to each block being followed */
+	int *extra;     /* The length of the loop at each block in the last pass */
+	bool *visited;
+	int *stack;
+} Analysis;
+
+#define MAX_LOCATION  64
+
+#define PATH_UNKNOWN  -2
+#define PATH_WORKING  -1
+
+/* Loops nested deeper than this are counted once in the loops around them */
+#define MAX_PATH_PASSES  8
+
+static int compare_labels(const void *a, const void *b) {
+	const Label *x = a, *y = b;
+	return x->addr != y->addr ? x->addr - y->addr : x->sym - y->sym;
+}
+
+static uint16_t opcode_at(const Assembler *as, int addr) {
+	return (as->program.bytes[addr] << 8) | as->program.bytes[addr + 1];
+}
+
+static bool opcode_is_skip(uint16_t op) {
+	return (op & 0xF000) == 0x3000 || (op & 0xF000) == 0x4000
+		|| (op & 0xF00F) == 0x5000 || (op & 0xF00F) == 0x9000
+		|| (op & 0xF0FF) == 0xE09E || (op & 0xF0FF) == 0xE0A1;
+}
+
+/* Formats `addr` with its place relative to the label before it */
+static const char *location(const Analysis *an, int addr, char *buf, size_t size) {
+	int lo = 0, hi = an->nlabels - 1, found = -1;
+	while(lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if(an->labels[mid].addr <= addr) {
+			found = mid;
+			lo = mid + 1;
+		} else
+			hi = mid - 1;
+	}
+	while(found > 0 && an->labels[found - 1].addr == an->labels[found].addr)
+		found--;
+	if(found < 0)
+		snprintf(buf, size, "%03X", addr);
+	else if(an->labels[found].addr == addr)
+		snprintf(buf, size, "%03X  %s", addr, an->as->strings + an->as->symbols[an->labels[found].sym].name);
+	else
+		snprintf(buf, size, "%03X  %s+%d", addr, an->as->strings + an->as->symbols[an->labels[found].sym].name,
+			addr - an->labels[found].addr);
+	return buf;
+}
+
+/* The number of instructions on the longest path from `block` to the
+end of its subroutine, going once around each loop before the pass that
+leaves it. `depth` is the number of instructions on the path so far, so
+that a jump back to a block on the path can add the length of the loop
+to the block it goes back to; the loops inside that loop add the lengths
+`extra` found for them in the previous pass. `*exits` is set if the path gets to the end
+of the subroutine; a loop that never does, such as a game's main loop, is
+only counted once */
+static int longest_path(Analysis *an, int block, int depth, bool *loop, bool *exits) {
+	const c8_cfg_t *cfg = an->cfg;
+	if(an->longest[block] == PATH_WORKING) {
+		int cycle = depth - an->depth[block] - an->extra[block];
+		if(cycle > an->cycle[block])
+			an->cycle[block] = cycle;
+		*loop = true;
+		*exits = false;
+		return 0;
+	}
+	if(an->longest[block] >= 0) {
+		*loop |= an->loops[block];
+		*exits = an->exits[block];
+		return an->longest[block];
+	}
+	an->longest[block] = PATH_WORKING;
+	an->depth[block] = depth;
+	an->cycle[block] = 0;
+
+	const c8_block_t *b = &cfg->blocks[block];
+	int size = (b->end - b->start) / 2, inner = depth + size + an->extra[block];
+	int best = 0, best_exit = -1;
+	bool loops = false, leaf = true;
+	for(int i = 0; i < cfg->nedges; i++) {
+		const c8_edge_t *e = &cfg->edges[i];
+		if(e->from != block || e->kind == C8_EDGE_RETURN)
+			continue;
+		bool out;
+		int n = longest_path(an, e->to, inner, &loops, &out);
+		if(e->kind == C8_EDGE_CALL) {
+			int next = c8_cfg_block(cfg, b->end);
+			if(next >= 0 && cfg->blocks[next].start == b->end)
+				n += longest_path(an, next, inner + n, &loops, &out);
+		}
+		leaf = false;
+		if(n > best)
+			best = n;
+		if(out && n > best_exit)
+			best_exit = n;
+	}
+	if(leaf)
+		best_exit = 0;
+	if(best_exit >= 0)
+		an->longest[block] = size + best_exit + an->cycle[block];
+	else
+		an->longest[block] = size + best;
+	an->loops[block] = loops;
+	an->exits[block] = best_exit >= 0;
+	*loop |= loops;
+	*exits = an->exits[block];
+	return an->longest[block];
+}
+
+/* The number of instructions in the subroutine that starts at `entry` */
+static int count_instructions(const Analysis *an, int entry) {
+	const c8_cfg_t *cfg = an->cfg;
+	bool *visited = an->visited;
+	int *stack = an->stack;
+	int sp = 0, count = 0;
+	memset(visited, 0, cfg->nblocks * sizeof *visited);
+	visited[entry] = true;
+	stack[sp++] = entry;
+	while(sp > 0) {
+		int block = stack[--sp];
+		const c8_block_t *b = &cfg->blocks[block];
+		count += (b->end - b->start) / 2;
+		for(int i = 0; i < cfg->nedges; i++) {
+			const c8_edge_t *e = &cfg->edges[i];
+			int n = e->to;
+			if(e->from != block || e->kind == C8_EDGE_RETURN)
+				continue;
+			if(e->kind == C8_EDGE_CALL) {
+				/* Carry on after the subroutine returns */
+				n = c8_cfg_block(cfg, b->end);
+				if(n < 0 || cfg->blocks[n].start != b->end)
+					continue;
+			}
+			if(!visited[n]) {
+				visited[n] = true;
+				stack[sp++] = n;
+			}
+		}
+	}
+	return count;
+}
+
+static void report_unreachable(Analysis *an) {
+	const Assembler *as = an->as;
+	char buf[MAX_LOCATION];
+	c8_write(an->out, "\nUnreachable code:\n");
+	int n = 0;
+	for(int addr = PROG_OFFSET; addr < as->program.max_instr; ) {
+		int count = 0, start = addr;
+		while(addr < as->program.max_instr && is_instr(as, addr)
+				&& !(an->cfg->reachable[addr >> 3] & (1 << (addr & 7)))) {
+			count++;
+			addr += 2;
+		}
+		if(!count) {
+			addr++;
+			continue;
+		}
+		c8_write(an->out, "  %s to %03X: %d instruction%s\n", location(an, start, buf, sizeof buf),
+			addr - 1, count, count > 1 ? "s" : "");
+		n++;
+	}
+	if(!n)
+		c8_write(an->out, "  none\n");
+}
+
+static void report_skips(Analysis *an) {
+	const Assembler *as = an->as;
+	char buf[MAX_LOCATION];
+	c8_write(an->out, "\nSkips:\n");
+	int n = 0;
+	for(int addr = PROG_OFFSET; addr < as->program.max_instr; addr++) {
+		if(!is_instr(as, addr))
+			continue;
+		uint16_t op = opcode_at(as, addr);
+		if(!opcode_is_skip(op))
+			continue;
+		const char *why = NULL;
+		uint16_t next = is_instr(as, addr + 2) ? opcode_at(as, addr + 2) : 0;
+		if((op & 0xF00F) == 0x5000 && ((op >> 8) & 0xF) == ((op >> 4) & 0xF))
+			why = "always skips";
+		else if((op & 0xF00F) == 0x9000 && ((op >> 8) & 0xF) == ((op >> 4) & 0xF))
+			why = "never skips";
+		else if((next & 0xF000) == 0x1000 && (next & 0xFFF) == addr + 4)
+			why = "skips a jump to the instruction after it";
+		else if((next & 0xF000) == 0x1000 && (next & 0xFFF) == addr + 6
+				&& is_instr(as, addr + 4) && !(an->cfg->labels[(addr + 2) >> 3] & (1 << ((addr + 2) & 7))))
+			why = "skips a jump over one instruction; the opposite skip would do";
+		if(!why)
+			continue;
+		c8_write(an->out, "  %s: %s\n", location(an, addr, buf, sizeof buf), why);
+		n++;
+	}
+	if(!n)
+		c8_write(an->out, "  none\n");
+}
+
+/* Follows the paths of every subroutine until the lengths of the loops
+inside other loops stop changing, one more level of nesting per pass */
+static void measure_paths(Analysis *an) {
+	const c8_cfg_t *cfg = an->cfg;
+	bool changed = true;
+	for(int pass = 0; changed && pass < MAX_PATH_PASSES; pass++) {
+		for(int i = 0; i < cfg->nblocks; i++)
+			an->longest[i] = PATH_UNKNOWN;
+		for(int i = 0; i < cfg->nfuncs; i++) {
+			bool loop = false, exits;
+			longest_path(an, cfg->funcs[i].block, 0, &loop, &exits);
+		}
+		changed = false;
+		for(int i = 0; i < cfg->nblocks; i++) {
+			int extra = an->longest[i] >= 0 && an->exits[i] ? an->cycle[i] : 0;
+			if(extra != an->extra[i]) {
+				an->extra[i] = extra;
+				changed = true;
+			}
+		}
+	}
+}
+
+static void report_subroutines(Analysis *an, int speed) {
+	const c8_cfg_t *cfg = an->cfg;
+	char buf[MAX_LOCATION];
+	int per_frame = speed >= 60 ? speed / 60 : 1;
+	c8_write(an->out, "\nSubroutines, at %d instructions per second (%d per frame):\n", speed, per_frame);
+	c8_write(an->out, "  %-24s %12s %12s %7s\n", "entry", "instructions", "longest path", "frames");
+	measure_paths(an);
+	for(int i = 0; i < cfg->nfuncs; i++) {
+		const c8_func_t *f = &cfg->funcs[i];
+		bool loop = false, exits;
+		int path = longest_path(an, f->block, 0, &loop, &exits);
+		c8_write(an->out, "  %-24s %12d %11d%c %7.2f\n", location(an, f->entry, buf, sizeof buf),
+			count_instructions(an, f->block), path, loop ? '+' : ' ', (double)path / per_frame);
+	}
+	c8_write(an->out, "  (+: the path goes once around a loop before leaving it, or once around\n"
+		"  a loop that it never leaves)\n");
+}
+
+static void report_labels(Analysis *an) {
+	const Assembler *as = an->as;
+	char buf[MAX_LOCATION];
+	c8_write(an->out, "\nLabels:\n");
+	c8_write(an->out, "  %-24s %6s %12s %10s\n", "label", "bytes", "instructions", "reachable");
+	for(int i = 0; i < an->nlabels; i++) {
+		int start = an->labels[i].addr, end = as->program.max_instr;
+		for(int j = i + 1; j < an->nlabels; j++)
+			if(an->labels[j].addr > start) {
+				end = an->labels[j].addr;
+				break;
+			}
+		int count = 0, reachable = 0;
+		for(int addr = start; addr < end; addr++) {
+			if(!is_instr(as, addr))
+				continue;
+			count++;
+			if(an->cfg->reachable[addr >> 3] & (1 << (addr & 7)))
+				reachable++;
+		}
+		c8_write(an->out, "  %-24s %6d %12d %10d\n", location(an, start, buf, sizeof buf), end - start, count, reachable);
+	}
+}
+
+static void free_analysis(Analysis *an) {
+	free(an->labels);
+	free(an->longest);
+	free(an->loops);
+	free(an->exits);
+	free(an->depth);
+	free(an->cycle);
+	free(an->extra);
+	free(an->visited);
+	free(an->stack);
+	c8_cfg_free(an->cfg);
+}
+
+int c8_asm_analyze(c8_asm_t *a, int speed, c8_writer_t *out) {
+	Assembler *as = a->state;
+	if(!as || !as->assembled)
+		return -1;
+	a->ndiags = 0;
+
+	c8_disasm_t d;
+	c8_disasm_init(&d, as->program.bytes);
+	c8_cfg_t *cfg = c8_cfg_build_r(&d);
+	c8_disasm_free(&d);
+	if(!cfg) {
+		error(as, "unable to follow the program");
+		return -1;
+	}
+
+	Analysis an = {.as = as, .cfg = cfg, .out = out};
+	int n = cfg->nblocks + 1;
+	an.labels = malloc((as->n_symbols + 1) * sizeof *an.labels);
+	an.longest = malloc(n * sizeof *an.longest);
+	an.loops = malloc(n * sizeof *an.loops);
+	an.exits = malloc(n * sizeof *an.exits);
+	an.depth = malloc(n * sizeof *an.depth);
+	an.cycle = malloc(n * sizeof *an.cycle);
+	an.extra = calloc(n, sizeof *an.extra);
+	an.visited = malloc(n * sizeof *an.visited);
+	an.stack = malloc(n * sizeof *an.stack);
+	if(!an.labels || !an.longest || !an.loops || !an.exits || !an.depth || !an.cycle || !an.extra || !an.visited || !an.stack) {
+		error(as, "out of memory");
+		free_analysis(&an);
+		return -1;
+	}
+	for(int i = 0; i < as->n_symbols; i++)
+		if(as->symbols[i].addr >= PROG_OFFSET) {
+			an.labels[an.nlabels].addr = as->symbols[i].addr;
+			an.labels[an.nlabels++].sym = i;
+		}
+	qsort(an.labels, an.nlabels, sizeof *an.labels, compare_labels);
+
+	int instructions = 0, reachable = 0;
+	for(int addr = PROG_OFFSET; addr < as->program.max_instr; addr++)
+		if(is_instr(as, addr)) {
+			instructions++;
+			if(cfg->reachable[addr >> 3] & (1 << (addr & 7)))
+				reachable++;
+		}
+	c8_write(out, "%d bytes, %d instructions, %d of them reachable\n",
+		as->program.max_instr - PROG_OFFSET, instructions, reachable);
+
+	report_unreachable(&an);
+	report_skips(&an);
+	report_subroutines(&an, speed);
+	report_labels(&an);
+
+	free_analysis(&an);
+	if(!c8_writer_flush(out)) {
+		error(as, "unable to write the analysis");
+		return -1;
+	}
+	return 0;
+}
+
+/* Source maps and listings.
+The source map is written in the format that c8_srcmap_load() reads (see
+chip8.h), with the text given to c8_assemble_r() as file 0 and the included
+files numbered as they are first met. Only the addresses where the line
+changes get an `a` record. */
+int c8_asm_source_map(c8_asm_t *a, const char *name, c8_writer_t *out) {
+	Assembler *as = a->state;
+	if(!as || !as->assembled)
+		return -1;
+	a->ndiags = 0;
+	if(setjmp(as->on_error))
+		return -1;
+
+	/* `ids` maps the files of the steppers to their numbers in the map */
+	as->ids = reserve(as, as->ids, &as->ids_size, as->n_includes + 1, sizeof *as->ids);
+	as->ids[0] = 0;
+	for(int i = 1; i <= as->n_includes; i++)
+		as->ids[i] = -1;
+	int n_files = 1;
+
+	c8_write(out, "%s\nf %s\n", C8_SRCMAP_MAGIC, name);
+	int file = 0, line = 0;
+	for(int addr = 0; addr < as->program.max_instr; addr++) {
+		int l = as->src_line[addr], f = l ? as->src_file[addr] : 0;
+		if(l == line && f == file)
+			continue;
+		line = l;
+		file = f;
+		if(!line) {
+			c8_write(out, "a %03X -\n", addr);
+			continue;
+		}
+		if(as->ids[file] < 0) {
+			as->ids[file] = n_files++;
+			c8_write(out, "f %s\n", as->includes[file - 1].path);
+		}
+		c8_write(out, "a %03X %d %d\n", addr, as->ids[file], line);
+	}
+	if(line)
+		c8_write(out, "a %03X -\n", as->program.max_instr);
+
+	if(!c8_writer_flush(out))
+		exit_error(as, "unable to write the source map");
+	return 0;
+}
+
+#define LISTING_BYTES  4
+
+/* Where the listing is in one of the files */
+typedef struct {
+	const char *text;  /* NULL if the text can't be had */
+	char *loaded;      /* The text, if it had to be read again */
+	int line;
+	const char *at;    /* The start of `line` */
+} ListedFile;
+
+/* Finds line `n` of the file */
+static const char *listed_line(ListedFile *lf, int n) {
+	if(!lf->text)
+		return NULL;
+	if(!lf->at || n < lf->line) {
+		lf->at = lf->text;
+		lf->line = 1;
+	}
+	while(lf->line < n) {
+		const char *nl = strchr(lf->at, '\n');
+		if(!nl)
+			return NULL;
+		lf->at = nl + 1;
+		lf->line++;
+	}
+	return lf->at;
+}
+
+int c8_asm_listing(c8_asm_t *a, const char *name, const char *text, c8_writer_t *out) {
+	Assembler *as = a->state;
+	if(!as || !as->assembled)
+		return -1;
+	a->ndiags = 0;
+
+	ListedFile *files = calloc(as->n_includes + 1, sizeof *files);
+	if(!files) {
+		error(as, "out of memory");
+		return -1;
+	}
+	files[0].text = text;
+	for(int i = 0; i < as->n_includes; i++) {
+		files[i + 1].text = as->includes[i].text;
+		if(!files[i + 1].text && as->includes[i].pass == as->pass && a->include)
+			files[i + 1].text = files[i + 1].loaded = a->include(as->includes[i].path);
+	}
+
+	int file = -1;
+	for(int addr = 0; addr < as->program.max_instr; ) {
+		int line = as->src_line[addr], f = as->src_file[addr];
+		if(!line) {
+			addr++;
+			continue;
+		}
+		if(f != file) {
+			c8_write(out, "%s; %s\n", file < 0 ? "" : "\n", f ? as->includes[f - 1].path : name);
+			file = f;
+		}
+		const char *src = listed_line(&files[f], line);
+		int len = src ? (int)strcspn(src, "\r\n") : 0;
+		/* The bytes of the line, LISTING_BYTES to a row */
+		bool first = true;
+		do {
+			char bytes[3 * LISTING_BYTES + 1] = "";
+			int start = addr, pos = 0;
+			for(int n = 0; n < LISTING_BYTES && addr < as->program.max_instr
+					&& as->src_line[addr] == line && as->src_file[addr] == f; n++, addr++)
+				pos += sprintf(bytes + pos, "%s%02X", n ? " " : "", as->program.bytes[addr]);
+			if(first)
+				c8_write(out, "%03X  %-*s %5d  %.*s\n", start, 3 * LISTING_BYTES - 1, bytes, line, len, src ? src : "");
+			else
+				c8_write(out, "%03X  %s\n", start, bytes);
+			first = false;
+		} while(addr < as->program.max_instr && as->src_line[addr] == line && as->src_file[addr] == f);
 	}
-	if(c8_verbose > 1 && success)
-		c8_message("\n");
 
-	if(c8_verbose) c8_message("Assembled; %d bytes.\n", program.max_instr - PROG_OFFSET);
+	for(int i = 0; i <= as->n_includes; i++)
+		free(files[i].loaded);
+	free(files);
+	if(!c8_writer_flush(out)) {
+		error(as, "unable to write the listing");
+		return -1;
+	}
+	return 0;
+}
+
+/* Object files.
+An object file is text, one record per line, after the OBJECT_MAGIC line:
+
+	b <addr> <bytes>            bytes of the program, in hex, from <addr>
+	s <name> <addr>             a `global` label, exported at <addr>
+	s <name> -                  a label used by this file but not defined in it
+	f <addr> <type> <line> <column> <ops>...
+
+The `f` records are the fixups, with their EMITTED_TYPE in decimal and their
+expression in RPN: `#n` is a number, `@a` the address of a label that is
+local to the file, which moves with it, `$i` the i-th `s` record, `u`
+followed by an operator a unary operator, and the other operators stand for
+themselves. Addresses are in hex, as the file was assembled from PROG_OFFSET. */
+#define OBJECT_MAGIC  "CHIP-8 object 2"
+
+#define OBJECT_LINE_BYTES  32
+
+/* Numbers the symbol `i` in the object file being written */
+static void write_symbol(Assembler *as, c8_writer_t *w, int i, int *n_ids) {
+	const Symbol *sym = &as->symbols[i];
+	as->ids[i] = (*n_ids)++;
+	if(sym->addr >= 0)
+		c8_write(w, "s %s %03X\n", as->strings + sym->name, sym->addr);
+	else
+		c8_write(w, "s %s -\n", as->strings + sym->name);
+}
+
+static void write_object(Assembler *as, c8_writer_t *w) {
+	static const char hex[] = "0123456789ABCDEF";
+	int n = program_length(as);
+
+	c8_write(w, "%s\n", OBJECT_MAGIC);
+	for(int i = 0; i < n; i += OBJECT_LINE_BYTES) {
+		char line[2 * OBJECT_LINE_BYTES + 1];
+		int len = 0;
+		for(int j = i; j < n && j < i + OBJECT_LINE_BYTES; j++) {
+			uint8_t byte = as->program.bytes[PROG_OFFSET + j];
+			line[len++] = hex[byte >> 4];
+			line[len++] = hex[byte & 0xF];
+		}
+		line[len] = '\0';
+		c8_write(w, "b %03X %s\n", PROG_OFFSET + i, line);
+	}
+
+	/* The global labels first, then the labels that other files must
+		define; the other labels are written as addresses */
+	int n_ids = 0;
+	as->ids = reserve(as, as->ids, &as->ids_size, as->n_symbols, sizeof *as->ids);
+	for(int i = 0; i < as->n_symbols; i++) {
+		as->ids[i] = -1;
+		if(as->symbols[i].addr >= 0 && as->symbols[i].global)
+			write_symbol(as, w, i, &n_ids);
+	}
+	for(int i = 0; i < as->n_fixups; i++) {
+		const Fixup *f = &as->fixups[i];
+		if(f->type == CONTINUED || f->addr < PROG_OFFSET)
+			continue;
+		for(const Op *op = &as->code[f->expr]; op->op != OP_END; op++)
+			if(op->op == OP_SYMBOL && as->symbols[op->value].addr < 0 && as->ids[op->value] < 0)
+				write_symbol(as, w, op->value, &n_ids);
+	}
+
+	for(int i = 0; i < as->n_fixups; i++) {
+		const Fixup *f = &as->fixups[i];
+		if(f->type == CONTINUED || f->addr < PROG_OFFSET)
+			continue;
+		c8_write(w, "f %03X %d %d %d", f->addr, f->type, f->linenum, f->column);
+		for(const Op *op = &as->code[f->expr]; op->op != OP_END; op++) {
+			if(op->op == OP_NUMBER)
+				c8_write(w, " #%d", op->value);
+			else if(op->op == OP_SYMBOL && as->ids[op->value] < 0)
+				c8_write(w, " @%03X", as->symbols[op->value].addr);
+			else if(op->op == OP_SYMBOL)
+				c8_write(w, " $%d", as->ids[op->value]);
+			else if(op->op & 0x80)
+				c8_write(w, " u%c", op->op & 0x7F);
+			else
+				c8_write(w, " %c", op->op);
+		}
+		c8_write(w, "\n");
+	}
+
+	if(!c8_writer_flush(w))
+		exit_error(as, "unable to write the object file");
+}
+
+int c8_assemble_object(c8_asm_t *a, const char *text, c8_writer_t *out) {
+
+	Assembler *as = begin(a);
+	if(!as)
+		return -1;
+
+	if(a->verbose) c8_message("Assembling...\n");
+
+	Stepper stepper = {.as = as, .in = text, .line = text, .linenum = 1};
+
+	if(setjmp(as->on_error)) {
+		while(as->n_included > 0)
+			free(as->included[--as->n_included]);
+		return -1;
+	}
+
+	c8_assemble_internal(&stepper);
+	as->stepper = NULL;
+
+	if(a->optimize) {
+		as->exported = true;
+		optimize(as);
+	}
+
+	write_object(as, out);
+
+	if(a->verbose) c8_message("Assembled; %d bytes.\n", as->program.max_instr - PROG_OFFSET);
+
+	return program_length(as);
+}
+
+/* Reads a number from line `line` of an object file */
+static int read_field(Assembler *as, const char **p, int base, int line) {
+	while(**p == ' ')
+		(*p)++;
+	char *end;
+	long value = strtol(*p, &end, base);
+	if(end == *p || (*end && !isspace((unsigned char)*end)))
+		exit_error(as, "malformed object file, line %d", line);
+	*p = end;
+	return value;
+}
+
+/* Reads the object file `text`, placing it at `base`.
+Returns the number of bytes it takes. */
+static int read_object(Assembler *as, const char *text, const char *name, int base) {
+	int delta = base - PROG_OFFSET, size = 0, n_ids = 0, line = 1;
+
+	as->file = name;
+	as->linenum = as->column = 0;
+	if(strncmp(text, OBJECT_MAGIC, strlen(OBJECT_MAGIC)))
+		exit_error(as, "not an object file");
+
+	for(const char *p = strchr(text, '\n'); p; p = strchr(p, '\n')) {
+		p++;
+		line++;
+		switch(*p) {
+		case 'b': {
+			p++;
+			int addr = read_field(as, &p, 16, line);
+			while(*p == ' ')
+				p++;
+			for(; isxdigit((unsigned char)p[0]) && isxdigit((unsigned char)p[1]); p += 2, addr++) {
+				if(addr < PROG_OFFSET || addr + delta >= TOTAL_RAM)
+					exit_error(as, "program too large");
+				char digits[3] = {p[0], p[1], '\0'};
+				as->program.bytes[addr + delta] = strtol(digits, NULL, 16);
+				if(addr - PROG_OFFSET >= size)
+					size = addr - PROG_OFFSET + 1;
+			}
+		} break;
+		case 's': {
+			char label[TOK_SIZE];
+			int len = 0;
+			for(p++; *p == ' '; p++);
+			while(*p && !isspace((unsigned char)*p)) {
+				if(len == TOK_SIZE - 1)
+					exit_error(as, "malformed object file, line %d", line);
+				label[len++] = *p++;
+			}
+			label[len] = '\0';
+			while(*p == ' ')
+				p++;
+			if(!len || !*p)
+				exit_error(as, "malformed object file, line %d", line);
+
+			Symbol *sym = find_symbol(as, label, 1);
+			as->ids = reserve(as, as->ids, &as->ids_size, n_ids + 1, sizeof *as->ids);
+			as->ids[n_ids++] = sym - as->symbols;
+			if(*p != '-') {
+				int addr = read_field(as, &p, 16, line);
+				if(sym->addr >= 0)
+					error(as, "duplicate label '%s'", label);
+				else
+					sym->addr = addr + delta;
+			}
+		} break;
+		case 'f': {
+			p++;
+			Fixup f = {.file = name};
+			int addr = read_field(as, &p, 16, line);
+			f.type = read_field(as, &p, 10, line);
+			f.linenum = read_field(as, &p, 10, line);
+			f.column = read_field(as, &p, 10, line);
+			if((f.type & ~0b1011) != ET_EXP4 || addr < PROG_OFFSET
+					|| addr + delta + !(f.type & EMIT8_BITMASK) >= TOTAL_RAM)
+				exit_error(as, "malformed object file, line %d", line);
+			f.addr = addr + delta;
+
+			Compiler c = {as, as->n_code, 0};
+			for(;;) {
+				while(*p == ' ')
+					p++;
+				if(!*p || *p == '\r' || *p == '\n')
+					break;
+				if(*p == '#') {
+					p++;
+					compile_value(&c, OP_NUMBER, read_field(as, &p, 10, line));
+				} else if(*p == '@') {
+					p++;
+					compile_value(&c, OP_NUMBER, read_field(as, &p, 16, line) + delta);
+				} else if(*p == '$') {
+					p++;
+					int id = read_field(as, &p, 10, line);
+					if(id < 0 || id >= n_ids)
+						exit_error(as, "malformed object file, line %d", line);
+					compile_value(&c, OP_SYMBOL, as->ids[id]);
+				} else if(*p == 'u' && p[1] && strchr("+-~", p[1])) {
+					compile_unary(&c, (unsigned char)p[1] | 0x80);
+					p += 2;
+				} else
+					compile_binary(&c, *p++);
+			}
+			if(c.depth != 1)
+				exit_error(as, "malformed object file, line %d", line);
+			compile_op(&c, OP_END, 0);
+			f.expr = c.start;
+
+			as->fixups = reserve(as, as->fixups, &as->fixups_size, as->n_fixups + 1, sizeof *as->fixups);
+			as->fixups[as->n_fixups++] = f;
+		} break;
+		case '\r':
+		case '\n':
+		case '\0':
+			break;
+		default:
+			exit_error(as, "malformed object file, line %d", line);
+		}
+	}
+
+	if(base + size > as->program.max_instr)
+		as->program.max_instr = base + size;
+	return size;
+}
+
+int c8_link(c8_asm_t *a, const char *const *objects, const char *const *names, int n, uint8_t *out, size_t size) {
+
+	Assembler *as = begin(a);
+	if(!as)
+		return -1;
+
+	if(setjmp(as->on_error))
+		return -1;
+
+	if(a->verbose) c8_message("Linking...\n");
+
+	int base = PROG_OFFSET;
+	for(int i = 0; i < n; i++)
+		base += read_object(as, objects[i], names ? names[i] : NULL, base);
+	if(a->ndiags)
+		exit_error(as, NULL);
+
+	if(a->verbose)
+		c8_message("Resolving labels...\n");
+
+	resolve(as);
+	int len = output(as, out, size);
+
+	if(a->verbose) c8_message("Linked; %d bytes.\n", len);
+
+	return len;
+}
+
+/* Where the listing goes; see c8_assemble_output() */
+static c8_writer_t *listing;
+
+void c8_assemble_output(c8_writer_t *w) {
+	listing = w;
+}
+
+int c8_assemble(const char *text) {
+	static c8_asm_t global;
+	static uint8_t out[TOTAL_RAM - PROG_OFFSET];
+
+	global.include = c8_include_callback;
+	global.verbose = c8_verbose;
+	global.listing = listing;
+
+	int n = c8_assemble_r(&global, text, out, sizeof out);
+	for(int i = 0; i < global.ndiags; i++) {
+		const c8_diag_t *d = &global.diags[i];
+		if(d->line)
+			c8_message("error:%d: %s\n", d->line, d->message);
+		else
+			c8_message("error: %s\n", d->message);
+	}
+	if(n < 0)
+		return 1;
+
+	for(int i = 0; i < n; i++)
+		c8_set(PROG_OFFSET + i, out[i]);
 
 	return 0;
 }
 
 int c8_assemble_internal(Stepper *stepper) {
 
+	Assembler *as = stepper->as;
+	Stepper *outer = as->stepper;
+	as->stepper = stepper;
+	int start;  /* Where the current instruction starts */
+
 	nextsym(stepper);
 	while(stepper->sym != SYM_END) {
 		switch(stepper->sym){
@@ -859,11 +2466,11 @@ int c8_assemble_internal(Stepper *stepper) {
 				already been used, eg. if aaa is already defined as 123
 				then define aaa 456 looks like define 123 456 */
 			if(stepper->sym != SYM_IDENTIFIER)
-				exit_error("error:%d: identifier expected, found %s\n", stepper->linenum, stepper->token);
+				exit_error(as, "identifier expected, found %s", stepper->token);
 			strcpy(name,stepper->token);
 			nextsym(stepper); /*
 			if(stepper->sym != SYM_NUMBER && stepper->sym != SYM_REGISTER)
-				exit_error("error:%d: value expected\n", stepper->linenum);
+				exit_error(as, "value expected");
 			*/
 			add_definition(stepper, name);
 			nextsym(stepper);
@@ -890,8 +2497,9 @@ int c8_assemble_internal(Stepper *stepper) {
 		case SYM_OFFSET:
 			nextsym(stepper);
 			if(stepper->sym != SYM_NUMBER)
-				exit_error("error:%d: offset expected\n", stepper->linenum);
-			program.next_instr = get_num(stepper->token,3,stepper->linenum);
+				exit_error(as, "offset expected");
+			as->program.next_instr = get_num(as, stepper->expr,3);
+			as->moved = true;
 			nextsym(stepper);
 		break;
 		/**
@@ -926,7 +2534,7 @@ int c8_assemble_internal(Stepper *stepper) {
 				if(stepper->sym == SYM_END)
 					break;
 				if(stepper->sym != SYM_NUMBER)
-					exit_error("error:%d: byte value expected\n", stepper->linenum);
+					exit_error(as, "byte value expected");
 				Emitted e={/*
 					.type=ET_IMM8,
 					.value.imm8=get_num(stepper,2),
@@ -953,7 +2561,7 @@ int c8_assemble_internal(Stepper *stepper) {
 				if(stepper->sym == SYM_END)
 					break;
 				if(stepper->sym != SYM_NUMBER && stepper->sym != SYM_IDENTIFIER)
-					exit_error("error:%d: byte value expected\n", stepper->linenum);
+					exit_error(as, "byte value expected");
 				emit_e(stepper,0, 4);
 				nextsym(stepper);
 			} while(stepper->sym == ',');
@@ -970,7 +2578,7 @@ int c8_assemble_internal(Stepper *stepper) {
 		case SYM_TEXT: {
 			nextsym(stepper);
 			if(stepper->sym != SYM_STRING)
-				exit_error("error:%d: string value expected\n", stepper->linenum);
+				exit_error(as, "string value expected");
 			Emitted e = { .type=EMIT8_BITMASK };
 			for(char *c = stepper->token; *c; c++) {
 				e.value = *c;
@@ -987,33 +2595,71 @@ int c8_assemble_internal(Stepper *stepper) {
 		 *
 		 * Assembles file `filename` and adds the results to the output bytecode.
 		 *
+		 * With `include once "filename"` the file is skipped if it has
+		 * already been included in the program, so that a library of
+		 * sprites can be included by every file that uses it.
+		 *
 		 */
 		case SYM_INCLUDE: {
+			bool once = false;
 			nextsym(stepper);
+			if(stepper->sym == SYM_IDENTIFIER && !strcmp(stepper->token, "once")) {
+				once = true;
+				nextsym(stepper);
+			}
 			if(stepper->sym != SYM_STRING)
-				exit_error("error:%d: file name expected\n", stepper->linenum);
+				exit_error(as, "file name expected");
 
-			if(c8_verbose)
+			if(as->a->verbose)
 				c8_message("including '%s'\n", stepper->token);
 
-			if(!c8_include_callback) {
-				exit_error("error:%d: `include` directive disabled\n", stepper->linenum);
+			if(!as->a->include) {
+				exit_error(as, "`include` directive disabled");
 			} else {
-				char *intext = c8_include_callback(stepper->token);
-				if(!intext) {
-					exit_error("error:%d: couldn't read %s\n", stepper->linenum, stepper->token);
+				if(stepper->depth == MAX_INCLUDE_DEPTH)
+					exit_error(as, "includes nested too deeply");
+				int n_included = as->n_included;
+				const char *intext;
+				Include *inc = find_include(as, stepper->token, &intext);
+				if(!once || inc->pass != as->pass) {
+					inc->pass = as->pass;
+					Stepper nextStepper = {.as = as, .in = intext, .line = intext, .linenum = 1, .depth = stepper->depth + 1,
+						.file = 1 + (int)(inc - as->includes)};
+					c8_assemble_internal(&nextStepper);
 				}
-				Stepper nextStepper;
-				nextStepper.in = intext;
-				nextStepper.linenum = 1;
-				nextStepper.last = NULL;
-				c8_assemble_internal(&nextStepper);
 
-				free(intext);
+				if(as->n_included > n_included)
+					free(as->included[--as->n_included]);
 			}
 
 			nextsym(stepper);
 		} break;
+		/**
+		 * ### global
+		 *
+		 * Syntax: `global LABEL`
+		 *
+		 * Makes `LABEL` available to the other units of a program that is
+		 * assembled into object files with `-c` and linked with `c8ld`.
+		 * The other labels of a unit can only be used in that unit, so
+		 * different units can have labels with the same name. A unit uses
+		 * the `global` labels of the others just by referring to them.
+		 *
+		 * ```
+		 * global draw_player
+		 * draw_player:
+		 *     ...
+		 * ```
+		 *
+		 * It makes no difference to a program that is assembled on its own.
+		 */
+		case SYM_GLOBAL: {
+			nextsym(stepper);
+			if(stepper->sym != SYM_IDENTIFIER)
+				exit_error(as, "label expected, found %s", stepper->token);
+			find_symbol(as, stepper->token, 1)->global = 1;
+			nextsym(stepper);
+		} break;
 		/**
 		 * ## Labels
 		 *
@@ -1030,15 +2676,15 @@ int c8_assemble_internal(Stepper *stepper) {
 		 * ```
 		 *
 		 */
-		case SYM_IDENTIFIER:
-			add_label(stepper->token, stepper->linenum);
+		case SYM_IDENTIFIER: {
+			int label = add_label(as, stepper->token);
 			SYMBOL sym = nextsym(stepper);
 			if(sym != ':') {
 				/* It's more likely that the user got the mnemonic wrong than forgot the ':' */
-				exit_error("error:%d: Unknown instruction `%s`\n", stepper->linenum, lookup[n_lookup-1].label);
+				exit_error(as, "Unknown instruction `%s`", as->strings + label);
 			}
 			nextsym(stepper);
-		break;
+		} break;
 		case SYM_INSTRUCTION:
 			/**
 			 * ## Instructions
@@ -1050,7 +2696,9 @@ int c8_assemble_internal(Stepper *stepper) {
 			 * (Unused at the moment; *TODO* We need a mechanism to hook `sys`
 			 * calls into the interpreter in the future)
 			 */
-			if(!strcmp("sys", stepper->token)) {
+			start = as->program.next_instr;
+			switch(stepper->inst) {
+			case INST_SYS: {
 				nextsym(stepper);
 				emit_e(stepper, 0x0000,3);
 			/**
@@ -1058,17 +2706,19 @@ int c8_assemble_internal(Stepper *stepper) {
 			 *
 			 * `cls` - Clears the screen (`00E0`).
 			 */
-			} else if(!strcmp("cls", stepper->token)) {
+			} break;
+			case INST_CLS: {
 				emit_w(stepper, 0x00E0);
 			/**
 			 * ### CALL - Call subroutine
 			 *
 			 * `call addr` - Calls the subroutine at address `nnn` (`2nnn`).
 			 */
-			} else if(!strcmp("call", stepper->token)) {
+			} break;
+			case INST_CALL: {
 				nextsym(stepper);
 				if(stepper->sym != SYM_IDENTIFIER && stepper->sym != SYM_NUMBER){
-					exit_error("error:%d: address expected", stepper->linenum);
+					exit_error(as, "address expected");
 				}
 				const Emitted e={
 					.type=ET_EXP16,
@@ -1080,7 +2730,8 @@ int c8_assemble_internal(Stepper *stepper) {
 			 *
 			 * `ret` - Returns from a subroutine (`00EE`).
 			 */
-			} else if(!strcmp("ret", stepper->token)) {
+			} break;
+			case INST_RET: {
 				emit_w(stepper, 0x00EE);
 			/**
 			 * ### JP - Jump
@@ -1090,7 +2741,8 @@ int c8_assemble_internal(Stepper *stepper) {
 			 * * `jp nnn` - Jumps to the program location `nnn` (`1nnn`).
 			 * * `jp v0, nnn` - Jumps to the program location calculated from `v0 + nnn` (`Bnnn`).
 			 */
-			} else if(!strcmp("jp", stepper->token)) {
+			} break;
+			case INST_JP: {
 				nextsym(stepper);
 				if(stepper->sym == SYM_IDENTIFIER || stepper->sym == SYM_NUMBER){
 					const Emitted e={
@@ -1101,7 +2753,7 @@ int c8_assemble_internal(Stepper *stepper) {
 				}
 				else if(stepper->sym == SYM_REGISTER) {
 					if(strcmp(stepper->token, "v0"))
-						exit_error("error:%d: JP applies to V0 only\n", stepper->linenum);
+						exit_error(as, "JP applies to V0 only");
 					expect(stepper, ',');
 					if(stepper->sym == SYM_IDENTIFIER || stepper->sym == SYM_NUMBER){
 						const Emitted e={
@@ -1124,7 +2776,8 @@ int c8_assemble_internal(Stepper *stepper) {
 			 * * `se Vx, Vy` - skips the next instruction if the value in `Vx` equals
 			 *     the value in `Vy` (`5xy0`)
 			 */
-			} else if(!strcmp("se", stepper->token)) {
+			} break;
+			case INST_SE: {
 				nextsym(stepper);
 				int regx = get_register(stepper);
 				expect(stepper, ',');
@@ -1134,7 +2787,7 @@ int c8_assemble_internal(Stepper *stepper) {
 					int regy = get_register(stepper);
 					emit_w(stepper, 0x5000 | (regx << 8) | (regy << 4));
 				} else
-					exit_error("error:%d: operand expected\n", stepper->linenum);
+					exit_error(as, "operand expected");
 			/**
 			 * ### SNE - Skip Not Equal
 			 *
@@ -1145,7 +2798,8 @@ int c8_assemble_internal(Stepper *stepper) {
 			 * * `sne Vx, Vy` - skips the next instruction if the value in `Vx` is
 			 *     not equal to the value in `Vy` (`9xy0`)
 			 */
-			} else if(!strcmp("sne", stepper->token)) {
+			} break;
+			case INST_SNE: {
 				nextsym(stepper);
 				int regx = get_register(stepper);
 				expect(stepper, ',');
@@ -1155,7 +2809,7 @@ int c8_assemble_internal(Stepper *stepper) {
 					int regy = get_register(stepper);
 					emit_w(stepper, 0x9000 | (regx << 8) | (regy << 4));
 				} else
-					exit_error("error:%d: operand expected\n", stepper->linenum);
+					exit_error(as, "operand expected");
 			/**
 			 * ### LD - Load
 			 *
@@ -1198,7 +2852,8 @@ int c8_assemble_internal(Stepper *stepper) {
 			 *
 			 * [^rpl]: The original SUPER-CHIP stored these in the calculator on which it ran's RPL registers
 			 */
-			} else if(!strcmp("ld", stepper->token)) {
+			} break;
+			case INST_LD: {
 				nextsym(stepper);
 				if(stepper->sym == SYM_I) {
 					expect(stepper, ',');
@@ -1224,9 +2879,9 @@ int c8_assemble_internal(Stepper *stepper) {
 					emit_w(stepper, 0xF033 | (get_register(stepper) << 8));
 				} else if(stepper->sym == '[') {
 					if(nextsym(stepper) != SYM_I || nextsym(stepper) != ']')
-						exit_error("error:%d: [I] expected\n", stepper->linenum);
+						exit_error(as, "[I] expected");
 					if(nextsym(stepper) != ',')
-						exit_error("error:%d: ',' expected\n", stepper->linenum);
+						exit_error(as, "',' expected");
 					nextsym(stepper);
 					emit_w(stepper, 0xF055 | (get_register(stepper) << 8));
 				} else if(stepper->sym == SYM_HF) {
@@ -1250,12 +2905,12 @@ int c8_assemble_internal(Stepper *stepper) {
 
 					else if(stepper->sym == '[') {
 						if(nextsym(stepper) != SYM_I || nextsym(stepper) != ']')
-							exit_error("error:%d: [I] expected\n", stepper->linenum);
+							exit_error(as, "[I] expected");
 						emit_w(stepper, 0xF065 | (regx << 8));
 					} else if(stepper->sym == SYM_R) {
 						emit_w(stepper, 0xF085 | (regx << 8));
 					} else
-						exit_error("error:%d: operand expected, found %s[%d]\n", stepper->linenum, stepper->token, stepper->sym);
+						exit_error(as, "operand expected, found %s[%d]", stepper->token, stepper->sym);
 				}
 			/**
 			 * ### ADD - Add values
@@ -1267,7 +2922,8 @@ int c8_assemble_internal(Stepper *stepper) {
 			 * * `add I, Vn` - Adds the value in `Vn` to `I`;
 			 *       The result is stored in `I` (`Fn1E`)
 			 */
-			} else if(!strcmp("add", stepper->token)) {
+			} break;
+			case INST_ADD: {
 				nextsym(stepper);
 				if(stepper->sym == SYM_I) {
 					expect(stepper, ',');
@@ -1281,7 +2937,7 @@ int c8_assemble_internal(Stepper *stepper) {
 						int regy = get_register(stepper);
 						emit_w(stepper, 0x8004 | (regx << 8) | (regy << 4));
 					} else
-						exit_error("error:%d: operand expected\n", stepper->linenum);
+						exit_error(as, "operand expected");
 				}
 			/**
 			 * ### OR - Bitwise OR
@@ -1290,7 +2946,8 @@ int c8_assemble_internal(Stepper *stepper) {
 			 *
 			 * The result is stored in `Vx`
 			 */
-			} else if(!strcmp("or", stepper->token)) {
+			} break;
+			case INST_OR: {
 				nextsym(stepper);
 				int regx = get_register(stepper);
 				expect(stepper, ',');
@@ -1303,7 +2960,8 @@ int c8_assemble_internal(Stepper *stepper) {
 			 *
 			 * The result is stored in `Vx`
 			 */
-			} else if(!strcmp("and", stepper->token)) {
+			} break;
+			case INST_AND: {
 				nextsym(stepper);
 				int regx = get_register(stepper);
 				expect(stepper, ',');
@@ -1316,7 +2974,8 @@ int c8_assemble_internal(Stepper *stepper) {
 			 *
 			 * The result is stored in `Vx`
 			 */
-			} else if(!strcmp("xor", stepper->token)) {
+			} break;
+			case INST_XOR: {
 				nextsym(stepper);
 				int regx = get_register(stepper);
 				expect(stepper, ',');
@@ -1329,7 +2988,8 @@ int c8_assemble_internal(Stepper *stepper) {
 			 *
 			 * The result is stored in `Vx`
 			 */
-			} else if(!strcmp("sub", stepper->token)) {
+			} break;
+			case INST_SUB: {
 				nextsym(stepper);
 				int regx = get_register(stepper);
 				expect(stepper, ',');
@@ -1347,7 +3007,8 @@ int c8_assemble_internal(Stepper *stepper) {
 			 * This is a well known quirk between different CHIP8 implementations.
 			 * [More information](https://tobiasvl.github.io/blog/write-a-chip-8-emulator/#8xy6-and-8xye-shift).
 			 */
-			} else if(!strcmp("shr", stepper->token)) {
+			} break;
+			case INST_SHR: {
 				nextsym(stepper);
 				int regx = get_register(stepper);
 				int regy = 0;
@@ -1363,7 +3024,8 @@ int c8_assemble_internal(Stepper *stepper) {
 			 *
 			 * `subn Vx, Vy` maps to the `8xy7` Chip8 instruction.
 			 */
-			} else if(!strcmp("subn", stepper->token)) {
+			} break;
+			case INST_SUBN: {
 				nextsym(stepper);
 				int regx = get_register(stepper);
 				expect(stepper, ',');
@@ -1381,7 +3043,8 @@ int c8_assemble_internal(Stepper *stepper) {
 			 * This is a well known quirk between different CHIP8 implementations.
 			 * [More information](https://tobiasvl.github.io/blog/write-a-chip-8-emulator/#8xy6-and-8xye-shift).
 			 */
-			} else if(!strcmp("shl", stepper->token)) {
+			} break;
+			case INST_SHL: {
 				nextsym(stepper);
 				int regx = get_register(stepper);
 				int regy=0;
@@ -1399,21 +3062,23 @@ int c8_assemble_internal(Stepper *stepper) {
 			 *
 			 * It creates a random number that is bitwise AND'ed with `kk`.
 			 */
-			} else if(!strcmp("rnd", stepper->token)) {
+			} break;
+			case INST_RND: {
 				nextsym(stepper);
 				int regx = get_register(stepper);
 				expect(stepper, ',');
 				if(stepper->sym == SYM_NUMBER || stepper->sym == SYM_IDENTIFIER){
 					emit_e(stepper, 0xC000 | (regx << 8), 2);
 				}
-				else exit_error("error:%d: operand expected\n", stepper->linenum);
+				else exit_error(as, "operand expected");
 			/**
 			 * ### DRW - Draw Sprite
 			 *
 			 * `drw Vx, Vy, n` - Draws the `n`-byte sprite at memory location `I`
 			 * to the screen position `Vx`,`Vy`. (`Dxyn`)
 			 */
-			}  else if(!strcmp("drw", stepper->token)) {
+			} break;
+			case INST_DRW: {
 				nextsym(stepper);
 				int regx = get_register(stepper);
 				expect(stepper, ',');
@@ -1425,7 +3090,8 @@ int c8_assemble_internal(Stepper *stepper) {
 			 *
 			 * `skp Vn` - Skips the next instruction if the key identified by `Vn` is pressed (`En9E`)
 			 */
-			} else if(!strcmp("skp", stepper->token)) {
+			} break;
+			case INST_SKP: {
 				nextsym(stepper);
 				emit_w(stepper, 0xE09E | (get_register(stepper) << 8));
 			/**
@@ -1433,7 +3099,8 @@ int c8_assemble_internal(Stepper *stepper) {
 			 *
 			 * `sknp Vn` - Skips the next instruction if the key identified by `Vn` is not pressed (`EnA1`)
 			 */
-			} else if(!strcmp("sknp", stepper->token)) {
+			} break;
+			case INST_SKNP: {
 				nextsym(stepper);
 				emit_w(stepper, 0xE0A1 | (get_register(stepper) << 8));
 			/**
@@ -1441,7 +3108,8 @@ int c8_assemble_internal(Stepper *stepper) {
 			 *
 			 * `delay Vx` - loads the value in `Vx` into the _Delay Timer_ (`Fx15`).
 			 */
-			} else if(!strcmp("delay", stepper->token)) {
+			} break;
+			case INST_DELAY: {
 				nextsym(stepper);
 				emit_w(stepper, 0xF015 | (get_register(stepper) << 8));
 			/**
@@ -1449,7 +3117,8 @@ int c8_assemble_internal(Stepper *stepper) {
 			 *
 			 * `sound Vx` - loads the value in `Vx` into the _Sound Timer_ (`Fx18`).
 			 */
-			} else if(!strcmp("sound", stepper->token)) {
+			} break;
+			case INST_SOUND: {
 				nextsym(stepper);
 				emit_w(stepper, 0xF018 | (get_register(stepper) << 8));
 			/**
@@ -1459,7 +3128,8 @@ int c8_assemble_internal(Stepper *stepper) {
 			 * represented by `Vx` into `I` (`Fx29`).
 			 *
 			 */
-			} else if(!strcmp("hex", stepper->token)) {
+			} break;
+			case INST_HEX: {
 				nextsym(stepper);
 				emit_w(stepper, 0xF029 | (get_register(stepper) << 8));
 			/**
@@ -1468,7 +3138,8 @@ int c8_assemble_internal(Stepper *stepper) {
 			 * `bcd Vx` - stores the BCD representation of `Vx` in the memory locations `I`, `I+1` and `I+2` (`Fx33`).
 			 *
 			 */
-			} else if(!strcmp("bcd", stepper->token)) {
+			} break;
+			case INST_BCD: {
 				nextsym(stepper);
 				emit_w(stepper, 0xF033 | (get_register(stepper) << 8));
 			/**
@@ -1476,7 +3147,8 @@ int c8_assemble_internal(Stepper *stepper) {
 			 *
 			 * `key Vx` - Waits for a keypress, then loads the key pressed into `Vx` (`Fx0A`).
 			 */
-			} else if(!strcmp("key", stepper->token)) {
+			} break;
+			case INST_KEY: {
 				nextsym(stepper);
 				emit_w(stepper, 0xF00A | (get_register(stepper) << 8));
 			/**
@@ -1484,7 +3156,8 @@ int c8_assemble_internal(Stepper *stepper) {
 			 *
 			 * `stor Vx` - Stores registers `V0` through `Vx` to the memory addresses `I` through `I+x` (`Fx55`).
 			 */
-			} else if(!strcmp("stor", stepper->token)) {
+			} break;
+			case INST_STOR: {
 				nextsym(stepper);
 				emit_w(stepper, 0xF055 | (get_register(stepper) << 8));
 			/**
@@ -1492,7 +3165,8 @@ int c8_assemble_internal(Stepper *stepper) {
 			 *
 			 * `rstr Vx` - Restores registers `V0` through `Vx` from the memory addresses `I` through `I+x` (`Fx65`).
 			 */
-			} else if(!strcmp("rstr", stepper->token)) {
+			} break;
+			case INST_RSTR: {
 				nextsym(stepper);
 				emit_w(stepper, 0xF065 | (get_register(stepper) << 8));
 			/**
@@ -1504,7 +3178,8 @@ int c8_assemble_internal(Stepper *stepper) {
 			 * `scd n` - scrolls the screen down by `n` rows (`00Cn`)
 			 *
 			 */
-			} else if(!strcmp("scd", stepper->token)) {
+			} break;
+			case INST_SCD: {
 				nextsym(stepper);
 				emit_e(stepper, 0x00C0 ,1);
 			/**
@@ -1512,21 +3187,24 @@ int c8_assemble_internal(Stepper *stepper) {
 			 *
 			 * `scr` - scrolls the screen to the right by 4 pixels (`00FB`)
 			 */
-			} else if(!strcmp("scr", stepper->token)) {
+			} break;
+			case INST_SCR: {
 				emit_w(stepper, 0x00FB);
 			/**
 			 * ### SCL - Scroll Left
 			 *
 			 * `scl` - scrolls the screen to the left by 4 pixels (`00FC`)
 			 */
-			} else if(!strcmp("scl", stepper->token)) {
+			} break;
+			case INST_SCL: {
 				emit_w(stepper, 0x00FC);
 			/**
 			 * ### EXIT - Exit
 			 *
 			 * `exit` - stops the interpreter (`00FD`)
 			 */
-			} else if(!strcmp("exit", stepper->token)) {
+			} break;
+			case INST_EXIT: {
 				emit_w(stepper, 0x00FD);
 			/**
 			 * ### HEXX - prepare a large hex sprite
@@ -1536,7 +3214,8 @@ int c8_assemble_internal(Stepper *stepper) {
 			 *
 			 * See also the [`hex`](#hex---prepare-a-hex-sprite) instruction.
 			 */
-			} else if(!strcmp("hexx", stepper->token)) {
+			} break;
+			case INST_HEXX: {
 				nextsym(stepper);
 				emit_w(stepper, 0xF030 | (get_register(stepper) << 8));
 			/**
@@ -1544,14 +3223,16 @@ int c8_assemble_internal(Stepper *stepper) {
 			 *
 			 * `low` maps to the `00FE` Chip8 instruction.
 			 */
-			} else if(!strcmp("low", stepper->token)) {
+			} break;
+			case INST_LOW: {
 				emit_w(stepper, 0x00FE);
 			/**
 			 * ### HIGH - High Resolution Mode
 			 *
 			 * `high` maps to the `00FF` Chip8 instruction.
 			 */
-			} else if(!strcmp("high", stepper->token)) {
+			} break;
+			case INST_HIGH: {
 				emit_w(stepper, 0x00FF);
 			/**
 			 * ### STORX - Store registers, extended
@@ -1560,7 +3241,8 @@ int c8_assemble_internal(Stepper *stepper) {
 			 *
 			 * See also the [`stor`](#stor---store-registers) instruction.
 			 */
-			} else if(!strcmp("storx", stepper->token)) {
+			} break;
+			case INST_STORX: {
 				nextsym(stepper);
 				emit_w(stepper, 0xF075 | (get_register(stepper) << 8));
 			/**
@@ -1570,21 +3252,56 @@ int c8_assemble_internal(Stepper *stepper) {
 			 *
 			 * See also the [`rstr`](#rstr---restore-registers) instruction.
 			 */
-			} else if(!strcmp("rstrx", stepper->token)) {
+			} break;
+			case INST_RSTRX: {
 				nextsym(stepper);
 				emit_w(stepper, 0xF085 | (get_register(stepper) << 8));
+			} break;
+			default:
+				break;
 			}
+			if(as->program.next_instr == start + 2)
+				as->is_instr[start >> 3] |= 1 << (start & 7);
 
 			nextsym(stepper);
 		break;
 		default:
-			exit_error("error:%d: unexpected token [%d]: '%s'\n", stepper->linenum, stepper->sym, stepper->token);
+			exit_error(as, "unexpected token [%d]: '%s'", stepper->sym, stepper->token);
 		}
 	}
 
+	as->stepper = outer;
 	return 0;
 }
 
+/**
+ * ## Optimization
+ *
+ * With `c8asm -O` the assembler makes these changes to the program before
+ * it resolves the labels:
+ *
+ * * `call x` followed by `ret` becomes `jp x`.
+ * * A `jp` or `call` to a `jp` goes straight to where that `jp` goes.
+ * * `ld Vx, a` followed by `add Vx, b` becomes `ld Vx, a+b` if `a` and `b`
+ *   are numbers.
+ * * The instructions after a `jp` or a `ret` that no label points at are
+ *   removed, since they can't be reached.
+ *
+ * A `call` or `ld` that follows a skip is left as it is, since the skip
+ * must still skip the same thing. So are the instructions after a label that
+ * is used other than as the address of a `jp` or a `call`, because they may
+ * be read or modified as data, or be the entries of a `jp v0` table. With
+ * `-c` that goes for every `global` label, since other units may use it.
+ *
+ * Instructions are only removed if the program doesn't use `offset` and only
+ * refers to addresses through plain labels, as in `ld i, sprite` rather than
+ * `ld i, sprite + 2` or `ld i, #300`; otherwise only the first two changes
+ * are made.
+ *
+ * The optimized program does the same as the original, except for the
+ * timing, and for programs that overflow the stack.
+ */
+
 /**
  * ## References
  *
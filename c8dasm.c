@@ -20,6 +20,11 @@ So there's now a `-r` command line option that will use the `c8_disasm_reachable
 function to tell us that an address is reachable. In our example you can use
 `-r 0xE98 -r 0xE9C`, which will tell the disassembler that #E98 and #E9C are reachable.
 
+These days the disassembler works out the possible values of `V0` (or `VE`) in the
+straight-line code before a `JP V0, nnn` itself (see "Value ranges" below), so it
+finds #E98, or #E9C if `QUIRKS_JUMP` is set with the `-q` option. `-r` is still
+there for jumps that depend on values computed elsewhere.
+
 [5-quirks]: https://github.com/Timendus/chip8-test-suite/raw/main/bin/5-quirks.ch8
 
 */
@@ -27,13 +32,12 @@ function to tell us that an address is reachable. In our example you can use
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdarg.h>
 #include <time.h>
 #include <assert.h>
 
 #include "chip8.h"
 
-#define MAX_BRANCHES	256
-
 /* If you have a run of ZERO_RUNS or more 0x00 bytes in the data output,
 just skip it... */
 #define ZERO_RUNS 	16
@@ -47,35 +51,407 @@ just skip it... */
 #define IS_LABEL(addr) (labels[(addr) >> 3] & (1 << ((addr) & 0x07)))
 #define SET_LABEL(addr) labels[(addr) >> 3] |= (1 << ((addr) & 0x07))
 
-static uint16_t branches[MAX_BRANCHES], bsp;
-uint8_t labels[TOTAL_RAM/8];
+#define IS_LEADER(addr) (leaders[(addr) >> 3] & (1 << ((addr) & 0x07)))
+#define SET_LEADER(addr) leaders[(addr) >> 3] |= (1 << ((addr) & 0x07))
+
+#define COVERED(addr) (d->covered_code[(addr) >> 3] & (1 << ((addr) & 0x07)))
+
+/* The state behind c8_disasm() and the other functions without a
+	c8_disasm_t, which disassemble the interpreter's RAM. Everything else
+	only uses the c8_disasm_t it is given, so different threads can
+	disassemble different programs at the same time. */
+static c8_disasm_t global;
+
+static c8_disasm_t *global_disasm() {
+	global.ram = C8.RAM;
+	global.quirks = c8_get_quirks();
+	return &global;
+}
+
+static uint16_t fetch(const c8_disasm_t *d, uint16_t addr) {
+	return d->ram[addr & (TOTAL_RAM - 1)] << 8 | d->ram[(addr + 1) & (TOTAL_RAM - 1)];
+}
+
+/* Reports an error in `d->error`, and through c8_puts() */
+static void report(c8_disasm_t *d, const char *msg, ...) {
+	va_list arg;
+	va_start (arg, msg);
+	vsnprintf (d->error, sizeof d->error, msg, arg);
+	va_end (arg);
+	if(c8_puts)
+		c8_puts(d->error);
+}
+
+/* Makes room in the array `*array` for at least `n + 1` elements of `size` bytes */
+static int grow(void **array, int n, int *capacity, size_t size) {
+	int cap = *capacity ? *capacity * 2 : 64;
+	void *p;
+	if(n < *capacity)
+		return 1;
+	if(!(p = realloc(*array, cap * size)))
+		return 0;
+	*array = p;
+	*capacity = cap;
+	return 1;
+}
+
+void c8_disasm_init(c8_disasm_t *d, const uint8_t *ram) {
+	memset(d, 0, sizeof *d);
+	d->ram = ram;
+	d->quirks = c8_get_quirks();
+}
+
+void c8_disasm_free(c8_disasm_t *d) {
+	free(d->roots);
+	d->roots = NULL;
+	d->nroots = 0;
+	d->roots_size = 0;
+}
 
 void c8_disasm_start() {
-	bsp = 0;
-	memset(labels, 0, sizeof labels);
+	global.nroots = 0;
+	global.have_coverage = 0;
 }
 
-void c8_disasm_reachable(uint16_t addr) {
-	if(addr > TOTAL_RAM)
+void c8_disasm_output(c8_writer_t *w) {
+	global.output = w;
+}
+
+int c8_disasm_coverage_r(c8_disasm_t *d, const char *fname) {
+	d->have_coverage = c8_coverage_load(fname, d->covered_code, d->covered_data);
+	return d->have_coverage;
+}
+
+int c8_disasm_coverage(const char *fname) {
+	return c8_disasm_coverage_r(&global, fname);
+}
+
+void c8_disasm_reachable_r(c8_disasm_t *d, uint16_t addr) {
+	if(addr >= TOTAL_RAM)
 		return;
-	branches[bsp++] = addr;
-	SET_LABEL(addr);
+	if(grow((void **)&d->roots, d->nroots, &d->roots_size, sizeof *d->roots))
+		d->roots[d->nroots++] = addr;
+	else
+		report(d, "error: out of memory\n");
 }
 
-void c8_disasm() {
-	/* Some of the reported errors can conceivably happen
-		if you try to disassembe a buggy program */
-	uint16_t addr, max_addr = 0, run, run_end = 0;
-	int odata = 0,
-		out = 0;
+void c8_disasm_reachable(uint16_t addr) {
+	c8_disasm_reachable_r(&global, addr);
+}
+
+/* Control flow graph:
+	c8_cfg_build() follows every path through the program from its entry
+	points, marking the reachable instructions and the addresses where basic
+	blocks start (the leaders). A second pass cuts the reachable instructions
+	into blocks at the leaders and after every branch, and connects them. A
+	third pass walks each subroutine's blocks to find its RETs and the
+	subroutines it calls. */
+
+/* A `JP V0, nnn` at `from` that can go to `to` */
+typedef struct {
+	uint16_t from, to;
+} computed_jump_t;
+
+typedef struct {
+	c8_disasm_t *d;
+	c8_cfg_t *cfg;
+	/* The worklist of addresses to follow */
+	uint16_t *stack;
+	int sp, stack_size;
+	uint8_t leaders[TOTAL_RAM/8];
+	int blocks_size, edges_size, funcs_size;
+	/* Addresses below this that were executed have been followed */
+	uint16_t covered;
+	/* The `JP V0, nnn` instructions found, and where they go */
+	uint16_t *jumps;
+	int njumps, jumps_size;
+	computed_jump_t *targets;
+	int ntargets, targets_size;
+	int failed;
+} cfg_builder_t;
+
+static int push_branch(cfg_builder_t *b, uint16_t addr) {
+	if(!grow((void **)&b->stack, b->sp, &b->stack_size, sizeof *b->stack)) {
+		report(b->d, "error: out of memory\n");
+		return 0;
+	}
+	b->stack[b->sp++] = addr;
+	return 1;
+}
+
+static int is_skip(uint16_t opcode) {
+	return (opcode & 0xF000) == 0x3000 || (opcode & 0xF000) == 0x4000
+		|| (opcode & 0xF00F) == 0x5000 || (opcode & 0xF00F) == 0x9000
+		|| (opcode & 0xF0FF) == 0xE09E || (opcode & 0xF0FF) == 0xE0A1;
+}
+
+/* Does the instruction end a basic block? */
+static int ends_block(uint16_t opcode) {
+	return opcode == 0x00EE || opcode == 0x00FD || (opcode & 0xF000) == 0x1000
+		|| (opcode & 0xF000) == 0x2000 || (opcode & 0xF000) == 0xB000 || is_skip(opcode);
+}
+
+/* Value ranges:
+	A `JP V0, nnn` (or `JP Vx, xnn` with QUIRKS_JUMP) is resolved by running
+	the straight-line code leading up to it, from the start of its block, on
+	ranges of values instead of values. A range holds the values from `lo` to
+	`hi` in steps of `step`; registers start out holding any value. Jump
+	tables are usually indexed with a multiple of 2, which the step keeps
+	track of so that the targets stay aligned. */
+
+/* Jumps with more targets than this are left unresolved */
+#define MAX_TARGETS	64
+
+typedef struct {
+	uint8_t lo, hi, step;
+} range_t;
+
+static const range_t any_value = {0, 255, 1};
+
+static range_t constant(uint8_t value) {
+	range_t r = {value, value, 1};
+	return r;
+}
+
+static range_t between(int lo, int hi, int step) {
+	range_t r;
+	if(lo < 0 || hi > 255 || step < 1)
+		return any_value;
+	r.lo = lo;
+	r.hi = hi;
+	r.step = step;
+	return r;
+}
+
+static int gcd(int a, int b) {
+	while(b) {
+		int t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* The step of a range that is the sum of ranges `a` and `b` */
+static int sum_step(range_t a, range_t b) {
+	if(a.lo == a.hi)
+		return b.step;
+	if(b.lo == b.hi)
+		return a.step;
+	return gcd(a.step, b.step);
+}
+
+/* The largest power of two that divides `value`; all values `v & mask`
+	are multiples of lowest_bit(mask) */
+static int lowest_bit(int value) {
+	return value ? value & -value : 1;
+}
 
-	uint8_t reachable[TOTAL_RAM/8];
-	uint8_t touched[TOTAL_RAM/8];
+/* Applies the instruction `opcode` to the registers `V` */
+static void range_step(range_t V[16], uint16_t opcode, unsigned int quirks) {
+	uint8_t x = (opcode >> 8) & 0x0F, y = (opcode >> 4) & 0x0F, kk = opcode & 0xFF;
+	range_t a = V[x], b = V[y], r, f;
+	int i, cx = a.lo == a.hi, cy = b.lo == b.hi;
 
-	memset(reachable, 0, sizeof reachable);
-	memset(touched, 0, sizeof touched);
+	switch(opcode & 0xF000) {
+		case 0x0000:
+			if(opcode != 0x00E0 && opcode != 0x00EE && (opcode & 0xFFF0) != 0x00C0
+					&& (opcode < 0x00FB || opcode > 0x00FF)) {
+				/* SYS: the c8_sys_hook can do anything */
+				for(i = 0; i < 16; i++)
+					V[i] = any_value;
+			}
+			break;
+		case 0x6000: V[x] = constant(kk); break;
+		case 0x7000:
+			if(cx)
+				V[x] = constant(a.lo + kk);
+			else
+				V[x] = between(a.lo + kk, a.hi + kk, a.step);
+			break;
+		case 0x8000:
+			f = V[0xF];
+			switch(opcode & 0x000F) {
+				case 0x0: r = b; break;
+				case 0x1: r = (cx && cy) ? constant(a.lo | b.lo) : any_value; break;
+				case 0x2:
+					if(cx && cy)
+						r = constant(a.lo & b.lo);
+					else if(cx || cy)
+						r = between(0, cx ? (a.lo < b.hi ? a.lo : b.hi) : (b.lo < a.hi ? b.lo : a.hi), lowest_bit(cx ? a.lo : b.lo));
+					else
+						r = between(0, a.hi < b.hi ? a.hi : b.hi, 1);
+					break;
+				case 0x3: r = (cx && cy) ? constant(a.lo ^ b.lo) : any_value; break;
+				case 0x4:
+					if(cx && cy) {
+						r = constant(a.lo + b.lo);
+						f = constant(a.lo + b.lo > 255);
+					} else if(a.hi + b.hi <= 255) {
+						r = between(a.lo + b.lo, a.hi + b.hi, sum_step(a, b));
+						f = constant(0);
+					} else {
+						r = any_value;
+						f = between(0, 1, 1);
+					}
+					break;
+				case 0x5:
+				case 0x7:
+					if(cx && cy) {
+						r = (opcode & 0x000F) == 0x5 ? constant(a.lo - b.lo) : constant(b.lo - a.lo);
+						f = (opcode & 0x000F) == 0x5 ? constant(a.lo > b.lo) : constant(b.lo > a.lo);
+					} else {
+						r = any_value;
+						f = between(0, 1, 1);
+					}
+					break;
+				case 0x6:
+					if(quirks & QUIRKS_SHIFT)
+						b = a;
+					if(b.lo == b.hi) {
+						r = constant(b.lo >> 1);
+						f = constant(b.lo & 0x01);
+					} else {
+						r = between(b.lo >> 1, b.hi >> 1, (b.step & 1) ? 1 : b.step >> 1);
+						f = (b.step & 1) ? between(0, 1, 1) : constant(b.lo & 0x01);
+					}
+					break;
+				case 0xE:
+					if(quirks & QUIRKS_SHIFT)
+						b = a;
+					if(b.lo == b.hi) {
+						r = constant(b.lo << 1);
+						f = constant(b.lo >> 7);
+					} else if(b.hi < 0x80) {
+						r = between(b.lo << 1, b.hi << 1, b.step << 1);
+						f = constant(0);
+					} else {
+						r = any_value;
+						f = between(0, 1, 1);
+					}
+					break;
+				default:
+					/* The interpreter ignores the other 8xyN instructions */
+					return;
+			}
+			V[x] = r;
+			if((opcode & 0x000F) >= 0x1 && (opcode & 0x000F) <= 0x3) {
+				if(quirks & QUIRKS_VF_RESET)
+					V[0xF] = constant(0);
+			} else if((opcode & 0x000F) != 0x0)
+				V[0xF] = f;
+			break;
+		case 0xC000: V[x] = between(0, kk, lowest_bit(kk)); break;
+		case 0xD000: V[0xF] = between(0, 1, 1); break;
+		case 0xF000:
+			switch(kk) {
+				case 0x07:
+				case 0x0A: V[x] = any_value; break;
+				case 0x1E: V[0xF] = between(0, 1, 1); break;
+				case 0x65:
+				case 0x85:
+					for(i = 0; i <= x; i++)
+						V[i] = any_value;
+					break;
+			}
+			break;
+	}
+}
+
+/* Works out where the `JP V0, nnn` at `addr` can go, and follows the new
+	targets. Returns the number of new targets. */
+static int resolve_jump(cfg_builder_t *b, uint16_t addr) {
+	const uint8_t *reachable = b->cfg->reachable, *leaders = b->leaders;
+	uint8_t *labels = b->cfg->labels;
+	unsigned int quirks = b->d->quirks;
+	uint16_t opcode = fetch(b->d, addr), start, target;
+	range_t V[16], r;
+	int i, j, n = 0;
+
+	/* Find the start of the straight-line code */
+	for(start = addr; start >= PROG_OFFSET + 2 && !IS_LEADER(start)
+		&& REACHABLE(start - 2) && !ends_block(fetch(b->d, start - 2)); start -= 2);
+
+	for(i = 0; i < 16; i++)
+		V[i] = any_value;
+	for(; start < addr; start += 2)
+		range_step(V, fetch(b->d, start), quirks);
+
+	r = V[(quirks & QUIRKS_JUMP) ? (opcode >> 8) & 0x0F : 0];
+	if((r.hi - r.lo) / r.step >= MAX_TARGETS)
+		return 0;
+
+	for(i = r.lo; i <= r.hi; i += r.step) {
+		target = ((opcode & 0x0FFF) + i) & 0xFFF;
+		if(target < PROG_OFFSET)
+			continue;
+		for(j = 0; j < b->ntargets; j++)
+			if(b->targets[j].from == addr && b->targets[j].to == target)
+				break;
+		if(j < b->ntargets)
+			continue;
+		if(!grow((void **)&b->targets, b->ntargets, &b->targets_size, sizeof *b->targets)) {
+			report(b->d, "error: out of memory\n");
+			b->failed = 1;
+			return 0;
+		}
+		if(!push_branch(b, target)) {
+			b->failed = 1;
+			return 0;
+		}
+		b->targets[b->ntargets].from = addr;
+		b->targets[b->ntargets].to = target;
+		b->ntargets++;
+		SET_LABEL(target);
+		n++;
+	}
+	return n;
+}
+
+/* Resolves all the `JP V0, nnn`s found so far. Returns the number of new
+	targets to follow. */
+static int resolve_jumps(cfg_builder_t *b) {
+	int i, n = 0;
+	for(i = 0; i < b->njumps && !b->failed; i++)
+		n += resolve_jump(b, b->jumps[i]);
+	return n;
+}
+
+/* Follows the lowest address that was executed according to the coverage,
+	but that isn't reachable yet. Returns 1 if there was one. */
+static int follow_coverage(cfg_builder_t *b) {
+	const c8_disasm_t *d = b->d;
+	const uint8_t *reachable = b->cfg->reachable;
+	uint8_t *labels = b->cfg->labels;
+	if(!d->have_coverage)
+		return 0;
+	for(; b->covered < TOTAL_RAM - 1; b->covered++) {
+		if(b->covered < PROG_OFFSET || !COVERED(b->covered) || REACHABLE(b->covered))
+			continue;
+		if(!push_branch(b, b->covered)) {
+			b->failed = 1;
+			return 0;
+		}
+		SET_LABEL(b->covered);
+		return 1;
+	}
+	return 0;
+}
+
+/* Determines which instructions are reachable, which addresses are
+	touched by `LD I, nnn` instructions (or were read according to the
+	coverage), and where the blocks start.
+	Returns 0 if the program could not be followed. */
+static int find_reachable(cfg_builder_t *b) {
+	/* Some of the reported errors can conceivably happen
+		if you try to disassembe a buggy program */
+	c8_disasm_t *d = b->d;
+	uint8_t *reachable = b->cfg->reachable, *touched = b->cfg->touched;
+	uint8_t *labels = b->cfg->labels, *leaders = b->leaders;
+	uint16_t addr;
+	int i;
 
-	/* Step 1: Determine which instructions are reachable.
+	/* Determine which instructions are reachable.
 	We run through the program instruction by instruction.
 	If we encouter a branch, we push one path onto a stack and
 	continue along the other. We continue until everything is
@@ -83,25 +459,35 @@ void c8_disasm() {
 	Also, we mark branch destinations as labels to prettify the
 	output - to have labels instead of adresses.
 	*/
-	branches[bsp++] = PROG_OFFSET;
-	while(bsp > 0) {
-		addr = branches[--bsp];
+	for(i = 0; i < d->nroots; i++) {
+		if(!push_branch(b, d->roots[i]))
+			return 0;
+		SET_LABEL(d->roots[i]);
+	}
+	if(!push_branch(b, PROG_OFFSET))
+		return 0;
+	if(d->have_coverage)
+		memcpy(touched, d->covered_data, sizeof d->covered_data);
+	while(b->sp > 0 || resolve_jumps(b) || follow_coverage(b)) {
+		addr = b->stack[--b->sp];
+		if(addr < TOTAL_RAM)
+			SET_LEADER(addr);
 
 		while(addr < TOTAL_RAM - 1 && !REACHABLE(addr)) {
 
 			SET_REACHABLE(addr);
 
-			uint16_t opcode = c8_opcode(addr);
+			uint16_t opcode = fetch(d, addr);
 			if(addr < PROG_OFFSET ) {
 				/* Program ended up where it shouldn't; assumes the RAM is initialised to 0 */
-				c8_message("error: bad jump: program at #%03X\n",addr);
-				return;
+				report(d, "error: bad jump: program at #%03X\n",addr);
+				return 0;
 			}
 
 			addr += 2;
 			if(addr >= TOTAL_RAM) {
-				c8_message("error: program overflows RAM\n");
-				return;
+				report(d, "error: program overflows RAM\n");
+				return 0;
 			}
 
 			uint16_t nnn = opcode & 0x0FFF;
@@ -114,48 +500,313 @@ void c8_disasm() {
 				addr = nnn;
 				assert(addr < TOTAL_RAM);
 				SET_LABEL(addr);
+				SET_LEADER(addr);
 			} else if((opcode & 0xF000) == 0x2000) { /* CALL addr */
-				if(bsp == MAX_BRANCHES) {
-					/* Basically, this program is too complex to disassemble,
-						but you can increase MAX_BRANCHES to see if it helps. */
-					c8_message("error: Too many branches to follow (%u)\n", bsp);
-					return;
-				}
-				branches[bsp++] = addr; /* For the RET */
+				if(!push_branch(b, addr)) /* For the RET */
+					return 0;
 				addr = nnn;
 				assert(addr < TOTAL_RAM);
 				SET_LABEL(addr);
-			} else if((opcode & 0xF000) == 0x3000 || (opcode & 0xF00F) == 0x5000) { /* SE */
-				if(bsp == MAX_BRANCHES) {c8_message("error: Too many branches to follow (%u)\n", bsp);return;}
-				branches[bsp++] = addr + 2;
-			} else if((opcode & 0xF000) == 0x4000 || (opcode & 0xF00F) == 0x9000) { /* SNE */
-				if(bsp == MAX_BRANCHES) {c8_message("error: Too many branches to follow (%u)\n", bsp);return;}
-				branches[bsp++] = addr + 2;
-			} else if((opcode & 0xF0FF) == 0xE09E) { /* SKP */
-				if(bsp == MAX_BRANCHES) {c8_message("error: Too many branches to follow (%u)\n", bsp);return;}
-				branches[bsp++] = addr + 2;
-			} else if((opcode & 0xF0FF) == 0xE0A1) { /* SKNP */
-				if(bsp == MAX_BRANCHES) {c8_message("error: Too many branches to follow (%u)\n", bsp); return;}
-				branches[bsp++] = addr + 2;
+				SET_LEADER(addr);
+			} else if(is_skip(opcode)) { /* SE, SNE, SKP, SKNP */
+				if(!push_branch(b, addr + 2))
+					return 0;
+				SET_LEADER(addr);
 			} else if((opcode & 0xF000) == 0xB000) {
-				/* I don't think we can realistically disassemble this, because
-					we can't know V0 without actually running the program. */
+				/* We can't know V0 without actually running the program,
+					but resolve_jumps() can work out what it could be. */
+				if(!grow((void **)&b->jumps, b->njumps, &b->jumps_size, sizeof *b->jumps)) {
+					report(d, "error: out of memory\n");
+					return 0;
+				}
+				b->jumps[b->njumps++] = addr - 2;
 				break;
-			} else if((opcode & 0xF000) == 0xA000) {
+			} else if((opcode & 0xF000) == 0xA000 && !d->have_coverage) {
 				/* Mark the address as touched so that it don't get removed by the code
 				that hides the long runs of 0x00 bytes. */
 				TOUCH(nnn);
 			}
 		}
 		if(addr >= TOTAL_RAM - 1) {
-			c8_message("error: program overflows RAM\n");
-			return;
+			report(d, "error: program overflows RAM\n");
+			return 0;
+		}
+	}
+	return !b->failed;
+}
+
+int c8_cfg_block(const c8_cfg_t *cfg, uint16_t addr) {
+	int lo = 0, hi = cfg->nblocks - 1, mid;
+	while(lo <= hi) {
+		mid = (lo + hi) / 2;
+		if(addr < cfg->blocks[mid].start)
+			hi = mid - 1;
+		else if(addr >= cfg->blocks[mid].end)
+			lo = mid + 1;
+		else
+			return mid;
+	}
+	return -1;
+}
+
+static int add_edge(cfg_builder_t *b, int from, uint16_t to, c8_edge_kind_t kind) {
+	c8_cfg_t *cfg = b->cfg;
+	int block = c8_cfg_block(cfg, to);
+	if(block < 0 || cfg->blocks[block].start != to)
+		return 1;
+	if(!grow((void **)&cfg->edges, cfg->nedges, &b->edges_size, sizeof *cfg->edges)) {
+		report(b->d, "error: out of memory\n");
+		return 0;
+	}
+	cfg->edges[cfg->nedges].from = from;
+	cfg->edges[cfg->nedges].to = block;
+	cfg->edges[cfg->nedges].kind = kind;
+	cfg->nedges++;
+	return 1;
+}
+
+/* Cuts the reachable instructions into blocks, and connects them */
+static int find_blocks(cfg_builder_t *b) {
+	c8_cfg_t *cfg = b->cfg;
+	const uint8_t *reachable = cfg->reachable, *leaders = b->leaders;
+	uint16_t addr, end, opcode;
+	int i, j;
+
+	for(addr = PROG_OFFSET; addr < TOTAL_RAM - 1; addr++) {
+		if(!IS_LEADER(addr) || !REACHABLE(addr))
+			continue;
+		for(end = addr;;) {
+			opcode = fetch(b->d, end);
+			end += 2;
+			if(ends_block(opcode) || end >= TOTAL_RAM - 1 || !REACHABLE(end) || IS_LEADER(end))
+				break;
+		}
+		if(!grow((void **)&cfg->blocks, cfg->nblocks, &b->blocks_size, sizeof *cfg->blocks)) {
+			report(b->d, "error: out of memory\n");
+			return 0;
+		}
+		cfg->blocks[cfg->nblocks].start = addr;
+		cfg->blocks[cfg->nblocks].end = end;
+		cfg->nblocks++;
+	}
+
+	for(i = 0; i < cfg->nblocks; i++) {
+		end = cfg->blocks[i].end;
+		opcode = fetch(b->d, end - 2);
+		if((opcode & 0xF000) == 0x1000) {
+			if(!add_edge(b, i, opcode & 0x0FFF, C8_EDGE_JUMP))
+				return 0;
+		} else if((opcode & 0xF000) == 0x2000) {
+			if(!add_edge(b, i, opcode & 0x0FFF, C8_EDGE_CALL))
+				return 0;
+		} else if((opcode & 0xF000) == 0xB000) {
+			for(j = 0; j < b->ntargets; j++)
+				if(b->targets[j].from == end - 2 && !add_edge(b, i, b->targets[j].to, C8_EDGE_JUMP))
+					return 0;
+		} else if(is_skip(opcode)) {
+			if(!add_edge(b, i, end, C8_EDGE_FALLTHROUGH) || !add_edge(b, i, end + 2, C8_EDGE_SKIP))
+				return 0;
+		} else if(!ends_block(opcode)) {
+			if(!add_edge(b, i, end, C8_EDGE_FALLTHROUGH))
+				return 0;
+		}
+	}
+	return 1;
+}
+
+static int find_func(const c8_cfg_t *cfg, int block) {
+	int i;
+	for(i = 0; i < cfg->nfuncs; i++)
+		if(cfg->funcs[i].block == block)
+			return i;
+	return -1;
+}
+
+/* Finds the subroutines, the subroutines they call, and where their
+	RETs return to */
+static int find_funcs(cfg_builder_t *b) {
+	c8_cfg_t *cfg = b->cfg;
+	int i, j, k, f, n, sp, ok = 0, *visited = NULL, *stack = NULL, nedges = cfg->nedges;
+	c8_func_t *func;
+
+	/* The program itself, and then every subroutine it calls */
+	for(i = -1; i < nedges; i++) {
+		int entry = i < 0 ? c8_cfg_block(cfg, PROG_OFFSET) : cfg->edges[i].to;
+		if(entry < 0 || (i >= 0 && cfg->edges[i].kind != C8_EDGE_CALL) || find_func(cfg, entry) >= 0)
+			continue;
+		if(!grow((void **)&cfg->funcs, cfg->nfuncs, &b->funcs_size, sizeof *cfg->funcs)) {
+			report(b->d, "error: out of memory\n");
+			return 0;
+		}
+		func = &cfg->funcs[cfg->nfuncs++];
+		func->entry = cfg->blocks[entry].start;
+		func->block = entry;
+		func->ncallees = 0;
+		func->callees = NULL;
+	}
+
+	if(!cfg->nblocks)
+		return 1;
+	visited = malloc(cfg->nblocks * sizeof *visited);
+	stack = malloc(cfg->nblocks * sizeof *stack);
+	if(!visited || !stack) {
+		report(b->d, "error: out of memory\n");
+		goto done;
+	}
+
+	for(f = 0; f < cfg->nfuncs; f++) {
+		int callees_size = 0;
+		func = &cfg->funcs[f];
+		memset(visited, 0, cfg->nblocks * sizeof *visited);
+		visited[func->block] = 1;
+		stack[0] = func->block;
+		sp = 1;
+		while(sp > 0) {
+			i = stack[--sp];
+			if(fetch(b->d, cfg->blocks[i].end - 2) == 0x00EE) {
+				/* Return to every caller */
+				for(j = 0; j < nedges; j++) {
+					if(cfg->edges[j].kind != C8_EDGE_CALL || cfg->edges[j].to != func->block)
+						continue;
+					if(!add_edge(b, i, cfg->blocks[cfg->edges[j].from].end, C8_EDGE_RETURN))
+						goto done;
+				}
+			}
+			for(j = 0; j < nedges; j++) {
+				if(cfg->edges[j].from != i)
+					continue;
+				n = cfg->edges[j].to;
+				if(cfg->edges[j].kind == C8_EDGE_CALL) {
+					k = find_func(cfg, n);
+					for(n = 0; n < func->ncallees && func->callees[n] != k; n++);
+					if(n == func->ncallees) {
+						if(!grow((void **)&func->callees, func->ncallees, &callees_size, sizeof *func->callees)) {
+							report(b->d, "error: out of memory\n");
+							goto done;
+						}
+						func->callees[func->ncallees++] = k;
+					}
+					/* Carry on after the subroutine returns */
+					n = c8_cfg_block(cfg, cfg->blocks[i].end);
+					if(n < 0 || cfg->blocks[n].start != cfg->blocks[i].end)
+						continue;
+				}
+				if(!visited[n]) {
+					visited[n] = 1;
+					stack[sp++] = n;
+				}
+			}
 		}
 	}
+	ok = 1;
+done:
+	free(visited);
+	free(stack);
+	return ok;
+}
+
+c8_cfg_t *c8_cfg_build_r(c8_disasm_t *d) {
+	cfg_builder_t b;
+	c8_cfg_t *cfg;
+
+	d->error[0] = '\0';
+	if(!(cfg = calloc(1, sizeof *cfg))) {
+		report(d, "error: out of memory\n");
+		return NULL;
+	}
+	memset(&b, 0, sizeof b);
+	b.d = d;
+	b.cfg = cfg;
+
+	if(!find_reachable(&b) || !find_blocks(&b) || !find_funcs(&b)) {
+		c8_cfg_free(cfg);
+		cfg = NULL;
+	}
+	free(b.stack);
+	free(b.jumps);
+	free(b.targets);
+	return cfg;
+}
+
+c8_cfg_t *c8_cfg_build() {
+	return c8_cfg_build_r(global_disasm());
+}
+
+void c8_cfg_free(c8_cfg_t *cfg) {
+	int i;
+	if(!cfg)
+		return;
+	for(i = 0; i < cfg->nfuncs; i++)
+		free(cfg->funcs[i].callees);
+	free(cfg->funcs);
+	free(cfg->edges);
+	free(cfg->blocks);
+	free(cfg);
+}
+
+static const char *edge_kinds[] = {"fallthrough", "skip", "jump", "call", "return"};
+
+void c8_cfg_json_r(c8_disasm_t *d, const c8_cfg_t *cfg) {
+	int i, j;
+	c8_write(d->output, "{\n\t\"blocks\": [");
+	for(i = 0; i < cfg->nblocks; i++)
+		c8_write(d->output, "%s\n\t\t{\"start\": %u, \"end\": %u}", i ? "," : "",
+			cfg->blocks[i].start, cfg->blocks[i].end);
+	c8_write(d->output, "\n\t],\n\t\"edges\": [");
+	for(i = 0; i < cfg->nedges; i++)
+		c8_write(d->output, "%s\n\t\t{\"from\": %d, \"to\": %d, \"kind\": \"%s\"}", i ? "," : "",
+			cfg->edges[i].from, cfg->edges[i].to, edge_kinds[cfg->edges[i].kind]);
+	c8_write(d->output, "\n\t],\n\t\"functions\": [");
+	for(i = 0; i < cfg->nfuncs; i++) {
+		c8_write(d->output, "%s\n\t\t{\"entry\": %u, \"block\": %d, \"callees\": [", i ? "," : "",
+			cfg->funcs[i].entry, cfg->funcs[i].block);
+		for(j = 0; j < cfg->funcs[i].ncallees; j++)
+			c8_write(d->output, "%s%d", j ? ", " : "", cfg->funcs[i].callees[j]);
+		c8_write(d->output, "]}");
+	}
+	c8_write(d->output, "\n\t]\n}\n");
+	c8_writer_flush(d->output);
+}
+
+void c8_cfg_json(const c8_cfg_t *cfg) {
+	c8_cfg_json_r(&global, cfg);
+}
+
+void c8_cfg_dot_r(c8_disasm_t *d, const c8_cfg_t *cfg) {
+	static const char *styles[] = {"", "style=dashed", "style=bold", "color=blue", "color=gray, style=dotted"};
+	int i;
+	c8_write(d->output, "digraph chip8 {\n\tnode [shape=box, fontname=\"monospace\"];\n");
+	for(i = 0; i < cfg->nblocks; i++)
+		c8_write(d->output, "\tb%d [label=\"L%03X-%03X\"%s];\n", i, cfg->blocks[i].start, cfg->blocks[i].end - 1,
+			find_func(cfg, i) >= 0 ? ", peripheries=2" : "");
+	for(i = 0; i < cfg->nedges; i++)
+		c8_write(d->output, "\tb%d -> b%d [%s];\n", cfg->edges[i].from, cfg->edges[i].to, styles[cfg->edges[i].kind]);
+	c8_write(d->output, "}\n");
+	c8_writer_flush(d->output);
+}
+
+void c8_cfg_dot(const c8_cfg_t *cfg) {
+	c8_cfg_dot_r(&global, cfg);
+}
+
+void c8_disasm_r(c8_disasm_t *d) {
+	uint16_t addr, max_addr = 0, run, run_end = 0;
+	int odata = 0,
+		out = 0;
+
+	c8_cfg_t *cfg;
+	const uint8_t *reachable, *touched, *labels;
+
+	/* Step 1: Determine which instructions are reachable. */
+	if(!(cfg = c8_cfg_build_r(d)))
+		return;
+	reachable = cfg->reachable;
+	touched = cfg->touched;
+	labels = cfg->labels;
 
 	/* Find the largest non-null address so that we don't write a bunch of
 		unnecessary zeros at the end of our output */
-	for(max_addr = TOTAL_RAM - 1; c8_get(max_addr) == 0; max_addr--);
+	for(max_addr = TOTAL_RAM - 1; max_addr > 0 && d->ram[max_addr] == 0; max_addr--);
 
 	/* Step 2: Loop through all the reachable instructions and print them. */
 	for(addr = PROG_OFFSET; addr < TOTAL_RAM; addr += REACHABLE(addr)?2:1) {
@@ -170,15 +821,15 @@ void c8_disasm() {
 
 				/* Find out a run of 0x00 bytes that are not code (REACHABLE) and not
 				data bytes that are referenced by a `LD I,nnn` (`Annn`) instruction (TOUCHED) */
-				for(run = addr; run < TOTAL_RAM && !REACHABLE(run) && !TOUCHED(run) && !c8_get(run); run++);
+				for(run = addr; run < TOTAL_RAM && !REACHABLE(run) && !TOUCHED(run) && !d->ram[run]; run++);
 
 				if(run - addr > ZERO_RUNS) {
 					if(odata) {
-						c8_message("\n");
+						c8_write(d->output, "\n");
 						odata = 0;
 					}
-					c8_message(" ; skipped run of %u #00 bytes at #%04X...\n", run - addr, addr);
-					c8_message("offset #%04X \n", run);
+					c8_write(d->output, " ; skipped run of %u #00 bytes at #%04X...\n", run - addr, addr);
+					c8_write(d->output, "offset #%04X \n", run);
 
 					run_end = run;
 					continue;
@@ -186,16 +837,16 @@ void c8_disasm() {
 
 				/* Make sure `db` clauses to blocks touched by `LD I, nnn` start on new line: */
 				if(TOUCHED(addr) && odata) {
-					c8_message("\n");
+					c8_write(d->output, "\n");
 					odata = 0;
 				}
 
 				if(!odata++) {
-					c8_message("L%03X: db #%02X", addr, c8_get(addr));
+					c8_write(d->output, "L%03X: db #%02X", addr, d->ram[addr]);
 				} else {
-					c8_message(", #%02X", c8_get(addr));
+					c8_write(d->output, ", #%02X", d->ram[addr]);
 					if(odata % 4 == 0) {
-						c8_message("\n");
+						c8_write(d->output, "\n");
 						odata = 0;
 					}
 				}
@@ -204,7 +855,7 @@ void c8_disasm() {
 			continue;
 		}
 
-		uint16_t opcode = c8_opcode(addr);
+		uint16_t opcode = fetch(d, addr);
 
 		buffer[0] = '\0';
 
@@ -291,15 +942,249 @@ void c8_disasm() {
 			} break;
 		}
 		if(!buffer[0]) {
-			c8_message("error: Disassembler got confused at #%03X\n", addr);
-			return;
+			c8_writer_flush(d->output);
+			report(d, "error: Disassembler got confused at #%03X\n", addr);
+			break;
 		}
 		if(IS_LABEL(addr) || TOUCHED(addr) || !out) {
-			if(odata) c8_message("\n");
-			c8_message("L%03X: %-20s    ; %04X  @ %03X\n", addr, buffer, opcode, addr);
+			if(odata) c8_write(d->output, "\n");
+			c8_write(d->output, "L%03X: %-20s    ; %04X  @ %03X\n", addr, buffer, opcode, addr);
 		} else
-			c8_message("      %-20s    ; %04X  @ %03X\n", buffer, opcode, addr);
+			c8_write(d->output, "      %-20s    ; %04X  @ %03X\n", buffer, opcode, addr);
 		out = 1;
 		odata = 0;
 	}
+	c8_writer_flush(d->output);
+	c8_cfg_free(cfg);
+}
+
+void c8_disasm() {
+	c8_disasm_r(global_disasm());
+}
+
+/* Translation to C:
+	Every reachable instruction at an even address becomes a `case` in a
+	`switch` on the PC, and falls through into the next instruction, so that
+	the translated code can be entered at any of them. A block of
+	instructions ends with a `JP` or a skip, or just before an instruction
+	that draws, reads the keys or the timers, writes to RAM, calls or returns.
+	Those are left to the interpreter, which is the translated code's runtime.
+*/
+
+/* Maximum number of instructions in a block, so that a block spans at
+	most two of the 64-byte pages that the generated code checks */
+#define MAX_C_BLOCK	32
+
+#define C_PAGE_SHIFT	6
+
+/* Writes the C code for the instruction at `addr`.
+	Returns 0 if the instruction is left to the interpreter,
+	1 if it's executed natively and 2 if it also ends the block. */
+static int emit_c(c8_disasm_t *d, uint16_t addr, int dry_run) {
+	uint16_t opcode = fetch(d, addr);
+	uint8_t x = (opcode >> 8) & 0x0F;
+	uint8_t y = (opcode >> 4) & 0x0F;
+	uint16_t nnn = opcode & 0x0FFF;
+	uint8_t kk = opcode & 0xFF;
+
+#define EMIT(...)	do { if(!dry_run) c8_write(d->output, __VA_ARGS__); } while(0)
+
+	switch(opcode & 0xF000) {
+		case 0x1000:
+			EMIT("\t\tC8.PC = 0x%03X;\n\t\tbreak;\n", nnn);
+			return 2;
+		case 0x3000:
+		case 0x4000:
+			EMIT("\t\tC8.PC = C8.V[%d] %s 0x%02X ? 0x%03X : 0x%03X;\n\t\tbreak;\n",
+				x, (opcode & 0xF000) == 0x3000 ? "==" : "!=", kk, addr + 4, addr + 2);
+			return 2;
+		case 0x5000:
+		case 0x9000:
+			EMIT("\t\tC8.PC = C8.V[%d] %s C8.V[%d] ? 0x%03X : 0x%03X;\n\t\tbreak;\n",
+				x, (opcode & 0xF000) == 0x5000 ? "==" : "!=", y, addr + 4, addr + 2);
+			return 2;
+		case 0x6000:
+			EMIT("\t\tC8.V[%d] = 0x%02X;\n", x, kk);
+			return 1;
+		case 0x7000:
+			EMIT("\t\tC8.V[%d] += 0x%02X;\n", x, kk);
+			return 1;
+		case 0x8000:
+			switch(opcode & 0x000F) {
+				case 0x0:
+					EMIT("\t\tC8.V[%d] = C8.V[%d];\n", x, y);
+					break;
+				case 0x1:
+				case 0x2:
+				case 0x3:
+					EMIT("\t\tC8.V[%d] %c= C8.V[%d];\n", x, "|&^"[(opcode & 0x000F) - 1], y);
+					EMIT("\t\tif(quirks & QUIRKS_VF_RESET) C8.V[15] = 0;\n");
+					break;
+				case 0x4:
+					EMIT("\t\tt = C8.V[%d] + C8.V[%d];\n", x, y);
+					EMIT("\t\tC8.V[%d] = t & 0xFF;\n\t\tC8.V[15] = t > 0xFF;\n", x);
+					break;
+				case 0x5:
+					EMIT("\t\tt = C8.V[%d] > C8.V[%d];\n", x, y);
+					EMIT("\t\tC8.V[%d] -= C8.V[%d];\n\t\tC8.V[15] = t;\n", x, y);
+					break;
+				case 0x7:
+					EMIT("\t\tt = C8.V[%d] > C8.V[%d];\n", y, x);
+					EMIT("\t\tC8.V[%d] = C8.V[%d] - C8.V[%d];\n\t\tC8.V[15] = t;\n", x, y, x);
+					break;
+				case 0x6:
+				case 0xE:
+					EMIT("\t\tif(!(quirks & QUIRKS_SHIFT)) C8.V[%d] = C8.V[%d];\n", x, y);
+					if((opcode & 0x000F) == 0x6)
+						EMIT("\t\tt = C8.V[%d] & 0x01;\n\t\tC8.V[%d] >>= 1;\n", x, x);
+					else
+						EMIT("\t\tt = C8.V[%d] >> 7;\n\t\tC8.V[%d] <<= 1;\n", x, x);
+					EMIT("\t\tC8.V[15] = t;\n");
+					break;
+				default:
+					/* The interpreter ignores the other 8xyN instructions */
+					break;
+			}
+			return 1;
+		case 0xA000:
+			EMIT("\t\tC8.I = 0x%03X;\n", nnn);
+			return 1;
+		case 0xF000:
+			if(kk == 0x1E) {
+				EMIT("\t\tC8.I += C8.V[%d];\n", x);
+				EMIT("\t\tC8.V[15] = C8.I > 0xFFF;\n\t\tC8.I &= 0xFFF;\n");
+				return 1;
+			}
+			break;
+	}
+	return 0;
+#undef EMIT
+}
+
+void c8_disasm_c_r(c8_disasm_t *d, const char *name) {
+	c8_cfg_t *cfg;
+	const uint8_t *reachable;
+	uint8_t length[TOTAL_RAM];
+	uint16_t addr, first = TOTAL_RAM, last = 0, end;
+	int n, kind, open = 0;
+
+	if(!(cfg = c8_cfg_build_r(d)))
+		return;
+	reachable = cfg->reachable;
+
+	/* Work out where the blocks end, and how many instructions are executed
+		natively from every address up to the end of its block */
+	memset(length, 0, sizeof length);
+	for(addr = PROG_OFFSET; addr < TOTAL_RAM - 1; addr += 2) {
+		if(!REACHABLE(addr) || !emit_c(d, addr, 1))
+			continue;
+		for(end = addr, n = 0; n < MAX_C_BLOCK && REACHABLE(end); end += 2, n++) {
+			kind = emit_c(d, end, 1);
+			if(kind == 0)
+				break;
+			if(kind == 2) {
+				end += 2;
+				n++;
+				break;
+			}
+		}
+		for(; addr < end; addr += 2, n--)
+			length[addr] = n;
+		addr -= 2;
+	}
+	c8_cfg_free(cfg);
+
+	for(addr = PROG_OFFSET; addr < TOTAL_RAM; addr++) {
+		if(length[addr]) {
+			if(addr < first) first = addr;
+			last = addr;
+		}
+	}
+	if(first > last) {
+		report(d, "error: nothing to translate\n");
+		return;
+	}
+	end = last + 2;
+
+	c8_write(d->output, "/* Translated from a CHIP-8 program by c8dasm.\n\n");
+	c8_write(d->output, "Call %s_start() after loading the program, and c8_run() executes\n", name);
+	c8_write(d->output, "the translated code. Instructions that the translation leaves to the\n");
+	c8_write(d->output, "interpreter and jumps to unknown addresses fall back to the interpreter.\n");
+	c8_write(d->output, "*/\n#include <string.h>\n\n#include \"chip8.h\"\n\n");
+
+	c8_write(d->output, "#define FIRST\t0x%03X\n#define END\t0x%03X\n", first, end);
+	c8_write(d->output, "#define PAGE_SHIFT\t%d\n\n", C_PAGE_SHIFT);
+
+	c8_write(d->output, "/* The translated bytes. Code in a page of RAM only runs while\n");
+	c8_write(d->output, "\tthe page still holds these bytes */\n");
+	c8_write(d->output, "static const uint8_t program[] = {");
+	for(addr = first; addr < end; addr++) {
+		if((addr - first) % 12 == 0)
+			c8_write(d->output, "\n\t");
+		c8_write(d->output, "0x%02X,", d->ram[addr]);
+	}
+	c8_write(d->output, "\n};\n\n");
+
+	c8_write(d->output, "/* Instructions executed natively from each address */\n");
+	c8_write(d->output, "static const uint8_t length[] = {");
+	for(addr = first; addr <= last; addr++) {
+		if((addr - first) % 16 == 0)
+			c8_write(d->output, "\n\t");
+		c8_write(d->output, "%d,", length[addr]);
+	}
+	c8_write(d->output, "\n};\n\n");
+
+	c8_write(d->output, "static uint8_t dirty[TOTAL_RAM >> PAGE_SHIFT];\n\n");
+
+	c8_write(d->output, "static void check(uint16_t addr, int n) {\n");
+	c8_write(d->output, "\tint p, lo, hi;\n");
+	c8_write(d->output, "\tfor(p = addr >> PAGE_SHIFT; p <= (addr + n - 1) >> PAGE_SHIFT && p < (TOTAL_RAM >> PAGE_SHIFT); p++) {\n");
+	c8_write(d->output, "\t\tlo = p << PAGE_SHIFT;\n\t\thi = lo + (1 << PAGE_SHIFT);\n");
+	c8_write(d->output, "\t\tif(lo < FIRST) lo = FIRST;\n\t\tif(hi > END) hi = END;\n");
+	c8_write(d->output, "\t\tif(lo < hi)\n");
+	c8_write(d->output, "\t\t\tdirty[p] = memcmp(C8.RAM + lo, program + lo - FIRST, hi - lo) != 0;\n");
+	c8_write(d->output, "\t}\n}\n\n");
+
+	c8_write(d->output, "static void stored(uint16_t addr, int n) {\n");
+	c8_write(d->output, "\tif(addr + n > TOTAL_RAM)\n\t\tcheck(0, addr + n - TOTAL_RAM);\n");
+	c8_write(d->output, "\tcheck(addr, n);\n}\n\n");
+
+	c8_write(d->output, "static int run(uint16_t pc, int n) {\n");
+	c8_write(d->output, "\tunsigned int quirks;\n\tuint16_t t;\n\tint k;\n\n");
+	c8_write(d->output, "\tif(pc < FIRST || pc >= END - 1)\n\t\treturn 0;\n");
+	c8_write(d->output, "\tk = length[pc - FIRST];\n");
+	c8_write(d->output, "\tif(!k || k > n || dirty[pc >> PAGE_SHIFT] || dirty[(pc + 2 * k - 1) >> PAGE_SHIFT])\n");
+	c8_write(d->output, "\t\treturn 0;\n\n");
+	c8_write(d->output, "\tquirks = c8_get_quirks();\n\t(void)quirks;\n\t(void)t;\n\n");
+	c8_write(d->output, "\tswitch(pc) {\n");
+	for(addr = first; addr <= last; addr += 2) {
+		if(!length[addr])
+			continue;
+		if(open)
+			c8_write(d->output, "\t\t/* fall through */\n");
+		c8_write(d->output, "\tcase 0x%03X: /* %04X */\n", addr, fetch(d, addr));
+		open = 1;
+		kind = emit_c(d, addr, 0);
+		if(kind == 2) {
+			open = 0;
+		} else if(length[addr] == 1) {
+			/* The block ends before an instruction for the interpreter */
+			c8_write(d->output, "\t\tC8.PC = 0x%03X;\n\t\tbreak;\n", addr + 2);
+			open = 0;
+		}
+	}
+	c8_write(d->output, "\t}\n\treturn k;\n}\n\n");
+
+	c8_write(d->output, "int %s_start() {\n", name);
+	c8_write(d->output, "\tcheck(0, TOTAL_RAM);\n");
+	c8_write(d->output, "\tc8_block_hook = run;\n\tc8_store_hook = stored;\n\treturn 1;\n}\n\n");
+
+	c8_write(d->output, "void %s_stop() {\n", name);
+	c8_write(d->output, "\tif(c8_block_hook == run)\n\t\tc8_block_hook = NULL;\n");
+	c8_write(d->output, "\tif(c8_store_hook == stored)\n\t\tc8_store_hook = NULL;\n}\n");
+	c8_writer_flush(d->output);
+}
+
+void c8_disasm_c(const char *name) {
+	c8_disasm_c_r(global_disasm(), name);
 }
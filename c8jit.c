@@ -0,0 +1,456 @@
+/*
+Dynamic recompiler for the CHIP-8 interpreter on x86-64.
+
+It plugs into `c8_run()` through `c8_block_hook`: The first time the PC reaches
+an address, the instructions from that address up to the next branch, skip or
+instruction that it can't translate are translated into a native function,
+which `c8_run()` then calls every time it reaches that address again.
+
+The native code only does arithmetic on the registers, so everything that
+draws, reads the keys or the timers, or writes to RAM is left to the
+interpreter. This keeps the interpreter in charge of the instruction counter
+and thus the timers. The V registers that a block uses most are loaded into
+the host registers `r8b`-`r11b` when the block is entered and stored back to
+`C8` when it is left; the others, `I` and the `PC` are accessed as memory
+operands relative to a pointer to `C8` (in `rdi`).
+
+Self-modifying code is common in CHIP-8 programs. The interpreter calls
+`c8_store_hook` whenever it writes to RAM, and the translations that overlap
+the bytes that were written are thrown away.
+
+The translated functions follow the System V calling convention, and the code
+is placed in memory obtained from `mmap()`, which is switched with `mprotect()`
+between writable while blocks are translated and executable while they run, but
+never both at once. So the JIT is only available on
+x86-64 Unix systems. Everywhere else `c8_jit_start()` returns 0 and the
+interpreter is used.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+#if (defined(__x86_64__) || defined(__amd64__)) && !defined(_WIN32)
+
+#include <sys/mman.h>
+
+/* Size of the memory for the translated code */
+#define ARENA_SIZE		(256 * 1024)
+
+/* Maximum number of instructions in a block */
+#define MAX_BLOCK		32
+
+/* The longest sequence of machine code for a single instruction, with room
+	for the epilogue */
+#define MAX_CODE		48
+
+/* Number of V registers kept in host registers in a block, and the code
+	needed to load and store them */
+#define MAX_HOST_REGS	4
+#define HOST_CODE		(MAX_HOST_REGS * 2 * 7)
+
+/* Translations are tracked in pages of RAM of this size, so that a store
+	to a page without any translated code can be ignored quickly */
+#define PAGE_SHIFT		6
+
+typedef void (*block_fn)(chip8_t *c8);
+
+typedef struct {
+	block_fn code;
+	/* Instructions in the block; 0 if the instruction at this address
+		can't be translated and is left to the interpreter */
+	uint8_t count;
+	uint8_t translated;
+} block_t;
+
+static block_t blocks[TOTAL_RAM];
+static uint8_t code_pages[TOTAL_RAM >> PAGE_SHIFT];
+
+static uint8_t *arena, *code;
+static int writable;
+static unsigned int jit_quirks;
+
+/* The host register (0 for r8b to 3 for r11b) holding each V register in the
+	block being translated, or -1 if it is accessed in memory */
+static int host[16];
+
+/* Registers of the x86 instructions emitted below */
+#define AL	0
+#define CL	1
+#define DL	2
+
+#define V_OFS(x)	((int)offsetof(chip8_t, V) + (x))
+#define I_OFS		((int)offsetof(chip8_t, I))
+#define PC_OFS		((int)offsetof(chip8_t, PC))
+
+static void emit_b(uint8_t b) {
+	*code++ = b;
+}
+
+static void emit_w(uint16_t w) {
+	emit_b(w & 0xFF);
+	emit_b(w >> 8);
+}
+
+static void emit_d(uint32_t d) {
+	emit_w(d & 0xFFFF);
+	emit_w(d >> 16);
+}
+
+/* Emits `op` with a ModRM byte addressing `[rdi + disp32]` */
+static void emit_mem(uint8_t op, int reg, int disp) {
+	emit_b(op);
+	emit_b(0x80 | (reg << 3) | 7);
+	emit_d(disp);
+}
+
+/* Emits `op` (a two byte opcode if it is above #FF) with the register Vx as
+	its r/m operand, which is either a host register or in memory */
+static void emit_v(uint16_t op, int reg, int x) {
+	if(host[x] < 0) {
+		if(op > 0xFF)
+			emit_b(op >> 8);
+		emit_mem(op & 0xFF, reg, V_OFS(x));
+		return;
+	}
+	emit_b(0x41);										/* REX.B for r8-r11 */
+	if(op > 0xFF)
+		emit_b(op >> 8);
+	emit_b(op & 0xFF);
+	emit_b(0xC0 | (reg << 3) | host[x]);
+}
+
+/* Emits `mov cx, pc+2`, `mov dx, pc+4` followed by the comparison of
+	a skip instruction, and `cmov` to choose the new PC */
+static void emit_skip(uint16_t opcode, uint16_t pc) {
+	uint8_t x = (opcode >> 8) & 0x0F;
+	uint8_t y = (opcode >> 4) & 0x0F;
+	int skip_if_equal = (opcode & 0xF000) == 0x3000 || (opcode & 0xF000) == 0x5000;
+
+	emit_b(0xB9); emit_d(pc + 2);					/* mov ecx, pc + 2 */
+	emit_b(0xBA); emit_d(pc + 4);					/* mov edx, pc + 4 */
+	if((opcode & 0xF000) == 0x3000 || (opcode & 0xF000) == 0x4000) {
+		emit_v(0x80, 7, x); emit_b(opcode & 0xFF);	/* cmp byte [Vx], kk */
+	} else {
+		emit_v(0x8A, AL, x);				/* mov al, [Vx] */
+		emit_v(0x3A, AL, y);				/* cmp al, [Vy] */
+	}
+	emit_b(0x0F); emit_b(skip_if_equal ? 0x44 : 0x45); emit_b(0xCA);	/* cmove/cmovne ecx, edx */
+	emit_b(0x66); emit_mem(0x89, CL, PC_OFS);		/* mov [PC], cx */
+}
+
+/* Emits the code for a single instruction.
+	Returns 0 if the instruction can't be translated */
+static int emit_insn(uint16_t opcode, unsigned int quirks) {
+	uint8_t x = (opcode >> 8) & 0x0F;
+	uint8_t y = (opcode >> 4) & 0x0F;
+	uint8_t kk = opcode & 0xFF;
+
+	switch(opcode & 0xF000) {
+		case 0x6000:
+			/* LD Vx, kk */
+			emit_v(0xC6, 0, x); emit_b(kk);	/* mov byte [Vx], kk */
+			return 1;
+		case 0x7000:
+			/* ADD Vx, kk */
+			emit_v(0x80, 0, x); emit_b(kk);	/* add byte [Vx], kk */
+			return 1;
+		case 0x8000:
+			switch(opcode & 0x000F) {
+				case 0x0:
+					/* LD Vx, Vy */
+					emit_v(0x8A, AL, y);		/* mov al, [Vy] */
+					emit_v(0x88, AL, x);		/* mov [Vx], al */
+					return 1;
+				case 0x1:
+				case 0x2:
+				case 0x3: {
+					/* OR, AND, XOR Vx, Vy */
+					static const uint8_t ops[] = {0x08, 0x20, 0x30};
+					emit_v(0x8A, AL, y);		/* mov al, [Vy] */
+					emit_v(ops[(opcode & 0x000F) - 1], AL, x);	/* op [Vx], al */
+					if(quirks & QUIRKS_VF_RESET) {
+						emit_v(0xC6, 0, 0xF); emit_b(0);	/* mov byte [VF], 0 */
+					}
+				} return 1;
+				case 0x4:
+					/* ADD Vx, Vy */
+					emit_v(0x8A, AL, x);		/* mov al, [Vx] */
+					emit_v(0x02, AL, y);		/* add al, [Vy] */
+					emit_v(0x88, AL, x);		/* mov [Vx], al */
+					emit_v(0x0F92, 0, 0xF);	/* setc [VF] */
+					return 1;
+				case 0x5:
+				case 0x7: {
+					/* SUB Vx, Vy and SUBN Vx, Vy. VF is set if there's no
+						borrow, but not if the operands are equal */
+					int a = (opcode & 0x000F) == 0x5 ? x : y;
+					int b = (opcode & 0x000F) == 0x5 ? y : x;
+					emit_v(0x8A, AL, a);		/* mov al, [Va] */
+					emit_v(0x3A, AL, b);		/* cmp al, [Vb] */
+					emit_b(0x0F); emit_b(0x97); emit_b(0xC2);	/* seta dl */
+					emit_v(0x2A, AL, b);		/* sub al, [Vb] */
+					emit_v(0x88, AL, x);		/* mov [Vx], al */
+					emit_v(0x88, DL, 0xF);		/* mov [VF], dl */
+				} return 1;
+				case 0x6:
+				case 0xE:
+					/* SHR Vx, Vy and SHL Vx, Vy */
+					emit_v(0x8A, AL, (quirks & QUIRKS_SHIFT) ? x : y);	/* mov al, [Vx or Vy] */
+					emit_b(0xD0); emit_b((opcode & 0x000F) == 0x6 ? 0xE8 : 0xE0);	/* shr/shl al, 1 */
+					emit_b(0x0F); emit_b(0x92); emit_b(0xC2);	/* setc dl */
+					emit_v(0x88, AL, x);		/* mov [Vx], al */
+					emit_v(0x88, DL, 0xF);		/* mov [VF], dl */
+					return 1;
+				default:
+					/* The interpreter ignores the other 8xyN instructions */
+					return 1;
+			}
+		case 0xA000:
+			/* LD I, nnn */
+			emit_b(0x66); emit_mem(0xC7, 0, I_OFS); emit_w(opcode & 0x0FFF);	/* mov word [I], nnn */
+			return 1;
+		case 0xF000:
+			if(kk == 0x1E) {
+				/* ADD I, Vx; VF is set if I goes past #FFF */
+				emit_b(0x0F); emit_mem(0xB7, AL, I_OFS);		/* movzx eax, word [I] */
+				emit_v(0x0FB6, DL, x);	/* movzx edx, byte [Vx] */
+				emit_b(0x66); emit_b(0x01); emit_b(0xD0);		/* add ax, dx */
+				emit_b(0x66); emit_b(0x3D); emit_w(0x0FFF);		/* cmp ax, #FFF */
+				emit_b(0x0F); emit_b(0x97); emit_b(0xC2);		/* seta dl */
+				emit_b(0x66); emit_b(0x25); emit_w(0x0FFF);		/* and ax, #FFF */
+				emit_b(0x66); emit_mem(0x89, AL, I_OFS);		/* mov [I], ax */
+				emit_v(0x88, DL, 0xF);				/* mov [VF], dl */
+				return 1;
+			}
+			break;
+	}
+	return 0;
+}
+
+/* Marks the pages of RAM that hold the block at `pc` */
+static void mark_pages(uint16_t pc, int count) {
+	int p;
+	for(p = pc >> PAGE_SHIFT; p <= (pc + count * 2 - 1) >> PAGE_SHIFT; p++)
+		code_pages[p] = 1;
+}
+
+/* Emits the code for up to `limit` instructions from `pc`.
+	Returns the number of instructions, and sets `*branched` if the last
+	one is a jump or a skip that sets the PC itself */
+static int emit_block(uint16_t pc, int limit, int *branched) {
+	uint16_t addr = pc, opcode;
+	int count = 0;
+
+	*branched = 0;
+	while(count < limit && addr + 2 <= TOTAL_RAM) {
+		opcode = c8_opcode(addr);
+		if((opcode & 0xF000) == 0x1000) {
+			/* JP nnn ends the block */
+			emit_b(0x66); emit_mem(0xC7, 0, PC_OFS); emit_w(opcode & 0x0FFF);	/* mov word [PC], nnn */
+			*branched = 1;
+			return count + 1;
+		}
+		if(((opcode & 0xF000) == 0x3000 || (opcode & 0xF000) == 0x4000
+				|| (opcode & 0xF000) == 0x5000 || (opcode & 0xF000) == 0x9000)) {
+			/* so does a skip */
+			emit_skip(opcode, addr);
+			*branched = 1;
+			return count + 1;
+		}
+		if(!emit_insn(opcode, jit_quirks))
+			break;
+		count++;
+		addr += 2;
+	}
+	return count;
+}
+
+/* Chooses the V registers that are kept in host registers in the block of
+	`count` instructions at `pc`: those used most, if they are used more than
+	once, since loading and storing them costs about as much as one access */
+static void allocate(uint16_t pc, int count) {
+	int uses[16] = {0}, i, r, x, best;
+	uint16_t opcode;
+
+	for(i = 0; i < 16; i++)
+		host[i] = -1;
+	for(i = 0; i < count; i++) {
+		opcode = c8_opcode(pc + i * 2);
+		if((opcode & 0xF000) == 0x1000 || (opcode & 0xF000) == 0xA000)
+			continue;
+		uses[(opcode >> 8) & 0x0F]++;
+		if((opcode & 0xF000) == 0x5000 || (opcode & 0xF000) == 0x8000 || (opcode & 0xF000) == 0x9000)
+			uses[(opcode >> 4) & 0x0F]++;
+		if((opcode & 0xF000) == 0x8000 || (opcode & 0xF000) == 0xF000)
+			uses[0xF]++;
+	}
+	for(r = 0; r < MAX_HOST_REGS; r++) {
+		best = -1;
+		for(x = 0; x < 16; x++)
+			if(host[x] < 0 && uses[x] > 1 && (best < 0 || uses[x] > uses[best]))
+				best = x;
+		if(best < 0)
+			break;
+		host[best] = r;
+	}
+}
+
+/* Emits `mov` between the V registers kept in host registers and `C8`;
+	`op` is #8A to load them and #88 to store them */
+static void emit_host_regs(uint8_t op) {
+	int x;
+	for(x = 0; x < 16; x++)
+		if(host[x] >= 0) {
+			emit_b(0x44);								/* REX.R for r8-r11 */
+			emit_mem(op, host[x], V_OFS(x));			/* mov rNb, [Vx] or mov [Vx], rNb */
+		}
+}
+
+/* Makes the arena either writable or executable, but never both.
+	Returns 0 if `mprotect()` fails */
+static int protect(int executable) {
+	if(writable == !executable)
+		return 1;
+	if(mprotect(arena, ARENA_SIZE, executable ? PROT_READ | PROT_EXEC : PROT_READ | PROT_WRITE))
+		return 0;
+	writable = !executable;
+	return 1;
+}
+
+static void translate(uint16_t pc) {
+	block_t *b = &blocks[pc];
+	uint8_t *start;
+	int branched, i;
+
+	b->translated = 1;
+	b->count = 0;
+	if(!protect(0))
+		return;
+	if(code + MAX_BLOCK * MAX_CODE + HOST_CODE > arena + ARENA_SIZE)
+		c8_jit_flush();
+
+	/* The first pass with every register in memory finds the end of the block,
+		the second one emits it with the registers allocated */
+	start = code;
+	for(i = 0; i < 16; i++)
+		host[i] = -1;
+	b->count = emit_block(pc, MAX_BLOCK, &branched);
+	code = start;
+	if(b->count == 0)
+		return;
+
+	allocate(pc, b->count);
+	emit_host_regs(0x8A);
+	emit_block(pc, b->count, &branched);
+	if(!branched) {
+		/* The block ended before an instruction for the interpreter */
+		emit_b(0x66); emit_mem(0xC7, 0, PC_OFS); emit_w(pc + b->count * 2);	/* mov word [PC], addr */
+	}
+	emit_host_regs(0x88);
+	emit_b(0xC3);												/* ret */
+	b->code = (block_fn)start;
+	mark_pages(pc, b->count);
+}
+
+static int run_block(uint16_t pc, int n) {
+	block_t *b = &blocks[pc];
+	if(c8_get_quirks() != jit_quirks) {
+		c8_jit_flush();
+		jit_quirks = c8_get_quirks();
+	}
+	if(!b->translated)
+		translate(pc);
+	if(!b->count || b->count > n || !protect(1))
+		return 0;
+	b->code(&C8);
+	return b->count;
+}
+
+static void invalidate(uint16_t addr, int n) {
+	int p, a, first, last = addr + n - 1;
+	block_t *b;
+
+	if(n > TOTAL_RAM / 4) {
+		c8_jit_flush();
+		return;
+	}
+	if(last >= TOTAL_RAM) {
+		/* The store wrapped around to the start of RAM */
+		invalidate(0, last - TOTAL_RAM + 1);
+		last = TOTAL_RAM - 1;
+	}
+	for(p = addr >> PAGE_SHIFT; p <= last >> PAGE_SHIFT; p++)
+		if(code_pages[p])
+			break;
+	if(p > last >> PAGE_SHIFT)
+		return;
+
+	/* Throw away the blocks that overlap [addr, addr + n) */
+	first = addr - MAX_BLOCK * 2;
+	if(first < 0)
+		first = 0;
+	for(a = first; a <= last; a++) {
+		b = &blocks[a];
+		if(b->count && a + b->count * 2 > addr) {
+			b->translated = 0;
+			b->count = 0;
+		}
+	}
+}
+
+int c8_jit_start() {
+	/* The trace compiler or the program has the hooks */
+	if((c8_block_hook && c8_block_hook != run_block) || (c8_store_hook && c8_store_hook != invalidate))
+		return 0;
+	if(!arena) {
+		arena = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(arena == MAP_FAILED) {
+			arena = NULL;
+			return 0;
+		}
+		writable = 1;
+	}
+	c8_jit_flush();
+	jit_quirks = c8_get_quirks();
+	c8_block_hook = run_block;
+	c8_store_hook = invalidate;
+	return 1;
+}
+
+void c8_jit_stop() {
+	if(c8_block_hook == run_block)
+		c8_block_hook = NULL;
+	if(c8_store_hook == invalidate)
+		c8_store_hook = NULL;
+	if(arena) {
+		munmap(arena, ARENA_SIZE);
+		arena = NULL;
+	}
+}
+
+void c8_jit_flush() {
+	memset(blocks, 0, sizeof blocks);
+	memset(code_pages, 0, sizeof code_pages);
+	code = arena;
+}
+
+#else
+
+/* Portable fallback: The interpreter does all the work */
+
+int c8_jit_start() {
+	return 0;
+}
+
+void c8_jit_stop() {
+}
+
+void c8_jit_flush() {
+}
+
+#endif
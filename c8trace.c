@@ -0,0 +1,407 @@
+/*
+Trace compiler for the CHIP-8 interpreter.
+
+Despite the name, nothing is compiled to native code: a trace is a list of
+pre-decoded instructions that `run_trace()` interprets without going back to
+`c8_run()`'s dispatch, which is where the time is saved.
+
+CHIP-8 game loops are tight cycles of `JP`s, `CALL`s and `RET`s. This tier
+plugs into `c8_run()` through `c8_block_hook` and looks for those loops:
+
+* Every time the PC moves backwards (the target of a loop's `JP`, or the
+  `RET` at the end of a subroutine) a counter for the destination is bumped.
+* When a counter reaches `HOT_THRESHOLD`, the tier records a trace from that
+  address: It executes the instructions itself, one at a time, and appends
+  them to the trace along with the direction every branch took. A `JP`
+  stays in the trace only so that it is counted as an instruction; running
+  it does nothing, since the trace goes on with the instruction it jumped
+  to. `CALL`s and `RET`s are kept so that the stack stays exact, and
+  subroutine bodies are recorded inline.
+* Recording stops when the PC gets back to the start of the trace (the trace
+  then loops), at an instruction the tier leaves to the interpreter, or when
+  the trace is full.
+* The next time the PC reaches the start of the trace, the trace runs
+  instead of the interpreter. Skips and `RET`s are guards: if one goes
+  another way than it did while recording, the trace exits with the PC set
+  to where the instruction went, and `c8_run()` continues in the
+  interpreter with exactly the state it would have had.
+
+Instructions are decoded once into `insn_t` (with the quirks already
+applied) and cached per address, so neither the recorder nor the traces
+decode opcodes again.
+
+Like the JIT, the tier leaves everything that draws, reads the keys or the
+timers, or writes to RAM to the interpreter. Decoded instructions and traces
+remember the generation of RAM they were made in, and are thrown away if
+`c8_clean()` says that the program has written over them since.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+/* Backward branches to an address before it is traced */
+#define HOT_THRESHOLD	32
+
+/* Maximum number of instructions in a trace */
+#define MAX_TRACE		128
+
+/* Maximum number of traces before they are all flushed */
+#define MAX_TRACES		64
+
+enum {
+	K_UNDECODED = 0,
+	K_INTERP,		/* left to the interpreter */
+	K_JP,
+	K_CALL,
+	K_RET,
+	K_SE_KK,
+	K_SNE_KK,
+	K_SE_XY,
+	K_SNE_XY,
+	K_LD_KK,
+	K_ADD_KK,
+	K_LD_XY,
+	K_OR,
+	K_AND,
+	K_XOR,
+	K_OR_RESET,		/* with QUIRKS_VF_RESET */
+	K_AND_RESET,
+	K_XOR_RESET,
+	K_ADD_XY,
+	K_SUB,
+	K_SUBN,
+	K_SHR,			/* Vx = Vy >> 1 */
+	K_SHL,
+	K_NOP,			/* the 8xyN instructions the interpreter ignores */
+	K_LD_I,
+	K_ADD_I,
+	/* Only in traces: */
+	K_LOOP,			/* back to the start of the trace */
+	K_EXIT,			/* leave the trace at `pc` */
+};
+
+typedef struct {
+	uint8_t kind;
+	uint8_t x, y;	/* for K_SHR and K_SHL, `y` is the source after the quirks */
+	uint8_t kk;
+	uint16_t nnn;
+	uint64_t gen;
+} insn_t;
+
+typedef struct {
+	insn_t i;
+	uint16_t pc;
+	/* Where a skip went, or where a RET returned to, while recording */
+	uint16_t next;
+} trace_op_t;
+
+typedef struct {
+	uint16_t head;
+	uint16_t length;
+	/* The pages of RAM the trace was recorded from, and when */
+	uint64_t pages;
+	uint64_t gen;
+	trace_op_t ops[MAX_TRACE];
+} trace_t;
+
+static insn_t decoded[TOTAL_RAM];
+static uint8_t hot[TOTAL_RAM];
+
+/* Index + 1 of the trace that starts at each address */
+static uint8_t trace_at[TOTAL_RAM];
+static trace_t traces[MAX_TRACES];
+static int n_traces;
+
+static unsigned int trace_quirks;
+static uint16_t last_pc;
+
+static const insn_t *decode(uint16_t pc) {
+	insn_t *i = &decoded[pc];
+	uint16_t opcode;
+	if(i->kind != K_UNDECODED && c8_clean(pc, 2, i->gen))
+		return i;
+
+	opcode = c8_opcode(pc);
+	i->gen = c8_generation();
+	i->x = (opcode >> 8) & 0x0F;
+	i->y = (opcode >> 4) & 0x0F;
+	i->kk = opcode & 0xFF;
+	i->nnn = opcode & 0x0FFF;
+	i->kind = K_INTERP;
+
+	switch(opcode & 0xF000) {
+		case 0x0000: if(opcode == 0x00EE) i->kind = K_RET; break;
+		case 0x1000: i->kind = K_JP; break;
+		case 0x2000: i->kind = K_CALL; break;
+		case 0x3000: i->kind = K_SE_KK; break;
+		case 0x4000: i->kind = K_SNE_KK; break;
+		case 0x5000: i->kind = K_SE_XY; break;
+		case 0x6000: i->kind = K_LD_KK; break;
+		case 0x7000: i->kind = K_ADD_KK; break;
+		case 0x8000:
+			switch(opcode & 0x000F) {
+				case 0x0: i->kind = K_LD_XY; break;
+				case 0x1: i->kind = (trace_quirks & QUIRKS_VF_RESET) ? K_OR_RESET : K_OR; break;
+				case 0x2: i->kind = (trace_quirks & QUIRKS_VF_RESET) ? K_AND_RESET : K_AND; break;
+				case 0x3: i->kind = (trace_quirks & QUIRKS_VF_RESET) ? K_XOR_RESET : K_XOR; break;
+				case 0x4: i->kind = K_ADD_XY; break;
+				case 0x5: i->kind = K_SUB; break;
+				case 0x7: i->kind = K_SUBN; break;
+				case 0x6:
+				case 0xE:
+					i->kind = (opcode & 0x000F) == 0x6 ? K_SHR : K_SHL;
+					if(trace_quirks & QUIRKS_SHIFT)
+						i->y = i->x;
+					break;
+				default: i->kind = K_NOP; break;
+			}
+			break;
+		case 0x9000: i->kind = K_SNE_XY; break;
+		case 0xA000: i->kind = K_LD_I; break;
+		case 0xF000: if(i->kk == 0x1E) i->kind = K_ADD_I; break;
+	}
+	return i;
+}
+
+/* Executes the arithmetic instructions; the caller handles the ones that
+	change the flow of control */
+static void execute(const insn_t *i) {
+	uint16_t t;
+	switch(i->kind) {
+		case K_LD_KK: C8.V[i->x] = i->kk; break;
+		case K_ADD_KK: C8.V[i->x] += i->kk; break;
+		case K_LD_XY: C8.V[i->x] = C8.V[i->y]; break;
+		case K_OR: C8.V[i->x] |= C8.V[i->y]; break;
+		case K_AND: C8.V[i->x] &= C8.V[i->y]; break;
+		case K_XOR: C8.V[i->x] ^= C8.V[i->y]; break;
+		case K_OR_RESET: C8.V[i->x] |= C8.V[i->y]; C8.V[0xF] = 0; break;
+		case K_AND_RESET: C8.V[i->x] &= C8.V[i->y]; C8.V[0xF] = 0; break;
+		case K_XOR_RESET: C8.V[i->x] ^= C8.V[i->y]; C8.V[0xF] = 0; break;
+		case K_ADD_XY:
+			t = C8.V[i->x] + C8.V[i->y];
+			C8.V[i->x] = t & 0xFF;
+			C8.V[0xF] = t > 0xFF;
+			break;
+		case K_SUB:
+			t = C8.V[i->x] > C8.V[i->y];
+			C8.V[i->x] -= C8.V[i->y];
+			C8.V[0xF] = t;
+			break;
+		case K_SUBN:
+			t = C8.V[i->y] > C8.V[i->x];
+			C8.V[i->x] = C8.V[i->y] - C8.V[i->x];
+			C8.V[0xF] = t;
+			break;
+		case K_SHR:
+			t = C8.V[i->y] & 0x01;
+			C8.V[i->x] = C8.V[i->y] >> 1;
+			C8.V[0xF] = t;
+			break;
+		case K_SHL:
+			t = C8.V[i->y] >> 7;
+			C8.V[i->x] = C8.V[i->y] << 1;
+			C8.V[0xF] = t;
+			break;
+		case K_LD_I: C8.I = i->nnn; break;
+		case K_ADD_I:
+			C8.I += C8.V[i->x];
+			C8.V[0xF] = C8.I > 0xFFF;
+			C8.I &= 0xFFF;
+			break;
+	}
+}
+
+/* Would the skip instruction `i` skip? */
+static int skips(const insn_t *i) {
+	switch(i->kind) {
+		case K_SE_KK: return C8.V[i->x] == i->kk;
+		case K_SNE_KK: return C8.V[i->x] != i->kk;
+		case K_SE_XY: return C8.V[i->x] == C8.V[i->y];
+		case K_SNE_XY: return C8.V[i->x] != C8.V[i->y];
+	}
+	return 0;
+}
+
+#define IS_SKIP(k)	((k) >= K_SE_KK && (k) <= K_SNE_XY)
+
+/* Records a trace starting at `head` while executing it, for at most
+	`n` instructions. Returns the number of instructions executed. */
+static int record(uint16_t head, int n) {
+	trace_t *t;
+	trace_op_t *op;
+	const insn_t *i;
+	uint16_t pc = head;
+	int done = 0;
+
+	if(n_traces == MAX_TRACES)
+		c8_trace_flush();
+	t = &traces[n_traces];
+	t->head = head;
+	t->length = 0;
+	t->pages = 0;
+	t->gen = c8_generation();
+
+	for(;;) {
+		if(t->length > 0 && pc == head) {
+			t->ops[t->length++].i.kind = K_LOOP;
+			break;
+		}
+		i = decode(pc);
+		op = &t->ops[t->length];
+		op->pc = pc;
+		if(done == n) {
+			/* Out of instructions; this trace is incomplete */
+			C8.PC = pc;
+			return done;
+		}
+		if(t->length == MAX_TRACE - 1 || i->kind == K_INTERP || pc > TOTAL_RAM - 2
+				|| (i->kind == K_CALL && C8.SP >= 16) || (i->kind == K_RET && C8.SP == 0)) {
+			op->i.kind = K_EXIT;
+			t->length++;
+			break;
+		}
+
+		op->i = *i;
+		t->pages |= (uint64_t)1 << (pc >> C8_PAGE_SHIFT) | (uint64_t)1 << ((pc + 1) >> C8_PAGE_SHIFT);
+		t->length++;
+		done++;
+
+		if(i->kind == K_JP) {
+			pc = i->nnn;
+		} else if(i->kind == K_CALL) {
+			C8.stack[C8.SP++] = pc + 2;
+			pc = i->nnn;
+		} else if(i->kind == K_RET) {
+			pc = C8.stack[--C8.SP];
+			op->next = pc;
+		} else if(IS_SKIP(i->kind)) {
+			pc += skips(i) ? 4 : 2;
+			op->next = pc;
+		} else {
+			execute(i);
+			pc += 2;
+		}
+		if(pc >= TOTAL_RAM) {
+			/* Let the interpreter wrap around */
+			op = &t->ops[t->length++];
+			op->i.kind = K_EXIT;
+			op->pc = pc;
+			break;
+		}
+	}
+
+	trace_at[head] = ++n_traces;
+	C8.PC = pc;
+	return done;
+}
+
+/* Has the program written over the trace `t` since it was recorded? */
+static int dirty(const trace_t *t) {
+	uint64_t pages;
+	int p;
+	for(pages = t->pages, p = 0; pages; pages >>= 1, p++)
+		if((pages & 1) && !c8_clean(p << C8_PAGE_SHIFT, 1, t->gen))
+			return 1;
+	return 0;
+}
+
+/* Runs the trace `t` for at most `n` instructions. */
+static int run_trace(const trace_t *t, int n) {
+	const trace_op_t *op = t->ops;
+	uint16_t pc;
+	int done = 0;
+
+	for(;; op++) {
+		switch(op->i.kind) {
+			case K_LOOP:
+				op = t->ops - 1;
+				continue;
+			case K_EXIT:
+				C8.PC = op->pc;
+				return done;
+		}
+		if(done == n || (op->i.kind == K_CALL && C8.SP >= 16) || (op->i.kind == K_RET && C8.SP == 0)) {
+			/* Leave it to the interpreter */
+			C8.PC = op->pc;
+			return done;
+		}
+		done++;
+		switch(op->i.kind) {
+			case K_JP:
+				break;
+			case K_CALL:
+				C8.stack[C8.SP++] = op->pc + 2;
+				break;
+			case K_RET:
+				pc = C8.stack[--C8.SP];
+				if(pc != op->next) {
+					C8.PC = pc;
+					return done;
+				}
+				break;
+			case K_SE_KK:
+			case K_SNE_KK:
+			case K_SE_XY:
+			case K_SNE_XY:
+				pc = op->pc + (skips(&op->i) ? 4 : 2);
+				if(pc != op->next) {
+					C8.PC = pc;
+					return done;
+				}
+				break;
+			default:
+				execute(&op->i);
+				break;
+		}
+	}
+}
+
+static int run(uint16_t pc, int n) {
+	int backward = pc <= last_pc, done;
+
+	if(c8_get_quirks() != trace_quirks) {
+		c8_trace_flush();
+		trace_quirks = c8_get_quirks();
+	}
+
+	last_pc = pc;
+	if(trace_at[pc] && dirty(&traces[trace_at[pc] - 1]))
+		trace_at[pc] = 0;
+	if(trace_at[pc]) {
+		done = run_trace(&traces[trace_at[pc] - 1], n);
+	} else if(backward && ++hot[pc] >= HOT_THRESHOLD) {
+		hot[pc] = 0;
+		done = record(pc, n);
+	} else
+		return 0;
+
+	/* Don't count the exit from a trace as a backward branch */
+	last_pc = 0;
+	return done;
+}
+
+int c8_trace_start() {
+	/* The JIT or the program has the hook */
+	if(c8_block_hook && c8_block_hook != run)
+		return 0;
+	c8_trace_flush();
+	trace_quirks = c8_get_quirks();
+	c8_block_hook = run;
+	return 1;
+}
+
+void c8_trace_stop() {
+	if(c8_block_hook == run)
+		c8_block_hook = NULL;
+}
+
+void c8_trace_flush() {
+	memset(decoded, 0, sizeof decoded);
+	memset(hot, 0, sizeof hot);
+	memset(trace_at, 0, sizeof trace_at);
+	n_traces = 0;
+	last_pc = 0;
+}
@@ -54,6 +54,22 @@ static uint16_t keys;
 /* HP48 flags for SuperChip Fx75 and Fx85 instructions */
 static uint8_t hp48_flags[16];
 
+/* Coverage: a bit for every address the PC executed, and for every value
+	of I that a DRW or LD Vx, [I] read from (see c8_coverage_start()) */
+static int recording;
+static uint8_t executed[TOTAL_RAM/8], read_data[TOTAL_RAM/8];
+
+#define COVER(map, addr)	do { \
+		if(recording) map[((addr) & RAM_MASK) >> 3] |= 1 << ((addr) & 0x07); \
+	} while(0)
+
+/* Instruction counter, and the tick at which the timers were last
+	brought up to date; every `tick_rate` instructions are `rate_ticks`
+	ticks (see c8_set_tick_rate()) */
+static uint64_t cycles;
+static unsigned int tick_rate, rate_ticks;
+static uint64_t timer_tick, yield_tick;
+
 /* Text output function */
 char c8_message_text[MAX_MESSAGE_TEXT];
 static int _puts_default(const char* s) {
@@ -64,6 +80,8 @@ int (*c8_puts)(const char* s) = _puts_default;
 int (*c8_rand)() = rand;
 
 c8_sys_hook_t c8_sys_hook = NULL;
+c8_block_hook_t c8_block_hook = NULL;
+c8_store_hook_t c8_store_hook = NULL;
 
 /* Standard 4x5 font */
 static const uint8_t font[] = {
@@ -105,9 +123,61 @@ static const uint8_t hfont[] = {
 /* 'F' */ 0xFE, 0x80, 0x80, 0x80, 0xF8, 0x80, 0x80, 0x80, 0x80, 0x00,
 };
 
+/* Stores:
+	RAM is only written by store(), or in bulk by code that calls written()
+	afterwards, so that the guard bytes, the generation counters and
+	c8_store_hook never miss a write. */
+
+/* The generation of each page of RAM, and of RAM as a whole */
+static uint64_t page_gen[C8_PAGES];
+static uint64_t generation;
+
+/* The pages the PC has been in since c8_reset(), for c8_stats.code_stores */
+static uint64_t code_pages;
+#if C8_PAGES > 64
+#  error "code_pages needs a bit for every page"
+#endif
+#define PAGE_BIT(addr)	((uint64_t)1 << (((addr) >> C8_PAGE_SHIFT) & (C8_PAGES - 1)))
+
+/* Keeps the guard bytes after RAM in sync with the start of RAM
+	after `n` bytes were stored at `addr` (see RAM_GUARD in chip8.h) */
+static void sync_guard(uint16_t addr, int n) {
+	assert(addr < TOTAL_RAM && (n <= RAM_GUARD || addr + n <= TOTAL_RAM));
+	if(addr + n > TOTAL_RAM)
+		memcpy(C8.RAM, C8.RAM + TOTAL_RAM, addr + n - TOTAL_RAM);
+	else if(addr < RAM_GUARD)
+		memcpy(C8.RAM + TOTAL_RAM + addr, C8.RAM + addr, (addr + n > RAM_GUARD) ? RAM_GUARD - addr : n);
+}
+
+/* Called after `n` bytes of RAM were changed at `addr` */
+static void written(uint16_t addr, int n) {
+	int p, last = (addr + n - 1) >> C8_PAGE_SHIFT;
+	sync_guard(addr, n);
+	generation++;
+	for(p = addr >> C8_PAGE_SHIFT; p <= last; p++)
+		page_gen[p & (C8_PAGES - 1)] = generation;
+	if(c8_store_hook)
+		c8_store_hook(addr, n);
+}
+
+/* Stores `n` bytes at `addr`; a store at the end of RAM that is no longer
+	than RAM_GUARD wraps around to the start */
+static void store(uint16_t addr, const void *bytes, int n) {
+	memcpy(C8.RAM + addr, bytes, n);
+	written(addr, n);
+}
+
+/* A store by the program itself, which may be changing its own code */
+static void program_store(uint16_t addr, const void *bytes, int n) {
+	c8_stats.stores++;
+	if(code_pages & (PAGE_BIT(addr) | PAGE_BIT(addr + n - 1)))
+		c8_stats.code_stores++;
+	store(addr, bytes, n);
+}
+
 void c8_reset() {
 	memset(C8.V, 0, sizeof C8.V);
-	memset(C8.RAM, 0, sizeof C8.RAM);
+	memset(C8.RAM, 0, TOTAL_RAM);
 	C8.PC = PROG_OFFSET;
 	C8.I = 0;
 	C8.DT = 0;
@@ -119,21 +189,98 @@ void c8_reset() {
 	memcpy(C8.RAM + FONT_OFFSET, font, sizeof font);
 	assert(HFONT_OFFSET + sizeof hfont <= FONT_OFFSET);
 	memcpy(C8.RAM + HFONT_OFFSET, hfont, sizeof hfont);
+	written(0, TOTAL_RAM);
+	code_pages = 0;
 
+	memset(pixels, 0, sizeof pixels);
 	hi_res = 0;
 	screen_updated = 0;
+	keys = 0;
 	yield = 0;
 	borked = 0;
+
+	cycles = 0;
+	timer_tick = 0;
+	yield_tick = 0;
 }
 
-void c8_step() {
-	assert(C8.PC < TOTAL_RAM);
+/* Everything that makes up a machine, for c8_save_state() and c8_load_state() */
+typedef struct {
+	chip8_t regs;
+	uint8_t pixels[sizeof pixels];
+	int yield, borked;
+	int screen_updated, hi_res;
+	uint16_t keys;
+	uint8_t hp48_flags[sizeof hp48_flags];
+	unsigned int quirks;
+	uint64_t cycles;
+	unsigned int tick_rate, rate_ticks;
+	uint64_t timer_tick, yield_tick;
+} state_t;
 
-	if(yield || borked) return;
+size_t c8_state_size() {
+	return sizeof(state_t);
+}
 
-	uint16_t opcode = C8.RAM[C8.PC] << 8 | C8.RAM[C8.PC+1];
-	C8.PC += 2;
+void c8_save_state(void *state) {
+	state_t *s = state;
+	memcpy(&s->regs, &C8, sizeof C8);
+	memcpy(s->pixels, pixels, sizeof pixels);
+	s->yield = yield;
+	s->borked = borked;
+	s->screen_updated = screen_updated;
+	s->hi_res = hi_res;
+	s->keys = keys;
+	memcpy(s->hp48_flags, hp48_flags, sizeof hp48_flags);
+	s->quirks = quirks;
+	s->cycles = cycles;
+	s->tick_rate = tick_rate;
+	s->rate_ticks = rate_ticks;
+	s->timer_tick = timer_tick;
+	s->yield_tick = yield_tick;
+}
+
+void c8_load_state(const void *state) {
+	const state_t *s = state;
+	memcpy(&C8, &s->regs, sizeof C8);
+	memcpy(pixels, s->pixels, sizeof pixels);
+	yield = s->yield;
+	borked = s->borked;
+	screen_updated = s->screen_updated;
+	hi_res = s->hi_res;
+	keys = s->keys;
+	memcpy(hp48_flags, s->hp48_flags, sizeof hp48_flags);
+	quirks = s->quirks;
+	cycles = s->cycles;
+	tick_rate = s->tick_rate;
+	rate_ticks = s->rate_ticks;
+	timer_tick = s->timer_tick;
+	yield_tick = s->yield_tick;
+
+	written(0, TOTAL_RAM);
+	code_pages = 0;
+}
+
+/* The tick that the instruction counter `c` falls in */
+static uint64_t tick_at(uint64_t c) {
+	return c * rate_ticks / tick_rate;
+}
+
+/* Brings the delay and sound timers up to date with the instruction
+	counter if the ticks are derived from it */
+static void update_timers() {
+	uint64_t now, elapsed;
+	if(!tick_rate)
+		return;
+	now = tick_at(cycles);
+	elapsed = now - timer_tick;
+	timer_tick = now;
+	C8.DT = (elapsed < C8.DT) ? C8.DT - elapsed : 0;
+	C8.ST = (elapsed < C8.ST) ? C8.ST - elapsed : 0;
+}
 
+/* Executes a single instruction. The PC has already been advanced past it */
+static void execute(uint16_t opcode) {
 	uint8_t x = (opcode >> 8) & 0x0F;
 	uint8_t y = (opcode >> 4) & 0x0F;
 	uint8_t nibble = opcode & 0x0F;
@@ -141,6 +288,7 @@ void c8_step() {
 	uint8_t kk = opcode & 0xFF;
 
 	int row, col;
+	const uint8_t *mem = C8.RAM + (C8.I & RAM_MASK);
 
 	screen_updated = 0;
 
@@ -342,6 +490,7 @@ void c8_step() {
 				W = 64; H = 32; mW = 0x3F; mH = 0x1F;
 			}
 
+			COVER(read_data, C8.I);
 			C8.V[0xF] = 0;
 			if(nibble) {
 				x = C8.V[x]; y = C8.V[y];
@@ -356,7 +505,7 @@ void c8_step() {
 						tx = (x + p);
 						if((quirks & QUIRKS_CLIPPING) && (tx >= W))
 							break;
-						pix = (C8.RAM[C8.I + q] & (0x80 >> p)) != 0;
+						pix = (mem[q] & (0x80 >> p)) != 0;
 						if(pix) {
 							tx &= mW;
 							ty &= mH;
@@ -385,10 +534,12 @@ void c8_step() {
 							break;
 
 						if(p >= 8)
-							pix = (C8.RAM[C8.I + (q * 2) + 1] & (0x80 >> (p & 0x07))) != 0;
+							pix = (mem[(q * 2) + 1] & (0x80 >> (p & 0x07))) != 0;
 						else
-							pix = (C8.RAM[C8.I + (q * 2)] & (0x80 >> p)) != 0;
+							pix = (mem[q * 2] & (0x80 >> p)) != 0;
 						if(pix) {
+							tx &= mW;
+							ty &= mH;
 							byte = ty * W + tx;
 							bit = 1 << (byte & 0x07);
 							byte >>= 3;
@@ -402,16 +553,18 @@ void c8_step() {
 			screen_updated = 1;
 			if(quirks & QUIRKS_DISP_WAIT) {
 				yield = 1;
+				if(tick_rate)
+					yield_tick = tick_at(cycles);
 			}
 			} break;
 		case 0xE000: {
 			if(kk == 0x9E) {
 				/* SKP Vx */
-				if(keys & (1 << C8.V[x]))
+				if(keys & (1 << (C8.V[x] & 0xF)))
 					C8.PC += 2;
 			} else if(kk == 0xA1) {
 				/* SKNP Vx */
-				if(!(keys & (1 << C8.V[x])))
+				if(!(keys & (1 << (C8.V[x] & 0xF))))
 					C8.PC += 2;
 			}
 		} break;
@@ -419,6 +572,7 @@ void c8_step() {
 			switch(kk) {
 				case 0x07:
 					/* LD Vx, DT */
+					update_timers();
 					C8.V[x] = C8.DT;
 					break;
 				case 0x0A: {
@@ -438,10 +592,12 @@ void c8_step() {
 				} break;
 				case 0x15:
 					/* LD DT, Vx */
+					update_timers();
 					C8.DT = C8.V[x];
 					break;
 				case 0x18:
 					/* LD ST, Vx */
+					update_timers();
 					C8.ST = C8.V[x];
 					break;
 				case 0x1E:
@@ -463,29 +619,24 @@ void c8_step() {
 					/* LD HF, Vx - Load 8x10 hi-resolution font */
 					C8.I = HFONT_OFFSET + (C8.V[x] & 0x0F) * 10;
 					break;
-				case 0x33:
+				case 0x33: {
 					/* LD B, Vx */
-					C8.RAM[C8.I] = (C8.V[x] / 100) % 10;
-					C8.RAM[C8.I + 1] = (C8.V[x] / 10) % 10;
-					C8.RAM[C8.I + 2] = C8.V[x] % 10;
-					break;
+					uint8_t bcd[3];
+					bcd[0] = (C8.V[x] / 100) % 10;
+					bcd[1] = (C8.V[x] / 10) % 10;
+					bcd[2] = C8.V[x] % 10;
+					program_store(C8.I & RAM_MASK, bcd, 3);
+				} break;
 				case 0x55:
 					/* LD [I], Vx */
-					if(C8.I + x > TOTAL_RAM)
-						x = TOTAL_RAM - C8.I;
-					assert(C8.I + x <= TOTAL_RAM);
-					if(x >= 0)
-						memcpy(C8.RAM + C8.I, C8.V, x+1);
+					program_store(C8.I & RAM_MASK, C8.V, x + 1);
 					if(quirks & QUIRKS_MEM_CHIP8)
 						C8.I += x + 1;
 					break;
 				case 0x65:
 					/* LD Vx, [I] */
-					if(C8.I + x > TOTAL_RAM)
-						x = TOTAL_RAM - C8.I;
-					assert(C8.I + x <= TOTAL_RAM);
-					if(x >= 0)
-						memcpy(C8.V, C8.RAM + C8.I, x+1);
+					COVER(read_data, C8.I);
+					memcpy(C8.V, mem, x + 1);
 					if(quirks & QUIRKS_MEM_CHIP8)
 						C8.I += x + 1;
 					break;
@@ -504,6 +655,206 @@ void c8_step() {
 	}
 }
 
+void c8_step() {
+	cycles++;
+	if(yield) {
+		/* With a tick rate, the wait for the display ends at the next tick */
+		if(!tick_rate || tick_at(cycles) == yield_tick)
+			return;
+		yield = 0;
+	}
+	if(borked) return;
+
+	/* The guard bytes take care of an opcode at #FFF */
+	C8.PC &= RAM_MASK;
+	code_pages |= PAGE_BIT(C8.PC);
+	COVER(executed, C8.PC);
+	uint16_t opcode = C8.RAM[C8.PC] << 8 | C8.RAM[C8.PC+1];
+	C8.PC += 2;
+
+	/* Like c8_run(), don't count the instructions that only wait */
+	if(opcode != 0x00FD && ((opcode & 0xF0FF) != 0xF00A || keys))
+		c8_stats.dispatches++;
+	execute(opcode);
+}
+
+/* Superinstructions:
+	When c8_run() decodes an instruction it also looks at the one or two
+	instructions that follow it, and executes these common sequences in a
+	single dispatch:
+
+	* `LD I, nnn` followed by `DRW`, which is how sprites are drawn.
+	* `SE`, `SNE`, `SKP` or `SKNP` followed by `JP`, which is how a
+	  conditional branch is written.
+	* `ADD Vx, kk` followed by `SE Vx, kk` or `SNE Vx, kk` and a `JP`,
+	  which is the counter at the bottom of a loop.
+
+	None of the instructions in these sequences write to RAM, so the
+	opcodes can't change underneath a sequence while it executes.
+	Every instruction in a sequence still counts towards c8_cycles().
+*/
+enum {
+	FUSE_NONE,
+	FUSE_LDI_DRW,
+	FUSE_SKIP_JP,
+	FUSE_ADD_SKIP_JP,
+};
+
+c8_stats_t c8_stats;
+
+static int is_skip(uint16_t opcode) {
+	switch(opcode & 0xF000) {
+		case 0x3000:
+		case 0x4000:
+		case 0x5000:
+		case 0x9000:
+			return 1;
+		case 0xE000:
+			return (opcode & 0xFF) == 0x9E || (opcode & 0xFF) == 0xA1;
+	}
+	return 0;
+}
+
+/* Evaluates the condition of a skip instruction, as execute() would */
+static int skip_taken(uint16_t opcode) {
+	uint8_t x = (opcode >> 8) & 0x0F;
+	uint8_t y = (opcode >> 4) & 0x0F;
+	uint8_t kk = opcode & 0xFF;
+	switch(opcode & 0xF000) {
+		case 0x3000: return C8.V[x] == kk;
+		case 0x4000: return C8.V[x] != kk;
+		case 0x5000: return C8.V[x] == C8.V[y];
+		case 0x9000: return C8.V[x] != C8.V[y];
+	}
+	if(kk == 0x9E)
+		return (keys & (1 << (C8.V[x] & 0xF))) != 0;
+	return !(keys & (1 << (C8.V[x] & 0xF)));
+}
+
+/* Selects the superinstruction that starts with the `opcode` at `pc`,
+	given that at most `n` instructions may be executed */
+static int fusion(uint16_t pc, uint16_t opcode, int n) {
+	uint16_t next;
+	if(n < 2)
+		return FUSE_NONE;
+	next = c8_opcode(pc + 2);
+	if((opcode & 0xF000) == 0xA000 && (next & 0xF000) == 0xD000)
+		return FUSE_LDI_DRW;
+	if((next & 0xF000) == 0x1000 && is_skip(opcode))
+		return FUSE_SKIP_JP;
+	if(n >= 3 && (opcode & 0xF000) == 0x7000
+			&& ((next & 0xF000) == 0x3000 || (next & 0xF000) == 0x4000)
+			&& (next & 0x0F00) == (opcode & 0x0F00)
+			&& (c8_opcode(pc + 4) & 0xF000) == 0x1000)
+		return FUSE_ADD_SKIP_JP;
+	return FUSE_NONE;
+}
+
+int c8_run(int n) {
+	int done = 0, updated = 0;
+	uint16_t pc, opcode, next;
+
+	while(n > 0) {
+		if(yield && tick_rate) {
+			/* The wait ends on the first cycle of the next tick */
+			uint64_t wake = ((yield_tick + 1) * tick_rate + rate_ticks - 1) / rate_ticks - 1;
+			if(wake - cycles >= (uint64_t)n) {
+				cycles += n;
+				break;
+			}
+			n -= wake - cycles;
+			cycles = wake;
+			yield = 0;
+		}
+
+		/* Nothing happens until the next c8_60hz_tick() or key press,
+			so the rest of the instructions are spent waiting */
+		if(borked || (yield && !tick_rate)) {
+			cycles += n;
+			break;
+		}
+		pc = C8.PC & RAM_MASK;
+		code_pages |= PAGE_BIT(pc);
+		opcode = C8.RAM[pc] << 8 | C8.RAM[pc+1];
+		if(opcode == 0x00FD || ((opcode & 0xF0FF) == 0xF00A && !keys)) {
+			COVER(executed, pc);
+			C8.PC = pc;
+			cycles += n;
+			break;
+		}
+
+		/* The hook's code wouldn't be recorded */
+		if(c8_block_hook && !yield && !recording) {
+			int k = c8_block_hook(pc, n);
+			if(k > 0) {
+				cycles += k;
+				n -= k;
+				done += k;
+				c8_stats.dispatches++;
+				c8_stats.native++;
+				continue;
+			}
+		}
+
+		switch(yield ? FUSE_NONE : fusion(pc, opcode, n)) {
+			case FUSE_LDI_DRW:
+				COVER(executed, pc);
+				COVER(executed, pc + 2);
+				C8.I = opcode & 0x0FFF;
+				C8.PC = pc + 4;
+				cycles += 2;
+				execute(c8_opcode(pc + 2));
+				updated |= screen_updated;
+				n -= 2;
+				done += 2;
+				break;
+			case FUSE_SKIP_JP:
+				COVER(executed, pc);
+				cycles++;
+				if(skip_taken(opcode)) {
+					C8.PC = pc + 4;
+					n--;
+					done++;
+				} else {
+					COVER(executed, pc + 2);
+					cycles++;
+					C8.PC = c8_opcode(pc + 2) & 0x0FFF;
+					n -= 2;
+					done += 2;
+				}
+				break;
+			case FUSE_ADD_SKIP_JP:
+				next = c8_opcode(pc + 2);
+				COVER(executed, pc);
+				COVER(executed, pc + 2);
+				C8.V[(opcode >> 8) & 0x0F] += opcode & 0xFF;
+				cycles += 2;
+				if(skip_taken(next)) {
+					C8.PC = pc + 6;
+					n -= 2;
+					done += 2;
+				} else {
+					COVER(executed, pc + 4);
+					cycles++;
+					C8.PC = c8_opcode(pc + 4) & 0x0FFF;
+					n -= 3;
+					done += 3;
+				}
+				break;
+			default:
+				c8_step();
+				updated |= screen_updated;
+				n--;
+				done++;
+				continue;
+		}
+		c8_stats.dispatches++;
+		c8_stats.fused++;
+	}
+	screen_updated = updated;
+	return done;
+}
+
 int c8_ended() {
 	/* Check whether the next instruction is 00FD */
 	return borked || c8_opcode(C8.PC) == 0x00FD;
@@ -519,11 +870,149 @@ uint8_t c8_get(uint16_t addr) {
 
 void c8_set(uint16_t addr, uint8_t byte) {
 	assert(addr < TOTAL_RAM);
-	C8.RAM[addr] = byte;
+	store(addr, &byte, 1);
+}
+
+void c8_coverage_start() {
+	memset(executed, 0, sizeof executed);
+	memset(read_data, 0, sizeof read_data);
+	recording = 1;
+}
+
+void c8_coverage_stop() {
+	recording = 0;
+}
+
+/* Coverage files are the magic number followed by the two bitmaps */
+static const char coverage_magic[4] = {'C', '8', 'C', 'V'};
+
+int c8_coverage_save(const char *fname) {
+	FILE *f;
+	int ok;
+	if(!(f = fopen(fname, "wb")))
+		return 0;
+	ok = fwrite(coverage_magic, sizeof coverage_magic, 1, f) == 1
+		&& fwrite(executed, sizeof executed, 1, f) == 1
+		&& fwrite(read_data, sizeof read_data, 1, f) == 1;
+	if(fclose(f))
+		ok = 0;
+	return ok;
+}
+
+int c8_coverage_load(const char *fname, uint8_t code[TOTAL_RAM/8], uint8_t data[TOTAL_RAM/8]) {
+	FILE *f;
+	char magic[sizeof coverage_magic];
+	int ok;
+	if(!(f = fopen(fname, "rb")))
+		return 0;
+	ok = fread(magic, sizeof magic, 1, f) == 1
+		&& !memcmp(magic, coverage_magic, sizeof magic)
+		&& fread(code, TOTAL_RAM/8, 1, f) == 1
+		&& fread(data, TOTAL_RAM/8, 1, f) == 1;
+	fclose(f);
+	return ok;
+}
+
+c8_srcmap_t *c8_srcmap_load(const char *fname) {
+	c8_srcmap_t *map;
+	char *text, *line, *next;
+	int file = -1, num = 0, addr = 0, ok = 1;
+
+	if(!(text = c8_load_txt(fname)))
+		return NULL;
+	if(!(map = calloc(1, sizeof *map))) {
+		free(text);
+		return NULL;
+	}
+
+	next = strchr(text, '\n');
+	if(!next || strncmp(text, C8_SRCMAP_MAGIC, strlen(C8_SRCMAP_MAGIC)))
+		ok = 0;
+	/* Each `a` record holds from its address up to the next one's */
+	for(line = next; ok && line; line = next) {
+		char **files;
+		int to, f, n;
+		*line++ = '\0';
+		if((next = strchr(line, '\n')))
+			*next = '\0';
+		line[strcspn(line, "\r")] = '\0';
+		if(line[0] == 'f' && line[1] == ' ') {
+			if(!(files = realloc(map->files, (map->nfiles + 1) * sizeof *files))) {
+				ok = 0;
+				break;
+			}
+			map->files = files;
+			if(!(map->files[map->nfiles] = malloc(strlen(line + 2) + 1))) {
+				ok = 0;
+				break;
+			}
+			strcpy(map->files[map->nfiles++], line + 2);
+		} else if(line[0] == 'a' && line[1] == ' ') {
+			char *p;
+			to = strtol(line + 2, &p, 16);
+			if(p == line + 2 || to < addr || to > TOTAL_RAM) {
+				ok = 0;
+				break;
+			}
+			for(; addr < to; addr++) {
+				map->file[addr] = file;
+				map->line[addr] = num;
+			}
+			if(sscanf(p, " %d %d", &f, &n) == 2 && f >= 0 && f < map->nfiles && n > 0) {
+				file = f;
+				num = n;
+			} else if(!strcmp(p, " -")) {
+				file = -1;
+				num = 0;
+			} else
+				ok = 0;
+		} else if(line[0])
+			ok = 0;
+	}
+	for(; addr < TOTAL_RAM; addr++) {
+		map->file[addr] = file;
+		map->line[addr] = num;
+	}
+	free(text);
+	if(!ok) {
+		c8_srcmap_free(map);
+		return NULL;
+	}
+	return map;
+}
+
+void c8_srcmap_free(c8_srcmap_t *map) {
+	int i;
+	if(!map)
+		return;
+	for(i = 0; i < map->nfiles; i++)
+		free(map->files[i]);
+	free(map->files);
+	free(map);
+}
+
+const char *c8_srcmap_lookup(const c8_srcmap_t *map, uint16_t addr, int *line) {
+	addr &= RAM_MASK;
+	if(map->file[addr] < 0)
+		return NULL;
+	*line = map->line[addr];
+	return map->files[map->file[addr]];
+}
+
+uint64_t c8_generation() {
+	return generation;
+}
+
+int c8_clean(uint16_t addr, int n, uint64_t gen) {
+	int p, last = (addr + n - 1) >> C8_PAGE_SHIFT;
+	for(p = addr >> C8_PAGE_SHIFT; p <= last; p++)
+		if(page_gen[p & (C8_PAGES - 1)] > gen)
+			return 0;
+	return 1;
 }
 
 uint16_t c8_opcode(uint16_t addr) {
-	assert(addr < TOTAL_RAM - 1);
+	addr &= RAM_MASK;
 	return C8.RAM[addr] << 8 | C8.RAM[addr+1];
 }
 
@@ -531,6 +1020,10 @@ uint16_t c8_get_pc() {
 	return C8.PC;
 }
 
+uint16_t c8_get_i() {
+	return C8.I;
+}
+
 uint16_t c8_prog_size() {
 	uint16_t n;
 	for(n = TOTAL_RAM - 1; n > PROG_OFFSET && C8.RAM[n] == 0; n--);
@@ -585,12 +1078,28 @@ void c8_key_up(uint8_t k) {
 }
 
 void c8_60hz_tick() {
+	if(tick_rate) return;
 	yield = 0;
 	if(C8.DT > 0) C8.DT--;
 	if(C8.ST > 0) C8.ST--;
 }
 
+void c8_set_tick_rate(unsigned int instructions, unsigned int ticks) {
+	update_timers();
+	tick_rate = ticks ? instructions : 0;
+	rate_ticks = ticks;
+	if(tick_rate) {
+		timer_tick = tick_at(cycles);
+		yield_tick = timer_tick;
+	}
+}
+
+uint64_t c8_cycles() {
+	return cycles;
+}
+
 int c8_sound() {
+	update_timers();
 	return C8.ST > 0;
 }
 
@@ -598,7 +1107,7 @@ size_t c8_load_program(uint8_t program[], size_t n) {
 	if(n + PROG_OFFSET > TOTAL_RAM)
 		n = TOTAL_RAM - PROG_OFFSET;
 	assert(n + PROG_OFFSET <= TOTAL_RAM);
-	memcpy(C8.RAM + PROG_OFFSET, program, n);
+	store(PROG_OFFSET, program, n);
 	return n;
 }
 
@@ -616,6 +1125,8 @@ int c8_load_file(const char *fname) {
 	rewind(f);
 	r = fread(C8.RAM + PROG_OFFSET, 1, len, f);
 	fclose(f);
+	if(r)
+		written(PROG_OFFSET, r);
 	if(r != len)
 		return 0;
 	return len;
@@ -672,6 +1183,115 @@ int c8_message(const char *msg, ...) {
 	return 0;
 }
 
+void c8_writer_file(c8_writer_t *w, FILE *f, char *buf, size_t size) {
+	w->file = f;
+	w->buf = size ? buf : NULL;
+	w->size = buf ? size : 0;
+	w->len = 0;
+	w->owned = 0;
+	w->error = 0;
+	if(w->buf)
+		w->buf[0] = '\0';
+}
+
+int c8_writer_buffer(c8_writer_t *w, char *buf, size_t size) {
+	w->file = NULL;
+	w->len = 0;
+	w->error = 0;
+	w->owned = !buf;
+	if(w->owned) {
+		size = 256;
+		buf = malloc(size);
+		if(!buf) {
+			w->size = 0;
+			w->error = 1;
+			return 0;
+		}
+	}
+	w->buf = buf;
+	w->size = size;
+	if(size)
+		buf[0] = '\0';
+	return 1;
+}
+
+int c8_write(c8_writer_t *w, const char *fmt, ...) {
+	va_list arg;
+	int n;
+
+	if(!w) {
+		va_start (arg, fmt);
+		vsnprintf (c8_message_text, MAX_MESSAGE_TEXT-1, fmt, arg);
+		va_end (arg);
+		return c8_message(NULL);
+	}
+
+	for(;;) {
+		size_t avail = w->size - w->len;
+		if(!avail) {
+			n = 0;
+		} else {
+			va_start (arg, fmt);
+			n = vsnprintf (w->buf + w->len, avail, fmt, arg);
+			va_end (arg);
+			if(n < 0) {
+				w->error = 1;
+				return n;
+			}
+			if((size_t)n < avail) {
+				w->len += n;
+				return n;
+			}
+			w->buf[w->len] = '\0';
+		}
+
+		/* It didn't fit: empty the buffer into the file, or grow it */
+		if(w->file) {
+			if(w->len) {
+				if(!c8_writer_flush(w))
+					return -1;
+				continue;
+			}
+			/* Too long for the buffer on its own */
+			va_start (arg, fmt);
+			n = vfprintf(w->file, fmt, arg);
+			va_end (arg);
+			if(n < 0)
+				w->error = 1;
+			return n;
+		} else if(w->owned && !w->error) {
+			size_t size = w->size * 2;
+			char *buf;
+			if(size < w->len + n + 1)
+				size = w->len + n + 1;
+			buf = realloc(w->buf, size);
+			if(!buf) {
+				w->error = 1;
+				return -1;
+			}
+			w->buf = buf;
+			w->size = size;
+			continue;
+		}
+		w->error = 1;
+		return -1;
+	}
+}
+
+int c8_writer_flush(c8_writer_t *w) {
+	if(!w)
+		return 1;
+	if(w->file && w->len) {
+		if(fwrite(w->buf, 1, w->len, w->file) != w->len)
+			w->error = 1;
+		w->len = 0;
+		w->buf[0] = '\0';
+	}
+	if(w->file && fflush(w->file))
+		w->error = 1;
+	return !w->error;
+}
+
 /**
  * [wikipedia]: https://en.wikipedia.org/wiki/CHIP-8
  *
@@ -17,7 +17,8 @@
  * * Tell the interpreter about the state of the keyboard; It should call
  *     `c8_key_down()` and `c8_key_up()` when the state of the keyboard
  *     changes.
- * * Tell the intepreter about every 60Hz timer tick; see `c8_60hz_tick()`.
+ * * Tell the intepreter about every 60Hz timer tick; see `c8_60hz_tick()`,
+ *     or let the interpreter count the ticks itself; see `c8_set_tick_rate()`.
  * * Play sound. Since the sound is just a buzzer, you may wish to skip this;
  *     See `c8_sound()`.
  *
@@ -45,6 +46,53 @@
  *    limitations under the License.
  * ```
  */
+#ifndef CHIP8_H
+#define CHIP8_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** ## Library
+ *
+ * The core, the assembler and the disassembler can be built as a static
+ * (`libchip8.a`) or a shared (`libchip8.so`) library through the `lib` target
+ * in the Makefile. The library does not depend on SDL or GDI, so it can be
+ * embedded in other programs.
+ *
+ * `C8_API`  \
+ * Marks the functions and variables in this header as part of the library's
+ * public interface. When the library is compiled with `-fvisibility=hidden`
+ * only the symbols marked with `C8_API` are exported; everything else stays
+ * internal to the library.
+ *
+ * The shared library is `libchip8.so.1`; the number after `.so` goes up
+ * whenever a change breaks programs built against an older version.
+ * The machine's registers and RAM in `C8` are not part of that interface: `C8`
+ * is only visible to code linked with the static library or the object
+ * files, like the front ends in this repository and the C translated by
+ * `c8_disasm_c()`, so its layout can change. Programs that use the shared
+ * library go through the functions instead, such as `c8_get()`, `c8_get_reg()`,
+ * `c8_get_pc()` and `c8_get_i()`.
+ *
+ * The interpreter is a single machine kept in globals, so its functions are
+ * neither reentrant nor thread-safe. A program can drive several machines
+ * from one thread by swapping them in and out with `c8_save_state()` and
+ * `c8_load_state()`. The `_r` functions of the assembler and the disassembler
+ * keep their state in the structures they are given, and don't share this
+ * limitation.
+ */
+#ifndef C8_API
+#  if defined(__GNUC__) && !defined(_WIN32)
+#    define C8_API __attribute__((visibility("default")))
+#  else
+#    define C8_API
+#  endif
+#endif
 
 /** ## Definitions */
 /** `#define TOTAL_RAM 4096`  \
@@ -52,6 +100,28 @@
  */
 #define TOTAL_RAM 4096
 
+/** `#define RAM_MASK (TOTAL_RAM - 1)`  \
+ * Mask applied to addresses in RAM. Addresses wrap around, so that `I`,
+ * `I + offset` and the `PC` always refer to `addr & RAM_MASK`.
+ */
+#define RAM_MASK (TOTAL_RAM - 1)
+
+/** `#define RAM_GUARD 64`  \
+ * Number of guard bytes after the end of RAM.
+ *
+ * `C8.RAM` is `TOTAL_RAM + RAM_GUARD` bytes long, and the guard bytes at
+ * `RAM[TOTAL_RAM]` to `RAM[TOTAL_RAM + RAM_GUARD - 1]` always mirror the
+ * first `RAM_GUARD` bytes of RAM. This means that an access at
+ * `RAM[(I & RAM_MASK) + offset]` for an `offset` less than `RAM_GUARD`
+ * behaves as if it wrapped around to the start of RAM without having to check
+ * the bounds on every access. The largest such offset is the 32 bytes of
+ * a SuperChip 16&times;16 sprite.
+ *
+ * Stores that can reach the guard bytes or the start of RAM keep the two
+ * copies in sync.
+ */
+#define RAM_GUARD 64
+
 /** `#define PROG_OFFSET	512`  \
  * Offset of the program in RAM. Should be 512, but
  * apparently there are some computers where this is `0x600` (See [wikipedia][]).
@@ -70,17 +140,22 @@
  * It has these members:
  *
  * * `uint8_t V[16]` - CHIP-8 registers
- * * `uint8_t RAM[TOTAL_RAM]` - Interpreter RAM
+ * * `uint8_t RAM[TOTAL_RAM + RAM_GUARD]` - Interpreter RAM, followed by the guard bytes
  * * `uint16_t PC` - Program counter
  * * `uint16_t I` - Index register
  * * `uint8_t DT, ST` - Delay timer and sound timer
  * * `uint16_t stack[16]` - stack
  * * `uint8_t SP` - Stack pointer
  *
+ * `RAM` must not be written directly: Use `c8_set()` or `c8_load_program()`,
+ * which keep the guard bytes and the store tracking (see `c8_clean()`) up
+ * to date.
+ *
+ * `C8` isn't exported by the shared library; see above.
  */
 typedef struct {
 	uint8_t V[16];
-	uint8_t RAM[TOTAL_RAM];
+	uint8_t RAM[TOTAL_RAM + RAM_GUARD];
 	uint16_t PC;
 	uint16_t I;
 	uint8_t DT, ST;
@@ -145,12 +220,12 @@ extern chip8_t C8;
 /**
  * `void c8_set_quirks(unsigned int q);`  \
  */
-void c8_set_quirks(unsigned int q);
+C8_API void c8_set_quirks(unsigned int q);
 
 /**
  * `unsigned int c8_get_quirks();`  \
  */
-unsigned int c8_get_quirks();
+C8_API unsigned int c8_get_quirks();
 
 /**
  * ## Utilities
@@ -160,22 +235,159 @@ unsigned int c8_get_quirks();
  *
  * The higher the value, the more verbose the output.
  */
-extern int c8_verbose;
+extern C8_API int c8_verbose;
 
 /** ## Interpreter */
 
 /** `void c8_reset();`  \
  * Resets the state of the interpreter so that a new program
- * can be executed.
+ * can be executed. All the keys are released.
+ */
+C8_API void c8_reset();
+
+/** `size_t c8_state_size();`  \
+ * Returns the number of bytes needed to store a snapshot of the
+ * interpreter's state with `c8_save_state()`.
+ *
+ * The snapshot contains everything that makes up a machine: the registers
+ * and RAM in `C8`, the display, the keypad, the quirks and so on.
+ * It does not contain the global hooks like `c8_sys_hook` or `c8_rand`.
+ */
+C8_API size_t c8_state_size();
+
+/** `void c8_save_state(void *state);`  \
+ * Saves a snapshot of the interpreter's state into `state`, which
+ * must be at least `c8_state_size()` bytes large.
+ *
+ * Together with `c8_load_state()` this allows a program to drive several
+ * machines with a single copy of the interpreter by swapping them in
+ * and out. Only one machine can run at a time, and only from one thread.
  */
-void c8_reset();
+C8_API void c8_save_state(void *state);
+
+/** `void c8_load_state(const void *state);`  \
+ * Restores the interpreter's state from a snapshot previously
+ * written by `c8_save_state()`.
+ */
+C8_API void c8_load_state(const void *state);
 
 /** `void c8_step();`  \
  * Steps through a single instruction in the interpreter.
  *
  * This function forms the core of the interpreter.
  */
-void c8_step();
+C8_API void c8_step();
+
+/** `int c8_run(int n);`  \
+ * Executes the next `n` instructions, as if by calling `c8_step()` `n` times,
+ * and returns the number of instructions that were actually executed.
+ *
+ * It is faster than calling `c8_step()` in a loop:
+ *
+ * * Some common sequences of two or three instructions are executed in a
+ *   single dispatch, such as a `LD I, nnn` followed by a `DRW`, or a `SE`
+ *   followed by a `JP`.
+ * * If the interpreter has ended, is waiting for a key (with no key pressed)
+ *   or is waiting for the display (see `QUIRKS_DISP_WAIT`), the remaining
+ *   instructions are counted towards `c8_cycles()` without being executed.
+ * * If `c8_block_hook` is set, it is given the chance to execute the
+ *   instructions natively; see `c8_jit_start()` and `c8_trace_start()`.
+ *
+ * A debugger should use `c8_step()` so that it can stop at every instruction.
+ */
+C8_API int c8_run(int n);
+
+/** `typedef struct { uint64_t dispatches, fused, native, stores, code_stores; } c8_stats_t;`  \
+ * `extern c8_stats_t c8_stats;`  \
+ * Counters for benchmarking the interpreter:
+ *
+ * * `dispatches` is the number of times the interpreter decoded and executed
+ *   either a single instruction or a sequence of instructions. The cycles
+ *   spent waiting for the display, for a key (`Fx0A`) or after `EXIT` are
+ *   not counted.
+ * * `fused` is the number of those that were sequences of instructions
+ *   executed by `c8_run()`.
+ * * `native` is the number of those that were executed by the
+ *   `c8_block_hook` instead of the interpreter.
+ * * `stores` is the number of `Fx33` and `Fx55` instructions executed.
+ * * `code_stores` is the number of those that wrote to a page of RAM that the
+ *   `PC` had been in since `c8_reset()`, i.e. the program may have changed
+ *   its own code.
+ *
+ * `c8_reset()` doesn't clear the counters; the program can do it itself.
+ */
+typedef struct {
+	uint64_t dispatches;
+	uint64_t fused;
+	uint64_t native;
+	uint64_t stores;
+	uint64_t code_stores;
+} c8_stats_t;
+
+extern C8_API c8_stats_t c8_stats;
+
+/** `int c8_jit_start();`  \
+ * Starts the x86-64 dynamic recompiler in `c8jit.c`, so that `c8_run()`
+ * executes straight-line runs of instructions as native code.
+ *
+ * A run of instructions is translated the first time the `PC` reaches it. It
+ * contains the `LD`, `ADD`, `OR`, `AND`, `XOR`, `SUB`, `SUBN`, `SHR`, `SHL`,
+ * `LD I, nnn` and `ADD I, Vx` instructions, and ends with a `JP` or a skip, or
+ * just before any other instruction, which is left to the interpreter.
+ * Translations are thrown away when the program writes over them, or when the
+ * quirks change.
+ *
+ * It installs `c8_block_hook` and `c8_store_hook`, so the program should not
+ * use those hooks itself while the JIT is running.
+ *
+ * Returns 0 if the JIT is not available, or if either hook is already in use
+ * (by `c8_trace_start()`, for example), in which case `c8_run()` keeps using
+ * the interpreter. The JIT is only available on x86-64 Unix systems.
+ */
+C8_API int c8_jit_start();
+
+/** `void c8_jit_stop();`  \
+ * Stops the JIT and frees the memory holding the translated code.
+ */
+C8_API void c8_jit_stop();
+
+/** `void c8_jit_flush();`  \
+ * Throws away all the code translated by the JIT.
+ */
+C8_API void c8_jit_flush();
+
+/** `int c8_trace_start();`  \
+ * Starts the trace compiler in `c8trace.c`, a portable alternative to the JIT
+ * for programs that spend their time in loops. Traces are not compiled to
+ * native code: they are lists of decoded instructions that are interpreted
+ * without going through `c8_run()`'s decoding and dispatch.
+ *
+ * It counts how often `c8_run()` branches backwards to each address. Once an
+ * address is hot, the next pass through the loop is recorded into a trace,
+ * following `JP`s, `CALL`s and `RET`s, from instructions decoded once and
+ * cached. The trace then runs whenever the `PC` reaches that address. Skips
+ * and `RET`s in the trace check that they go the same way they did while
+ * recording; if not, or at an instruction that isn't in the trace (the same
+ * ones the JIT leaves to the interpreter), the trace exits and `c8_run()`
+ * continues from the exact same state in the interpreter. Traces and decoded
+ * instructions are checked with `c8_clean()` before they are used.
+ *
+ * It installs `c8_block_hook`, so it can't be used together with the JIT.
+ *
+ * Returns 0, and leaves the hook alone, if `c8_block_hook` is already in use
+ * (by `c8_jit_start()`, for example). Returns 1 otherwise.
+ */
+C8_API int c8_trace_start();
+
+/** `void c8_trace_stop();`  \
+ * Stops the trace compiler.
+ */
+C8_API void c8_trace_stop();
+
+/** `void c8_trace_flush();`  \
+ * Throws away all the traces, decoded instructions and counters.
+ */
+C8_API void c8_trace_flush();
 
 /** `int c8_ended();`  \
  * Returns true if the interpreter has ended.
@@ -184,14 +396,14 @@ void c8_step();
  *
  * The **00FD** instruction is actually SuperChip specific.
  */
-int c8_ended();
+C8_API int c8_ended();
 
 /** `int c8_waitkey();`  \
  * Returns true if the interpreter is waiting for keyboard input.
  *
  * The **Fx0A** instruction is the one that waits for a specific key to be pressed.
  */
-int c8_waitkey();
+C8_API int c8_waitkey();
 
 /**
  * `typedef int (*c8_sys_hook_t)(unsigned int nnn);`  \
@@ -205,7 +417,71 @@ int c8_waitkey();
  */
 typedef int (*c8_sys_hook_t)(unsigned int nnn);
 
-extern c8_sys_hook_t c8_sys_hook;
+extern C8_API c8_sys_hook_t c8_sys_hook;
+
+/**
+ * `typedef int (*c8_block_hook_t)(uint16_t pc, int n);`  \
+ * `extern c8_block_hook_t c8_block_hook;`  \
+ *
+ * If `c8_block_hook` is not null, `c8_run()` calls it before it decodes the
+ * instruction at `pc`, so that another execution engine (such as the JIT in
+ * `c8jit.c`) can execute the instructions from `pc` onwards instead.
+ *
+ * The hook may execute at most `n` instructions. It should update `C8.PC` and
+ * return the number of instructions it executed, or return 0 to let the
+ * interpreter execute the instruction at `pc`. It must not execute
+ * instructions that draw, read the keypad or the timers, or write to RAM;
+ * those are left to the interpreter.
+ *
+ * `c8_step()` never calls the hook.
+ */
+typedef int (*c8_block_hook_t)(uint16_t pc, int n);
+
+extern C8_API c8_block_hook_t c8_block_hook;
+
+/**
+ * `typedef void (*c8_store_hook_t)(uint16_t addr, int n);`  \
+ * `extern c8_store_hook_t c8_store_hook;`  \
+ *
+ * If `c8_store_hook` is not null, the interpreter calls it after it changed
+ * `n` bytes of RAM starting at `addr`: through the `Fx33` and `Fx55`
+ * instructions, `c8_set()` (and so `c8_assemble()`), `c8_load_program()` and
+ * `c8_load_file()`. `c8_reset()` and `c8_load_state()` call it for all of RAM.
+ *
+ * This allows an execution engine to throw away code it translated from RAM
+ * that has since been overwritten. An engine that would rather check its code
+ * before it runs it can use `c8_clean()` instead.
+ */
+typedef void (*c8_store_hook_t)(uint16_t addr, int n);
+
+extern C8_API c8_store_hook_t c8_store_hook;
+
+/** `#define C8_PAGE_SHIFT 6`  \
+ * `#define C8_PAGES (TOTAL_RAM >> C8_PAGE_SHIFT)`  \
+ * For tracking stores, RAM is divided into `C8_PAGES` pages of
+ * `1 << C8_PAGE_SHIFT` bytes.
+ */
+#define C8_PAGE_SHIFT	6
+#define C8_PAGES		(TOTAL_RAM >> C8_PAGE_SHIFT)
+
+/** `uint64_t c8_generation();`  \
+ * Returns the current generation of RAM, a counter that goes up with every
+ * store to RAM (by the same functions and instructions that call
+ * `c8_store_hook`). Each page of RAM remembers the generation it was last
+ * written in.
+ */
+C8_API uint64_t c8_generation();
+
+/** `int c8_clean(uint16_t addr, int n, uint64_t gen);`  \
+ * Returns true if none of the `n` bytes at `addr` have been written since
+ * `c8_generation()` returned `gen`.
+ *
+ * A cache of anything derived from RAM, such as decoded instructions, records
+ * the generation when it reads RAM and checks that the range is still clean
+ * before it uses what it read. Stores are tracked per page, so a store next to
+ * the range (but in the same page) also makes it dirty.
+ */
+C8_API int c8_clean(uint16_t addr, int n, uint64_t gen);
 
 /** ## Debugging */
 
@@ -213,37 +489,112 @@ extern c8_sys_hook_t c8_sys_hook;
  * Gets the value of a byte at a specific address `addr` in
  * the interpreter's RAM.
  */
-uint8_t c8_get(uint16_t addr);
+C8_API uint8_t c8_get(uint16_t addr);
 
 /** `void c8_set(uint16_t addr, uint8_t byte);`  \
  * Sets the value of the `byte` at a specific address `addr` in
  * the interpreter's RAM.
  */
-void c8_set(uint16_t addr, uint8_t byte);
+C8_API void c8_set(uint16_t addr, uint8_t byte);
+
+/** `void c8_coverage_start();`  \
+ * `void c8_coverage_stop();`  \
+ * Start and stop recording coverage: a bit for the address of every
+ * instruction executed, and a bit for the value of `I` used by every `DRW`
+ * and `LD Vx, [I]`. Starting clears the previous recording.
+ *
+ * Recording costs one bit per instruction and does no I/O, so it can be left
+ * on while playing; save the recording with `c8_coverage_save()` at the end.
+ * While recording, `c8_run()` doesn't call `c8_block_hook`, since the code it
+ * runs couldn't be recorded.
+ */
+C8_API void c8_coverage_start();
+C8_API void c8_coverage_stop();
+
+/** `int c8_coverage_save(const char *fname);`  \
+ * Writes the coverage recorded since `c8_coverage_start()` to the file `fname`.
+ * Returns 0 on failure.
+ */
+C8_API int c8_coverage_save(const char *fname);
+
+/** `int c8_coverage_load(const char *fname, uint8_t code[TOTAL_RAM/8], uint8_t data[TOTAL_RAM/8]);`  \
+ * Reads a file written by `c8_coverage_save()` into the bitmaps `code` (the
+ * executed addresses) and `data` (the values of `I`). Bit `addr & 7` of byte
+ * `addr >> 3` is the bit for `addr`. Returns 0 on failure.
+ */
+C8_API int c8_coverage_load(const char *fname, uint8_t code[TOTAL_RAM/8], uint8_t data[TOTAL_RAM/8]);
+
+/** `#define C8_SRCMAP_MAGIC "CHIP-8 source map 1"`  \
+ * A source map tells which line of which source file each byte of a program
+ * was assembled from (see `c8_asm_source_map()`). It is text, one record per
+ * line, after the `C8_SRCMAP_MAGIC` line:
+ *
+ * * `f <name>` names a file. The files are numbered from 0 in order.
+ * * `a <addr> <file> <line>` says that the bytes from the address `addr`, in
+ *   hex, come from line `line` of file number `file`.
+ * * `a <addr> -` says that the bytes from `addr` don't come from any line.
+ *
+ * Each `a` record holds up to the next one.
+ */
+#define C8_SRCMAP_MAGIC "CHIP-8 source map 1"
+
+/** `typedef struct {...} c8_srcmap_t;`  \
+ * A source map loaded with `c8_srcmap_load()`: `files` holds the names of
+ * the `nfiles` files, and for every address `file` holds the index in `files`
+ * of the file it comes from, or -1, and `line` the line, or 0.
+ */
+typedef struct {
+	char **files;
+	int nfiles;
+	int file[TOTAL_RAM];
+	int line[TOTAL_RAM];
+} c8_srcmap_t;
+
+/** `c8_srcmap_t *c8_srcmap_load(const char *fname);`  \
+ * Reads the source map in the file `fname`. Returns `NULL` on failure.
+ * Free the map with `c8_srcmap_free()`.
+ */
+C8_API c8_srcmap_t *c8_srcmap_load(const char *fname);
+
+/** `void c8_srcmap_free(c8_srcmap_t *map);`  \
+ * Frees a source map returned by `c8_srcmap_load()`.
+ */
+C8_API void c8_srcmap_free(c8_srcmap_t *map);
+
+/** `const char *c8_srcmap_lookup(const c8_srcmap_t *map, uint16_t addr, int *line);`  \
+ * Returns the name of the file the byte at `addr` was assembled from, and
+ * puts its line in `line`, or returns `NULL` if it isn't known.
+ */
+C8_API const char *c8_srcmap_lookup(const c8_srcmap_t *map, uint16_t addr, int *line);
 
 /** `uint16_t c8_opcode(uint16_t addr);`  \
  * Gets the opcode at a specific address `addr` in the interpreter's RAM.
  */
-uint16_t c8_opcode(uint16_t addr);
+C8_API uint16_t c8_opcode(uint16_t addr);
 
 /** `uint16_t c8_get_pc();`  \
  * Gets the current address pointed to by the interpreter's program
  * counter (PC).
  *
  */
-uint16_t c8_get_pc();
+C8_API uint16_t c8_get_pc();
+
+/** `uint16_t c8_get_i();`  \
+ * Gets the value of the index register `I`.
+ */
+C8_API uint16_t c8_get_i();
 
 /** `uint16_t c8_prog_size();`  \
  * Gets the size of the program in the interpreter's RAM.
  *
  * It basically just search for the last non-zero byte in RAM.
  */
-uint16_t c8_prog_size();
+C8_API uint16_t c8_prog_size();
 
 /** `uint8_t c8_get_reg(uint8_t r);`  \
  * Gets the value of the register `Vr` where `0` <= `r` <= `F`.
  */
-uint8_t c8_get_reg(uint8_t r);
+C8_API uint8_t c8_get_reg(uint8_t r);
 
 /** `int (*c8_rand)();`  \
  * Points to the function that should be used to generate
@@ -253,7 +604,7 @@ uint8_t c8_get_reg(uint8_t r);
  * This implies that `srand()` should be called at the
  * start of the program.
  */
-extern int (*c8_rand)();
+extern C8_API int (*c8_rand)();
 
 /** ## Graphics
  * The _implementation_ should provide a platform specific way for the interpreter
@@ -264,8 +615,10 @@ extern int (*c8_rand)();
 /** `int c8_screen_updated();`  \
  * Returns true if the last instruction executed by `c8_step()` changed the graphics,
  * in which case the display should be updated.
+ *
+ * After `c8_run()` it returns true if any of the instructions changed the graphics.
  */
-int c8_screen_updated();
+C8_API int c8_screen_updated();
 
 /** `int c8_resolution(int *w, int *h);`  \
  * Loads the current resolution of the interpreter into `w` and `h`.
@@ -275,7 +628,7 @@ int c8_screen_updated();
  *
  * It returns 1 if the interpreter is in high resolution mode, 0 otherwise.
  */
-int c8_resolution(int *w, int *h);
+C8_API int c8_resolution(int *w, int *h);
 
 /** `int c8_get_pixel(int x, int y);`  \
  * Gets the status of the pixel at (x,y).
@@ -284,7 +637,7 @@ int c8_resolution(int *w, int *h);
  *
  * Returns 0 if the pixel is cleared - i.e. it should be drawn in the background colour.
  */
-int c8_get_pixel(int x, int y);
+C8_API int c8_get_pixel(int x, int y);
 
 /** ## Keyboard routines
  * The _implementation_ should use these functions to tell the interpreter
@@ -294,17 +647,18 @@ int c8_get_pixel(int x, int y);
 /** `void c8_key_down(uint8_t k);`  \
  * Sets the state of key `k` to pressed.
  */
-void c8_key_down(uint8_t k);
+C8_API void c8_key_down(uint8_t k);
 
 /** `void c8_key_up(uint8_t k);`  \
  * Sets the state of key `k` to released.
  */
-void c8_key_up(uint8_t k);
+C8_API void c8_key_up(uint8_t k);
 
 /** ## Timer and sound functions
  * CHIP-8 has a 60Hz timer that updates a delay timer and a sound timer
- * register. The _implementation_ needs to tell the interpreter about these
- * 60Hz ticks.
+ * register. The _implementation_ needs to either tell the interpreter about
+ * these 60Hz ticks through `c8_60hz_tick()`, or let the interpreter derive
+ * them from the number of instructions executed through `c8_set_tick_rate()`.
  */
 
 /** `void c8_60hz_tick();`  \
@@ -313,15 +667,45 @@ void c8_key_up(uint8_t k);
  * This decrements the delay and sound timers if they are non-zero.
  *
  * The _implementation_ should call this function 60 times per second.
+ *
+ * It does nothing if a tick rate was set through `c8_set_tick_rate()`.
  */
-void c8_60hz_tick();
+C8_API void c8_60hz_tick();
+
+/** `void c8_set_tick_rate(unsigned int instructions, unsigned int ticks);`  \
+ * Derives the 60Hz timer ticks from the instruction counter (see `c8_cycles()`)
+ * instead of from calls to `c8_60hz_tick()`: Every `instructions` calls to
+ * `c8_step()` count as `ticks` ticks.
+ *
+ * For example, an _implementation_ that executes 1000 instructions per second
+ * would call `c8_set_tick_rate(1000, 60)`, so that the timers run at exactly
+ * 60Hz even though 1000 is not a multiple of 60.
+ *
+ * The delay and sound timers are then computed lazily from the instruction
+ * counter when an instruction (or `c8_sound()`) reads or writes them, so
+ * `C8.DT` and `C8.ST` hold their values as of the last such access.
+ *
+ * Set `instructions` or `ticks` to 0 (the default) to go back to calling
+ * `c8_60hz_tick()`.
+ */
+C8_API void c8_set_tick_rate(unsigned int instructions, unsigned int ticks);
+
+/** `uint64_t c8_cycles();`  \
+ * Returns the number of times `c8_step()` was called since the last `c8_reset()`.
+ * Each of the `n` instructions passed to `c8_run()` counts as one call.
+ *
+ * Calls that don't execute an instruction because the interpreter is waiting
+ * for the display (see `QUIRKS_DISP_WAIT`) are also counted, because time passes
+ * while the interpreter waits.
+ */
+C8_API uint64_t c8_cycles();
 
 /** `int c8_sound();`  \
  * Returns true if the sound timer is non-zero and sound should be played.
  *
  * CHIP-8 sounds use a single tone over which programs have no control.
  */
-int c8_sound();
+C8_API int c8_sound();
 
 /** ## I/O Routines
  * The toolkit provides several functions to save
@@ -332,14 +716,14 @@ int c8_sound();
  * Loads a program's bytes (of length `n`) into the interpreter's RAM.
  * It returns the number of bytes loaded.
  */
-size_t c8_load_program(uint8_t program[], size_t n);
+C8_API size_t c8_load_program(uint8_t program[], size_t n);
 
 /** `int c8_load_file(const char *fname);`  \
  * Loads a CHIP-8 file from disk into the interpreter's RAM.
  *
  * Returns the number of bytes read, 0 on error.
  */
-int c8_load_file(const char *fname);
+C8_API int c8_load_file(const char *fname);
 
 /** `int c8_save_file(const char *fname);`  \
  * Writes the contents of the interpreter's RAM to a file.
@@ -349,7 +733,7 @@ int c8_load_file(const char *fname);
  *
  * Returns the number of bytes written on success, 0 on failure.
  */
-int c8_save_file(const char *fname);
+C8_API int c8_save_file(const char *fname);
 
 /** `char *c8_load_txt(const char *fname);`  \
  * Utility function that loads a text file.
@@ -359,7 +743,7 @@ int c8_save_file(const char *fname);
  *
  * Returns the buffer, or `NULL` on error.
  */
-char *c8_load_txt(const char *fname);
+C8_API char *c8_load_txt(const char *fname);
 
 /** ## Output and Error handling */
 
@@ -370,7 +754,7 @@ char *c8_load_txt(const char *fname);
  * and writes to `stdout`; change it if output needs
  * to be done differently.
  */
-extern int (*c8_puts)(const char* s);
+extern C8_API int (*c8_puts)(const char* s);
 
 /** `int c8_message(const char *msg, ...);`  \
  * Outputs a formatted message.
@@ -380,12 +764,63 @@ extern int (*c8_puts)(const char* s);
  *
  * Returns the value of the `c8_puts()` call.
  */
-int c8_message(const char *msg, ...);
+C8_API int c8_message(const char *msg, ...);
 
 /** `extern char c8_message_text[];`  \
  * The internal buffer used by `c8_message()`.
  */
-extern char c8_message_text[];
+extern C8_API char c8_message_text[];
+
+/** `typedef struct {...} c8_writer_t;`  \
+ * A buffered output sink for long outputs, like the disassembler's.
+ * `c8_write()` formats text straight into `buf`, without going through
+ * `c8_message_text` and `c8_puts()` for every line.
+ *
+ * * `file` is the file that `buf` is written to when it fills up,
+ *   or `NULL` if the output stays in `buf`.
+ * * `buf` holds the `len` bytes written so far and a terminating `NUL`.
+ * * `error` is set if the output didn't fit in a caller's buffer,
+ *   memory ran out or the file couldn't be written.
+ *
+ * Use `c8_writer_file()` or `c8_writer_buffer()` to set one up.
+ */
+typedef struct {
+	FILE *file;
+	char *buf;
+	size_t size, len;
+	int owned, error;
+} c8_writer_t;
+
+/** `void c8_writer_file(c8_writer_t *w, FILE *f, char *buf, size_t size);`  \
+ * Sets up `w` to write to `f`, collecting the output in the `size` bytes
+ * at `buf` in between. If `buf` is `NULL` every `c8_write()` goes straight
+ * to `f`.
+ *
+ * Call `c8_writer_flush()` once the output is done.
+ */
+C8_API void c8_writer_file(c8_writer_t *w, FILE *f, char *buf, size_t size);
+
+/** `int c8_writer_buffer(c8_writer_t *w, char *buf, size_t size);`  \
+ * Sets up `w` to keep the output in memory, in the `size` bytes at `buf`.
+ *
+ * If `buf` is `NULL`, the buffer is `malloc()`ed and grows as needed;
+ * `free()` `w->buf` afterwards. Returns 0 if it couldn't be allocated.
+ */
+C8_API int c8_writer_buffer(c8_writer_t *w, char *buf, size_t size);
+
+/** `int c8_write(c8_writer_t *w, const char *fmt, ...);`  \
+ * Writes formatted text to `w`, with the same semantics as `printf()`.
+ *
+ * If `w` is `NULL`, the text is output through `c8_message()` instead.
+ */
+C8_API int c8_write(c8_writer_t *w, const char *fmt, ...);
+
+/** `int c8_writer_flush(c8_writer_t *w);`  \
+ * Writes what is collected in `w`'s buffer to its file.
+ *
+ * Returns 0 if `w->error` is set.
+ */
+C8_API int c8_writer_flush(c8_writer_t *w);
 
 /**
  * ## Assembler
@@ -400,9 +835,23 @@ extern char c8_message_text[];
  * `c8_load_txt()` is provided as a utility function to load
  * a text file that can be assembled.
  *
+ * Returns 0 on success. If there are errors in the text, they are reported
+ * through `c8_message()`, a non-zero value is returned and the RAM is left
+ * as it was.
+ *
+ * The assembler keeps its state in globals, so only one thread may
+ * assemble at a time; see `c8_assemble_r()` for the alternative.
+ *
  * See `asmmain.c` for an example of a program that uses this function.
  */
-int c8_assemble(const char *text);
+C8_API int c8_assemble(const char *text);
+
+/** `void c8_assemble_output(c8_writer_t *w);`  \
+ * Sets the writer that the listing of the assembled bytes goes to when
+ * `c8_verbose` is greater than 1. With `NULL`, the default, it goes through
+ * `c8_message()`.
+ */
+C8_API void c8_assemble_output(c8_writer_t *w);
 
 /**
  * `typedef char *(*c8_include_callback_t)(const char *fname);`  \
@@ -414,10 +863,170 @@ int c8_assemble(const char *text);
  * return value should be allocated on the heap, because the assembler
  * will call `free()` on it when it is done.
  *
- * `c8_include_callback` defaults to `c8_load_txt()`.
+ * `c8_include_callback` defaults to `c8_load_txt()`. The assembler keeps
+ * the files it reads with `c8_load_txt()`, by their canonical path, until
+ * `c8_asm_free()`, and only reads them again when their modification time
+ * or size changes. If the library is compiled with `C8_MMAP` defined, they
+ * are mapped into memory with `mmap()` instead, where it is available.
  */
  typedef char *(*c8_include_callback_t)(const char *fname);
- extern c8_include_callback_t c8_include_callback;
+ extern C8_API c8_include_callback_t c8_include_callback;
+
+/** ### Assembling on several threads
+ *
+ * `c8_assemble_r()` keeps the assembler's state in a `c8_asm_t` and puts the
+ * program in a buffer rather than the interpreter's RAM, so that different
+ * threads can assemble different programs at the same time. Errors are
+ * returned as diagnostics instead of going through `c8_message()`.
+ */
+
+/** `typedef struct {...} c8_diag_t;`  \
+ * An error in the text being assembled: the `message` is about the token
+ * at `column` of `line`. Both count from 1; `line` is 0 if the error isn't
+ * about a particular token, and `column` is 0 if the line is all that is
+ * known. Line numbers in included files count from the start of the file.
+ *
+ * `file` is `NULL`, except for the errors of `c8_link()`, where it is the
+ * name of the object file, and `line` and `column` are in its source.
+ */
+typedef struct {
+	int line, column;
+	const char *file;
+	char message[MAX_MESSAGE_TEXT];
+} c8_diag_t;
+
+/** `typedef struct {...} c8_asm_t;`  \
+ * The assembler's state:
+ *
+ * * `include` is called for `include` directives, like `c8_include_callback`.
+ *   If it is `NULL` they are errors.
+ * * `verbose` is the level of detail of the progress messages, like
+ *   `c8_verbose`. They go through `c8_message()`, so leave it at 0 when
+ *   several threads assemble at the same time.
+ * * `listing` is where the listing of the assembled bytes goes when `verbose`
+ *   is greater than 1, or `NULL` for `c8_message()`.
+ * * `optimize`, if nonzero, makes the assembler rewrite some sequences of
+ *   instructions into shorter or faster ones that do the same; see the
+ *   assembler's documentation.
+ * * `diags` holds the `ndiags` errors found by the last `c8_assemble_r()`.
+ * * `state` is private; it keeps the memory the assembler allocates between
+ *   calls, so reusing a `c8_asm_t` is faster than starting over.
+ */
+typedef struct {
+	c8_include_callback_t include;
+	int verbose;
+	c8_writer_t *listing;
+	int optimize;
+	c8_diag_t *diags;
+	int ndiags, diags_size;
+	struct c8_asm_state *state;
+} c8_asm_t;
+
+/** `void c8_asm_init(c8_asm_t *a);`  \
+ * Initializes `a`, with `include` set to `c8_include_callback`.
+ */
+C8_API void c8_asm_init(c8_asm_t *a);
+
+/** `void c8_asm_free(c8_asm_t *a);`  \
+ * Frees the memory allocated for `a`.
+ */
+C8_API void c8_asm_free(c8_asm_t *a);
+
+/** `int c8_assemble_r(c8_asm_t *a, const char *text, uint8_t *out, size_t size);`  \
+ * Assembles `text` with the state in `a`, and puts the program, which starts
+ * at `PROG_OFFSET`, in the `size` bytes at `out`.
+ *
+ * Returns the length of the program, or -1 if there are errors, which are
+ * then in `a->diags`.
+ */
+C8_API int c8_assemble_r(c8_asm_t *a, const char *text, uint8_t *out, size_t size);
+
+/** `int c8_asm_analyze(c8_asm_t *a, int speed, c8_writer_t *out);`  \
+ * Writes a report on the program that was last assembled with
+ * `c8_assemble_r()` to `out`. It follows the program from `PROG_OFFSET` with
+ * the disassembler's control flow graph (see `c8_cfg_build()`), and lists:
+ *
+ * * the instructions that can't be reached;
+ * * the skips that always or never skip, that skip a jump to the instruction
+ *   after the jump, or that skip a jump over a single instruction, where the
+ *   opposite skip would do without the jump;
+ * * for every subroutine, its number of instructions and the number of them
+ *   on its longest path (through the subroutines it calls, and once around
+ *   each loop before the pass that leaves it, or once around a loop that it
+ *   never leaves), also in frames at `speed` instructions per second;
+ * * for every label, the size of the code and data up to the next label and
+ *   how many instructions there are, and how many of them can be reached.
+ *
+ * Returns 0, or -1 if there is no program or it can't be followed, with the
+ * reason in `a->diags`.
+ */
+C8_API int c8_asm_analyze(c8_asm_t *a, int speed, c8_writer_t *out);
+
+/** `int c8_asm_source_map(c8_asm_t *a, const char *name, c8_writer_t *out);`  \
+ * Writes the source map (see `C8_SRCMAP_MAGIC`) of the program that was last
+ * assembled with `c8_assemble_r()` to `out`, so that addresses in the program
+ * can be traced back to the lines they were assembled from. `name` is the
+ * name of the file that held the `text` given to `c8_assemble_r()`; included
+ * files go by the names they were read with.
+ *
+ * Returns 0, or -1 if there is no program or it can't be written, with the
+ * reason in `a->diags`.
+ */
+C8_API int c8_asm_source_map(c8_asm_t *a, const char *name, c8_writer_t *out);
+
+/** `int c8_asm_listing(c8_asm_t *a, const char *name, const char *text, c8_writer_t *out);`  \
+ * Writes a listing of the program that was last assembled with
+ * `c8_assemble_r()` to `out`: the address and the bytes of every line that
+ * emitted any, with its line number and its text. `name` and `text` are
+ * the name of the file and the text given to `c8_assemble_r()`. The text of
+ * included files that the assembler didn't keep is read again through
+ * `a->include`.
+ *
+ * Returns 0, or -1 if there is no program or it can't be written, with the
+ * reason in `a->diags`.
+ */
+C8_API int c8_asm_listing(c8_asm_t *a, const char *name, const char *text, c8_writer_t *out);
+
+/** ### Separate compilation
+ *
+ * A program can be split into units that are assembled on their own into
+ * object files, and linked together into a ROM afterwards, so that only the
+ * units that changed need to be assembled again.
+ *
+ * An object file is text. It holds the bytes of the unit as it was assembled
+ * at `PROG_OFFSET`, the `global` labels it defines and the labels of other
+ * units it uses, and the fixups of the bytes whose values depend on labels. When the units are linked
+ * they are placed one after the other in the order they are given, and their
+ * labels move with them.
+ *
+ * Only the labels declared with `global` can be used by the other units, and
+ * each of them can only be defined once; the other labels are local to their
+ * unit, so two units can both have a `loop:`. `define`s and expressions that
+ * are evaluated as they are assembled, like the one of `offset`, stay local to
+ * their unit and are not relocated, so `offset` is relative to the start of
+ * the unit as if it were the whole program.
+ */
+
+/** `int c8_assemble_object(c8_asm_t *a, const char *text, c8_writer_t *out);`  \
+ * Assembles `text` with the state in `a` into an object file, written to `out`.
+ * Labels that `text` uses but doesn't define are left for `c8_link()`, to be
+ * found among the `global` labels of the other units.
+ *
+ * Returns the length of the unit, or -1 if there are errors, which are then
+ * in `a->diags`.
+ */
+C8_API int c8_assemble_object(c8_asm_t *a, const char *text, c8_writer_t *out);
+
+/** `int c8_link(c8_asm_t *a, const char *const *objects, const char *const *names, int n, uint8_t *out, size_t size);`  \
+ * Links the `n` object files whose text is in `objects` into a program that
+ * starts at `PROG_OFFSET`, and puts it in the `size` bytes at `out`.
+ * `names` holds the names of the object files for the diagnostics, and can be
+ * `NULL`.
+ *
+ * Returns the length of the program, or -1 if there are errors, which are
+ * then in `a->diags`.
+ */
+C8_API int c8_link(c8_asm_t *a, const char *const *objects, const char *const *names, int n, uint8_t *out, size_t size);
 
 /**
  * ## Disassembler
@@ -427,7 +1036,7 @@ int c8_assemble(const char *text);
 /** `void c8_disasm_start();`  \
  * Initializes the variables used by the disassembler to track its state.
  */
-void c8_disasm_start();
+C8_API void c8_disasm_start();
 
 /** `void c8_disasm_reachable(uint16_t addr)`  \
  *
@@ -435,23 +1044,242 @@ void c8_disasm_start();
  *
  * The disassembler follows the different branches in a program to determine
  * which instructions are reachable. It does this to determine which bytes in
- * the program are code and which are data. Unfortunately this does not work for
- * the `JP V0, nnn` (`Bnnn`) instruction, because it won't know what the value
- * in `V0` is (and `Bnnn`'s behaviour also depends on the `QUIRKS_JUMP` quirk).
+ * the program are code and which are data. This is harder for the
+ * `JP V0, nnn` (`Bnnn`) instruction, because it won't know what the value
+ * in `V0` is (and `Bnnn`'s behaviour also depends on the `QUIRKS_JUMP` quirk,
+ * which is taken from `c8_get_quirks()`).
  *
- * If you can determine the `Bnnn`'s intended destination, you could mark
- * that destination as reachable, and rerun the disassembler.
+ * The disassembler works out the range of values the register can hold from
+ * the instructions before the `Bnnn` in the same basic block, such as a
+ * `LD V0, kk`, or a `RND` and `SHL` that index a table of `JP`s, and follows
+ * every target in that range. If the value comes from elsewhere and you can
+ * determine the `Bnnn`'s intended destination, you could mark that
+ * destination as reachable, and rerun the disassembler.
  */
-void c8_disasm_reachable(uint16_t addr);
+C8_API void c8_disasm_reachable(uint16_t addr);
+
+/** `int c8_disasm_coverage(const char *fname);`  \
+ * Loads coverage recorded while running the program (see `c8_coverage_start()`
+ * and `c8_coverage_save()`) from the file `fname`.
+ *
+ * Every instruction that was executed is then treated as reachable, even if
+ * the disassembler can't work out how it is reached, and the data read by
+ * `DRW` and `LD Vx, [I]` decides where the `db` data starts instead of the
+ * `LD I, nnn` instructions. Returns 0 if the file couldn't be read.
+ */
+C8_API int c8_disasm_coverage(const char *fname);
+
+/** `void c8_disasm_output(c8_writer_t *w);`  \
+ * Sets the writer that `c8_disasm()`, `c8_disasm_c()`, `c8_cfg_json()` and
+ * `c8_cfg_dot()` write to. With `NULL`, the default, their output goes through
+ * `c8_message()` line by line. They flush `w` when they are done.
+ *
+ * Errors are still reported through `c8_message()`.
+ */
+C8_API void c8_disasm_output(c8_writer_t *w);
 
 /** `void c8_disasm();`  \
  * Disassembles the program currently in the interpreter's RAM.
  *
- * The output is written through `c8_puts()`.
+ * The output is written to the writer set with `c8_disasm_output()`.
  *
  * See `dasmmain.c` for an example of a program that uses this function.
  */
-void c8_disasm();
+C8_API void c8_disasm();
+
+/** ### Control flow graph
+ *
+ * `c8_cfg_build()` performs the analysis behind `c8_disasm()` and returns
+ * its results as a control flow graph, for tools that want to work with the
+ * structure of a program rather than its text.
+ */
+
+/** `typedef enum {...} c8_edge_kind_t;`  \
+ * The ways control can get from one block to another:
+ *
+ * * `C8_EDGE_FALLTHROUGH` - to the next instruction, including a skip that
+ *   doesn't skip
+ * * `C8_EDGE_SKIP` - over the next instruction
+ * * `C8_EDGE_JUMP` - through a `JP nnn`, or a `JP V0, nnn` to each of its
+ *   possible targets
+ * * `C8_EDGE_CALL` - through a `CALL nnn`, to the subroutine's first block
+ * * `C8_EDGE_RETURN` - through a `RET`, to the instruction after each `CALL`
+ *   of the subroutine
+ */
+typedef enum {
+	C8_EDGE_FALLTHROUGH,
+	C8_EDGE_SKIP,
+	C8_EDGE_JUMP,
+	C8_EDGE_CALL,
+	C8_EDGE_RETURN
+} c8_edge_kind_t;
+
+/** `typedef struct {...} c8_block_t;`  \
+ * A basic block: the instructions from `start` up to, but not including, `end`.
+ */
+typedef struct {
+	uint16_t start, end;
+} c8_block_t;
+
+/** `typedef struct {...} c8_edge_t;`  \
+ * An edge from the block at index `from` to the block at index `to`.
+ */
+typedef struct {
+	int from, to;
+	c8_edge_kind_t kind;
+} c8_edge_t;
+
+/** `typedef struct {...} c8_func_t;`  \
+ * A node in the call graph: the program itself (the first one) or a subroutine,
+ * starting at `entry`, which is the start of the block at index `block`.
+ * `callees` holds the indexes of the `ncallees` subroutines it calls.
+ */
+typedef struct {
+	uint16_t entry;
+	int block;
+	int ncallees;
+	int *callees;
+} c8_func_t;
+
+/** `typedef struct {...} c8_cfg_t;`  \
+ * The control flow graph of a program:
+ *
+ * * `blocks` holds `nblocks` blocks, sorted by address.
+ * * `edges` holds `nedges` edges.
+ * * `funcs` holds `nfuncs` call graph nodes.
+ * * `reachable` has a bit set for the address of every reachable instruction,
+ *   `touched` for every address loaded by a `LD I, nnn`, and `labels` for
+ *   every address that is jumped to or marked with `c8_disasm_reachable()`.
+ *   Bit `addr & 7` of byte `addr >> 3` is the bit for `addr`.
+ */
+typedef struct {
+	c8_block_t *blocks;
+	int nblocks;
+	c8_edge_t *edges;
+	int nedges;
+	c8_func_t *funcs;
+	int nfuncs;
+	uint8_t reachable[TOTAL_RAM/8];
+	uint8_t touched[TOTAL_RAM/8];
+	uint8_t labels[TOTAL_RAM/8];
+} c8_cfg_t;
+
+/** `c8_cfg_t *c8_cfg_build();`  \
+ * Builds the control flow graph of the program currently in the interpreter's
+ * RAM, starting at `PROG_OFFSET` and at the addresses marked with
+ * `c8_disasm_reachable()`.
+ *
+ * Returns `NULL` if the program couldn't be followed, after reporting why
+ * through `c8_message()`. Free the graph with `c8_cfg_free()`.
+ */
+C8_API c8_cfg_t *c8_cfg_build();
+
+/** `void c8_cfg_free(c8_cfg_t *cfg);`  \
+ * Frees a control flow graph returned by `c8_cfg_build()`.
+ */
+C8_API void c8_cfg_free(c8_cfg_t *cfg);
+
+/** `int c8_cfg_block(const c8_cfg_t *cfg, uint16_t addr);`  \
+ * Returns the index of the block containing `addr`, or -1 if there is none.
+ */
+C8_API int c8_cfg_block(const c8_cfg_t *cfg, uint16_t addr);
+
+/** `void c8_cfg_json(const c8_cfg_t *cfg);`  \
+ * `void c8_cfg_dot(const c8_cfg_t *cfg);`  \
+ * Write the graph to the writer set with `c8_disasm_output()` as JSON,
+ * or in the DOT language of
+ * [Graphviz](https://graphviz.org/).
+ */
+C8_API void c8_cfg_json(const c8_cfg_t *cfg);
+C8_API void c8_cfg_dot(const c8_cfg_t *cfg);
+
+/** `void c8_disasm_c(const char *name);`  \
+ * Translates the program currently in the interpreter's RAM into C source code,
+ * so that it can be compiled ahead of time.
+ *
+ * It uses the same analysis as `c8_disasm()` to find the reachable instructions.
+ * The instructions that only do arithmetic on the registers and `I`, and the
+ * `JP` and skip instructions that end a block, are translated into C. Everything
+ * else (drawing, keys, timers, `SYS`, `CALL`/`RET`, stores to RAM) and jumps to
+ * addresses that were not translated, such as the destinations of a `JP V0, nnn`,
+ * are left to the interpreter.
+ *
+ * The generated code defines `int name_start()`, which installs the translated
+ * code in `c8_block_hook` and `c8_store_hook` so that `c8_run()` uses it, and
+ * `void name_stop()`. Translated code only runs while the RAM it was translated
+ * from is unchanged, so programs that modify themselves still work.
+ *
+ * The output is written to the writer set with `c8_disasm_output()`.
+ */
+C8_API void c8_disasm_c(const char *name);
+
+/** ### Disassembling other programs
+ *
+ * The functions above disassemble the program in the interpreter's RAM, and
+ * keep the disassembler's state in a global. The functions ending in `_r`
+ * do the same with the state in a `c8_disasm_t`, for a program anywhere in
+ * memory, so that different threads can disassemble different programs at
+ * the same time.
+ */
+
+/** `typedef struct {...} c8_disasm_t;`  \
+ * The disassembler's state:
+ *
+ * * `ram` is the `TOTAL_RAM` bytes holding the program, at `PROG_OFFSET`.
+ * * `quirks` decides where `JP V0, nnn`s go, like `c8_get_quirks()`.
+ * * `output` is the writer for the output, or `NULL` for `c8_message()`.
+ * * `roots` holds the `nroots` addresses marked with `c8_disasm_reachable_r()`.
+ * * `have_coverage`, `covered_code` and `covered_data` hold the coverage
+ *   loaded with `c8_disasm_coverage_r()`.
+ * * `error` holds the last error, which is also output through `c8_puts()`.
+ *   It is cleared at the start of every disassembly.
+ */
+typedef struct {
+	const uint8_t *ram;
+	unsigned int quirks;
+	c8_writer_t *output;
+	uint16_t *roots;
+	int nroots, roots_size;
+	int have_coverage;
+	uint8_t covered_code[TOTAL_RAM/8], covered_data[TOTAL_RAM/8];
+	char error[MAX_MESSAGE_TEXT];
+} c8_disasm_t;
+
+/** `void c8_disasm_init(c8_disasm_t *d, const uint8_t *ram);`  \
+ * Initializes `d` to disassemble the program in `ram`, with the quirks
+ * from `c8_get_quirks()`.
+ */
+C8_API void c8_disasm_init(c8_disasm_t *d, const uint8_t *ram);
+
+/** `void c8_disasm_free(c8_disasm_t *d);`  \
+ * Frees the memory allocated for `d->roots`.
+ */
+C8_API void c8_disasm_free(c8_disasm_t *d);
+
+/** `void c8_disasm_reachable_r(c8_disasm_t *d, uint16_t addr);`  \
+ * `int c8_disasm_coverage_r(c8_disasm_t *d, const char *fname);`  \
+ * `c8_cfg_t *c8_cfg_build_r(c8_disasm_t *d);`  \
+ * `void c8_disasm_r(c8_disasm_t *d);`  \
+ * `void c8_disasm_c_r(c8_disasm_t *d, const char *name);`  \
+ * `void c8_cfg_json_r(c8_disasm_t *d, const c8_cfg_t *cfg);`  \
+ * `void c8_cfg_dot_r(c8_disasm_t *d, const c8_cfg_t *cfg);`  \
+ * Like `c8_disasm_reachable()`, `c8_disasm_coverage()`, `c8_cfg_build()`,
+ * `c8_disasm()`, `c8_disasm_c()`, `c8_cfg_json()` and `c8_cfg_dot()`, for
+ * the program and state in `d`.
+ */
+C8_API void c8_disasm_reachable_r(c8_disasm_t *d, uint16_t addr);
+C8_API int c8_disasm_coverage_r(c8_disasm_t *d, const char *fname);
+C8_API c8_cfg_t *c8_cfg_build_r(c8_disasm_t *d);
+C8_API void c8_disasm_r(c8_disasm_t *d);
+C8_API void c8_disasm_c_r(c8_disasm_t *d, const char *name);
+C8_API void c8_cfg_json_r(c8_disasm_t *d, const c8_cfg_t *cfg);
+C8_API void c8_cfg_dot_r(c8_disasm_t *d, const c8_cfg_t *cfg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CHIP8_H */
 
 /**
  * [wikipedia]: https://en.wikipedia.org/wiki/CHIP-8
@@ -1,31 +1,567 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "chip8.h"
 
+/* Corpus mode:
+	`c8dasm -p threads *.ch8` disassembles every ROM into `rom.ch8.asm` on a
+	pool of threads (using `rom.ch8.cov` from `c8bench -r` if there is one),
+	and prints statistics about the reachable instructions of all of them:
+	how often each class of instruction occurs, the most common sequences of
+	two and three instructions within a basic block, which ROMs use SCHIP
+	instructions, and which ROMs have stores that can write into their own
+	code. The statistics are what the superinstructions in `c8_run()` and the
+	specializations in the JIT are chosen from.
+
+	With `-V` it checks instead that assembling each disassembly gives back
+	the ROM, and reports the first address where it doesn't (`make check`). */
+
+/* Classes of instructions, by opcode. The first match counts. */
+static const struct {
+	uint16_t mask, value;
+	const char *name;
+	int schip;
+} classes[] = {
+	{0xFFFF, 0x00E0, "00E0 CLS", 0},
+	{0xFFFF, 0x00EE, "00EE RET", 0},
+	{0xFFF0, 0x00C0, "00Cn SCD", 1},
+	{0xFFFF, 0x00FB, "00FB SCR", 1},
+	{0xFFFF, 0x00FC, "00FC SCL", 1},
+	{0xFFFF, 0x00FD, "00FD EXIT", 1},
+	{0xFFFF, 0x00FE, "00FE LOW", 1},
+	{0xFFFF, 0x00FF, "00FF HIGH", 1},
+	{0xF000, 0x0000, "0nnn SYS", 0},
+	{0xF000, 0x1000, "1nnn JP", 0},
+	{0xF000, 0x2000, "2nnn CALL", 0},
+	{0xF000, 0x3000, "3xkk SE", 0},
+	{0xF000, 0x4000, "4xkk SNE", 0},
+	{0xF00F, 0x5000, "5xy0 SE", 0},
+	{0xF000, 0x6000, "6xkk LD", 0},
+	{0xF000, 0x7000, "7xkk ADD", 0},
+	{0xF00F, 0x8000, "8xy0 LD", 0},
+	{0xF00F, 0x8001, "8xy1 OR", 0},
+	{0xF00F, 0x8002, "8xy2 AND", 0},
+	{0xF00F, 0x8003, "8xy3 XOR", 0},
+	{0xF00F, 0x8004, "8xy4 ADD", 0},
+	{0xF00F, 0x8005, "8xy5 SUB", 0},
+	{0xF00F, 0x8006, "8xy6 SHR", 0},
+	{0xF00F, 0x8007, "8xy7 SUBN", 0},
+	{0xF00F, 0x800E, "8xyE SHL", 0},
+	{0xF00F, 0x9000, "9xy0 SNE", 0},
+	{0xF000, 0xA000, "Annn LD I", 0},
+	{0xF000, 0xB000, "Bnnn JP V0", 0},
+	{0xF000, 0xC000, "Cxkk RND", 0},
+	{0xF00F, 0xD000, "Dxy0 DRW", 1},
+	{0xF000, 0xD000, "Dxyn DRW", 0},
+	{0xF0FF, 0xE09E, "Ex9E SKP", 0},
+	{0xF0FF, 0xE0A1, "ExA1 SKNP", 0},
+	{0xF0FF, 0xF007, "Fx07 DELAY", 0},
+	{0xF0FF, 0xF00A, "Fx0A KEY", 0},
+	{0xF0FF, 0xF015, "Fx15 DELAY", 0},
+	{0xF0FF, 0xF018, "Fx18 SOUND", 0},
+	{0xF0FF, 0xF01E, "Fx1E ADD I", 0},
+	{0xF0FF, 0xF029, "Fx29 HEX", 0},
+	{0xF0FF, 0xF030, "Fx30 HEXX", 1},
+	{0xF0FF, 0xF033, "Fx33 BCD", 0},
+	{0xF0FF, 0xF055, "Fx55 STOR", 0},
+	{0xF0FF, 0xF065, "Fx65 RSTR", 0},
+	{0xF0FF, 0xF075, "Fx75 STORX", 1},
+	{0xF0FF, 0xF085, "Fx85 RSTRX", 1},
+	{0x0000, 0x0000, "???? other", 0},
+};
+#define NCLASSES	((int)(sizeof classes / sizeof classes[0]))
+
+/* The number of SMC candidates listed per ROM */
+#define MAX_SMC	8
+
+/* The number of n-grams listed */
+#define TOP_NGRAMS	20
+
+typedef struct {
+	const char *fname;
+	int ok;
+	int ninsns;
+	int count[NCLASSES];
+	/* The first MAX_SMC of the `nsmc` stores that may write into code */
+	uint16_t smc[MAX_SMC];
+	int nsmc;
+	/* With -V, the first address where the assembled disassembly differs
+		from the ROM, or 0 */
+	uint16_t diff;
+	uint8_t expected, got;
+	char error[MAX_MESSAGE_TEXT];
+} rom_stats_t;
+
+/* Counts of pairs and triples of classes, kept by each thread */
+typedef struct {
+	uint32_t pairs[NCLASSES][NCLASSES];
+	uint32_t triples[NCLASSES][NCLASSES][NCLASSES];
+} ngrams_t;
+
+static struct {
+	pthread_mutex_t lock;
+	char **files;
+	int nfiles, next;
+	rom_stats_t *roms;
+	unsigned int quirks;
+	int verify;
+} corpus;
+
+static int classify(uint16_t opcode) {
+	int i;
+	for(i = 0; (opcode & classes[i].mask) != classes[i].value; i++);
+	return i;
+}
+
+#define REACHABLE(cfg, addr) ((cfg)->reachable[(addr) >> 3] & (1 << ((addr) & 0x07)))
+
+/* The addresses `I` can hold; empty if lo > hi */
+typedef struct {
+	int lo, hi;
+} span_t;
+
+/* Works out what `I` can be after `opcode`, and how many bytes `opcode`
+	stores at `I` before that */
+static span_t step_i(span_t i, uint16_t opcode, int *stored) {
+	*stored = 0;
+	if((opcode & 0xF000) == 0xA000) {
+		i.lo = i.hi = opcode & 0x0FFF;
+	} else if((opcode & 0xF0FF) == 0xF01E) {
+		i.hi += 0xFF;
+	} else if((opcode & 0xF0FF) == 0xF029 || (opcode & 0xF0FF) == 0xF030) {
+		i.lo = 0;
+		i.hi = PROG_OFFSET - 1;
+	} else if((opcode & 0xF0FF) == 0xF033) {
+		*stored = 3;
+	} else if((opcode & 0xF0FF) == 0xF055 || (opcode & 0xF0FF) == 0xF065) {
+		/* `I` moves on or not, depending on the quirks */
+		i.hi += ((opcode >> 8) & 0x0F) + 1;
+		if((opcode & 0xF0FF) == 0xF055)
+			*stored = ((opcode >> 8) & 0x0F) + 1;
+	}
+	if(i.hi > TOTAL_RAM - 1)
+		i.hi = TOTAL_RAM - 1;
+	return i;
+}
+
+static span_t run_block(span_t i, const c8_block_t *block, const uint8_t *ram) {
+	uint16_t addr;
+	int n;
+	for(addr = block->start; addr < block->end; addr += 2)
+		i = step_i(i, ram[addr] << 8 | ram[addr + 1], &n);
+	return i;
+}
+
+/* Looks for `BCD` and `STOR` instructions that can store into reachable
+	code. What `I` can hold at the start of each block is the union of what
+	it can hold at the end of the blocks before it, worked out until nothing
+	changes. Blocks that nothing leads to, like the destinations of a
+	`JP V0, nnn` found through coverage, start with any `I`. */
+static void find_smc(rom_stats_t *rom, const c8_cfg_t *cfg, const uint8_t *ram) {
+	span_t *in, out;
+	int b, e, n, a, changed;
+	uint16_t addr;
+
+	if(cfg->nblocks <= 0 || !(in = malloc(cfg->nblocks * sizeof *in)))
+		return;
+	for(b = 0; b < cfg->nblocks; b++) {
+		in[b].lo = 0;
+		in[b].hi = TOTAL_RAM - 1;
+		for(e = 0; e < cfg->nedges; e++)
+			if(cfg->edges[e].to == b) {
+				in[b].lo = 1;
+				in[b].hi = 0;
+				break;
+			}
+		if(cfg->blocks[b].start == PROG_OFFSET && in[b].lo > in[b].hi)
+			in[b].lo = in[b].hi = 0;
+	}
+	do {
+		changed = 0;
+		for(e = 0; e < cfg->nedges; e++) {
+			const c8_edge_t *edge = &cfg->edges[e];
+			span_t *to = &in[edge->to];
+			if(in[edge->from].lo > in[edge->from].hi)
+				continue;
+			out = run_block(in[edge->from], &cfg->blocks[edge->from], ram);
+			if(to->lo > to->hi) {
+				*to = out;
+				changed = 1;
+				continue;
+			}
+			if(out.lo < to->lo) {
+				to->lo = out.lo;
+				changed = 1;
+			}
+			if(out.hi > to->hi) {
+				to->hi = out.hi;
+				changed = 1;
+			}
+		}
+	} while(changed);
+
+	for(b = 0; b < cfg->nblocks; b++) {
+		out = in[b];
+		if(out.lo > out.hi)
+			continue;
+		for(addr = cfg->blocks[b].start; addr < cfg->blocks[b].end; addr += 2) {
+			span_t i = out;
+			out = step_i(out, ram[addr] << 8 | ram[addr + 1], &n);
+			if(!n)
+				continue;
+			for(a = i.lo; a < i.hi + n && a < TOTAL_RAM && !REACHABLE(cfg, a); a++);
+			if(a < i.hi + n && a < TOTAL_RAM) {
+				if(rom->nsmc < MAX_SMC)
+					rom->smc[rom->nsmc] = addr;
+				rom->nsmc++;
+			}
+		}
+	}
+	free(in);
+}
+
+static void count_insns(rom_stats_t *rom, ngrams_t *g, const c8_cfg_t *cfg, const uint8_t *ram) {
+	int b, c, prev, prev2;
+	uint16_t addr;
+	for(b = 0; b < cfg->nblocks; b++) {
+		prev = prev2 = -1;
+		for(addr = cfg->blocks[b].start; addr < cfg->blocks[b].end; addr += 2) {
+			c = classify(ram[addr] << 8 | ram[addr + 1]);
+			rom->count[c]++;
+			rom->ninsns++;
+			if(prev >= 0)
+				g->pairs[prev][c]++;
+			if(prev2 >= 0)
+				g->triples[prev2][prev][c]++;
+			prev2 = prev;
+			prev = c;
+		}
+	}
+}
+
+/* Assembles the disassembly of the ROM in `ram` with the thread's
+	assembler `a`, and compares the result with the ROM. */
+static void verify_rom(rom_stats_t *rom, c8_disasm_t *d, const uint8_t *ram, c8_asm_t *a) {
+	uint8_t prog[TOTAL_RAM - PROG_OFFSET];
+	c8_writer_t out;
+	int addr, n;
+
+	if(!c8_writer_buffer(&out, NULL, 0)) {
+		snprintf(rom->error, sizeof rom->error, "error: out of memory\n");
+		return;
+	}
+	d->output = &out;
+	c8_disasm_r(d);
+	if(d->error[0] || out.error) {
+		snprintf(rom->error, sizeof rom->error, "%s", out.error ? "error: out of memory\n" : d->error);
+		free(out.buf);
+		return;
+	}
+
+	n = c8_assemble_r(a, out.buf, prog, sizeof prog);
+	if(n < 0) {
+		if(a->ndiags)
+			snprintf(rom->error, sizeof rom->error, "error:%d: %.100s\n", a->diags[0].line, a->diags[0].message);
+		else
+			snprintf(rom->error, sizeof rom->error, "error: out of memory\n");
+	} else {
+		memset(prog + n, 0, sizeof prog - n);
+		for(addr = PROG_OFFSET; addr < TOTAL_RAM && prog[addr - PROG_OFFSET] == ram[addr]; addr++);
+		if(addr < TOTAL_RAM) {
+			rom->diff = addr;
+			rom->expected = ram[addr];
+			rom->got = prog[addr - PROG_OFFSET];
+		}
+		rom->ok = addr == TOTAL_RAM;
+	}
+	free(out.buf);
+}
+
+static void disasm_rom(rom_stats_t *rom, ngrams_t *g, uint8_t *ram, c8_asm_t *a) {
+	static const size_t max_size = TOTAL_RAM - PROG_OFFSET;
+	char name[FILENAME_MAX], buffer[1 << 14];
+	c8_disasm_t d;
+	c8_cfg_t *cfg;
+	c8_writer_t out;
+	FILE *f;
+
+	memset(ram, 0, TOTAL_RAM);
+	if(!(f = fopen(rom->fname, "rb"))) {
+		snprintf(rom->error, sizeof rom->error, "error: unable to read the ROM\n");
+		return;
+	}
+	fread(ram + PROG_OFFSET, 1, max_size, f);
+	fclose(f);
+
+	c8_disasm_init(&d, ram);
+	d.quirks = corpus.quirks;
+	snprintf(name, sizeof name, "%s.cov", rom->fname);
+	c8_disasm_coverage_r(&d, name);
+
+	if(corpus.verify) {
+		verify_rom(rom, &d, ram, a);
+		c8_disasm_free(&d);
+		return;
+	}
+
+	if(!(cfg = c8_cfg_build_r(&d))) {
+		snprintf(rom->error, sizeof rom->error, "%s", d.error);
+		c8_disasm_free(&d);
+		return;
+	}
+	count_insns(rom, g, cfg, ram);
+	find_smc(rom, cfg, ram);
+	c8_cfg_free(cfg);
+
+	snprintf(name, sizeof name, "%s.asm", rom->fname);
+	if(!(f = fopen(name, "w"))) {
+		snprintf(rom->error, sizeof rom->error, "error: unable to write the .asm file\n");
+	} else {
+		c8_writer_file(&out, f, buffer, sizeof buffer);
+		d.output = &out;
+		c8_disasm_r(&d);
+		if(d.error[0])
+			snprintf(rom->error, sizeof rom->error, "%s", d.error);
+		else if(!c8_writer_flush(&out))
+			snprintf(rom->error, sizeof rom->error, "error: unable to write the .asm file\n");
+		fclose(f);
+		rom->ok = !rom->error[0];
+	}
+	c8_disasm_free(&d);
+}
+
+static void *worker(void *arg) {
+	ngrams_t *g = arg;
+	uint8_t *ram = malloc(TOTAL_RAM);
+	c8_asm_t a;
+	int i;
+	if(!ram)
+		return NULL;
+	c8_asm_init(&a);
+	for(;;) {
+		pthread_mutex_lock(&corpus.lock);
+		i = corpus.next++;
+		pthread_mutex_unlock(&corpus.lock);
+		if(i >= corpus.nfiles)
+			break;
+		disasm_rom(&corpus.roms[i], g, ram, &a);
+	}
+	c8_asm_free(&a);
+	free(ram);
+	return NULL;
+}
+
+static void print_top(const char *title, const uint32_t *counts, int n, int len) {
+	int i, j, k, c, best;
+	char *taken = calloc(n, 1);
+	if(!taken)
+		return;
+	printf("\n%s:\n", title);
+	for(k = 0; k < TOP_NGRAMS; k++) {
+		for(best = -1, i = 0; i < n; i++)
+			if(!taken[i] && counts[i] && (best < 0 || counts[i] > counts[best]))
+				best = i;
+		if(best < 0)
+			break;
+		taken[best] = 1;
+		printf("  %10u", counts[best]);
+		for(j = len - 1; j >= 0; j--) {
+			for(c = best, i = 0; i < j; i++)
+				c /= NCLASSES;
+			printf("  %-12s", classes[c % NCLASSES].name);
+		}
+		printf("\n");
+	}
+	free(taken);
+}
+
+static int quiet_puts(const char *s) {
+	(void)s;
+	return 0;
+}
+
+static int run_corpus(int nthreads, int verify, char **files, int nfiles) {
+	pthread_t *threads = calloc(nthreads, sizeof *threads);
+	ngrams_t **grams = calloc(nthreads, sizeof *grams);
+	uint64_t count[NCLASSES], ninsns = 0;
+	int uses[NCLASSES], i, j, k, ok = 0, schip, schip_roms = 0, smc = 0, smc_roms = 0;
+
+	corpus.roms = calloc(nfiles, sizeof *corpus.roms);
+	if(!threads || !grams || !corpus.roms) {
+		fprintf(stderr, "error: out of memory\n");
+		return 1;
+	}
+	for(i = 0; i < nthreads; i++) {
+		if(!(grams[i] = calloc(1, sizeof **grams))) {
+			fprintf(stderr, "error: out of memory\n");
+			return 1;
+		}
+	}
+	for(i = 0; i < nfiles; i++)
+		corpus.roms[i].fname = files[i];
+	corpus.files = files;
+	corpus.nfiles = nfiles;
+	corpus.next = 0;
+	corpus.quirks = c8_get_quirks();
+	corpus.verify = verify;
+
+	/* The errors are reported with the names of the ROMs below */
+	c8_puts = quiet_puts;
+
+	pthread_mutex_init(&corpus.lock, NULL);
+	for(i = 0; i < nthreads; i++) {
+		if(pthread_create(&threads[i], NULL, worker, grams[i])) {
+			fprintf(stderr, "error: unable to start a thread\n");
+			break;
+		}
+	}
+	/* Whatever is left if no thread could be started */
+	if(!i)
+		worker(grams[0]);
+	for(j = 0; j < i; j++)
+		pthread_join(threads[j], NULL);
+	pthread_mutex_destroy(&corpus.lock);
+
+	memset(count, 0, sizeof count);
+	memset(uses, 0, sizeof uses);
+	for(i = 0; i < nfiles; i++) {
+		rom_stats_t *rom = &corpus.roms[i];
+		if(rom->error[0])
+			fprintf(stderr, "%s: %s", rom->fname, rom->error);
+		ok += rom->ok;
+		ninsns += rom->ninsns;
+		for(j = 0; j < NCLASSES; j++) {
+			count[j] += rom->count[j];
+			uses[j] += rom->count[j] > 0;
+		}
+	}
+	for(k = 1; k < nthreads; k++) {
+		for(i = 0; i < NCLASSES; i++) {
+			for(j = 0; j < NCLASSES; j++) {
+				int l;
+				grams[0]->pairs[i][j] += grams[k]->pairs[i][j];
+				for(l = 0; l < NCLASSES; l++)
+					grams[0]->triples[i][j][l] += grams[k]->triples[i][j][l];
+			}
+		}
+	}
+
+	if(corpus.verify) {
+		for(i = 0; i < nfiles; i++) {
+			rom_stats_t *rom = &corpus.roms[i];
+			if(rom->diff)
+				printf("%s: differs at #%03X (#%02X instead of #%02X)\n", rom->fname,
+					rom->diff, rom->got, rom->expected);
+		}
+		printf("%d of %d ROMs assemble back from their disassembly\n", ok, nfiles);
+		goto done;
+	}
+
+	printf("Disassembled %d of %d ROMs, with %llu reachable instructions\n", ok, nfiles,
+		(unsigned long long)ninsns);
+
+	printf("\nInstruction classes:\n");
+	printf("  %-12s  %10s  %7s  %6s\n", "class", "count", "", "ROMs");
+	for(i = 0; i < NCLASSES; i++) {
+		if(count[i])
+			printf("  %-12s  %10llu  %6.2f%%  %6d\n", classes[i].name,
+				(unsigned long long)count[i], 100.0 * count[i] / ninsns, uses[i]);
+	}
+
+	print_top("Most common pairs in a block", &grams[0]->pairs[0][0], NCLASSES * NCLASSES, 2);
+	print_top("Most common triples in a block", &grams[0]->triples[0][0][0], NCLASSES * NCLASSES * NCLASSES, 3);
+
+	for(i = 0; i < nfiles; i++) {
+		rom_stats_t *rom = &corpus.roms[i];
+		for(schip = 0, j = 0; j < NCLASSES; j++)
+			if(classes[j].schip)
+				schip += rom->count[j];
+		if(!schip)
+			continue;
+		if(!schip_roms++)
+			printf("\nROMs that use SCHIP instructions:\n");
+		printf("  %s: %d instructions\n", rom->fname, schip);
+	}
+	printf("\n%d ROMs use SCHIP instructions\n", schip_roms);
+
+	for(i = 0; i < nfiles; i++) {
+		rom_stats_t *rom = &corpus.roms[i];
+		if(!rom->nsmc)
+			continue;
+		if(!smc_roms++)
+			printf("\nStores that may write into code:\n");
+		printf("  %s:", rom->fname);
+		for(j = 0; j < rom->nsmc && j < MAX_SMC; j++)
+			printf(" #%03X", rom->smc[j]);
+		if(rom->nsmc > MAX_SMC)
+			printf(" and %d more", rom->nsmc - MAX_SMC);
+		printf("\n");
+		smc += rom->nsmc;
+	}
+	printf("\n%d stores in %d ROMs may write into code\n", smc, smc_roms);
+
+done:
+	for(i = 0; i < nthreads; i++)
+		free(grams[i]);
+	free(grams);
+	free(threads);
+	free(corpus.roms);
+	return ok < nfiles;
+}
+
 static void usage(const char *name) {
 	printf("usage: %s [options] infile.bin\n", name);
+	printf("       %s -p threads [-q quirks] [-V] infile.bin...\n", name);
 	printf("where options are:\n");
 	printf(" -d             : Dump bytes\n");
 	printf(" -a             : Dump bytes with addresses\n");
 	printf(" -r address     : Marks `address` as reachable\n");
+	printf(" -q quirks      : Sets the quirks, for working out where `JP V0, nnn`s go\n");
+	printf(" -t file        : Uses coverage recorded with `chip8 -r file`\n");
+	printf(" -c name        : Translate to C, with functions `name_start()`\n");
+	printf("                  and `name_stop()`\n");
+	printf(" -j             : Write the control flow graph as JSON\n");
+	printf(" -g             : Write the control flow graph for Graphviz\n");
+	printf(" -p threads     : Disassemble every infile to infile.asm on `threads`\n");
+	printf("                  threads, and print statistics about them all\n");
+	printf(" -V             : With -p, check that assembling the disassembly\n");
+	printf("                  of every infile gives back the infile instead\n");
 	printf(" -v             : Verbose mode\n");
 }
 
 int main(int argc, char *argv[]) {
 
-	int opt, dump = 0;
-	const char *infile = NULL;
+	int opt, dump = 0, graph = 0, threads = 0, verify = 0;
+	const char *infile = NULL, *c_name = NULL;
+	static char buffer[1 << 16];
+	c8_writer_t out;
 
 	c8_reset();
 	c8_disasm_start();
 
-	while((opt = getopt(argc, argv, "vdar:?")) != -1) {
+	c8_writer_file(&out, stdout, buffer, sizeof buffer);
+	c8_disasm_output(&out);
+
+	while((opt = getopt(argc, argv, "vdar:q:t:c:jgp:V?")) != -1) {
 		switch(opt) {
 			case 'd': dump = 1; break;
 			case 'a': dump = 2; break;
+			case 'c': c_name = optarg; break;
+			case 'q': c8_set_quirks(strtol(optarg, NULL, 0)); break;
+			case 't': {
+				if(!c8_disasm_coverage(optarg)) {
+					fprintf(stderr, "error: Unable to load coverage from %s\n", optarg);
+					return 1;
+				}
+			} break;
+			case 'j': graph = 'j'; break;
+			case 'g': graph = 'g'; break;
+			case 'p': threads = atoi(optarg); break;
+			case 'V': verify = 1; break;
 			case 'v': {
 				c8_verbose++;
 			} break;
@@ -45,6 +581,8 @@ int main(int argc, char *argv[]) {
         usage(argv[0]);
         return 1;
     }
+	if(threads > 0)
+		return run_corpus(threads, verify, argv + optind, argc - optind);
 	infile = argv[optind++];
 
 
@@ -53,18 +591,30 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
-	if(dump == 0) {
+	if(c_name) {
+		c8_disasm_c(c_name);
+	} else if(graph) {
+		c8_cfg_t *cfg = c8_cfg_build();
+		if(!cfg)
+			return 1;
+		if(graph == 'j')
+			c8_cfg_json(cfg);
+		else
+			c8_cfg_dot(cfg);
+		c8_cfg_free(cfg);
+	} else if(dump == 0) {
 		c8_disasm();
 	} else {
 		uint16_t pc;
 		for(pc = PROG_OFFSET; pc < c8_prog_size(); pc += 2) {
 			uint16_t op = c8_opcode(pc);
 			if(dump == 2) {
-				c8_message("%03X: %04X\n", pc, op);
+				c8_write(&out, "%03X: %04X\n", pc, op);
 			} else {
-				c8_message("%04X\n", op);
+				c8_write(&out, "%04X\n", op);
 			}
 		}
+		c8_writer_flush(&out);
 	}
-	return 0;
+	return !c8_writer_flush(&out);
 }
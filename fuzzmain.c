@@ -0,0 +1,197 @@
+/* Fuzzing harness for the CHIP-8 interpreter.
+
+It can be built in three ways:
+
+* With libFuzzer: compile with `-fsanitize=fuzzer -DC8_LIBFUZZER`; libFuzzer
+  then provides `main()` and calls `LLVMFuzzerTestOneInput()` for every input.
+  The PC and opcode bitmaps below are placed in libFuzzer's extra counters
+  section so that they count as coverage.
+* With AFL: compile with `afl-clang-fast`. `main()` then uses AFL's
+  persistent mode (`__AFL_LOOP`) to run many inputs in the same process.
+* Standalone: `main()` runs each file on the command line (or `stdin`) once
+  and reports how many distinct program counters and opcodes were covered.
+  This is useful for measuring the coverage of a corpus and for reproducing
+  crashes.
+
+The input is laid out like this:
+
+* byte 0: the quirks (see `c8_set_quirks()`)
+* byte 1: the number `n` of key script events that follow
+* bytes 2 to `n+1`: the key script. Each event is a byte where the low nibble
+  is the key, bit 4 is set to press the key or clear to release it, and bits
+  5-7 are the number of frames to wait before the event is applied.
+* The rest of the input is the ROM, loaded at `PROG_OFFSET`.
+
+Every input starts from a snapshot of a freshly reset machine, which is
+restored with `c8_load_state()` instead of `c8_reset()` and file I/O.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "chip8.h"
+
+/* Instructions executed between 60Hz ticks */
+#define STEPS_PER_FRAME		20
+
+/* The maximum number of frames to run per input */
+#define MAX_FRAMES			16
+
+#define MAX_INPUT_SIZE		(TOTAL_RAM - PROG_OFFSET + 2 + 255)
+
+#if defined(C8_LIBFUZZER) && defined(__clang__)
+#  define COVERAGE_MAP __attribute__((used, section("__libfuzzer_extra_counters")))
+#else
+#  define COVERAGE_MAP
+#endif
+
+/* One counter for every (even) address the PC visits */
+COVERAGE_MAP static uint8_t pc_map[TOTAL_RAM/2];
+
+/* One counter per opcode class: the high nibble combined with the low byte,
+	which distinguishes all the 8xyN, ExNN and FxNN variants */
+COVERAGE_MAP static uint8_t op_map[4096];
+
+#define OP_CLASS(op)	((((op) & 0xF000) >> 4) | ((op) & 0x00FF))
+
+/* Saturating increment, so that a counter never wraps back to 0 */
+#define HIT(c)			((c) += ((c) != 0xFF))
+
+static uint8_t *pristine;
+
+static uint32_t seed;
+static int fuzz_rand() {
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 16) & 0x7FFF;
+}
+
+static int quiet_puts(const char *s) {
+	(void)s;
+	return 0;
+}
+
+static void fuzz_init() {
+	c8_puts = quiet_puts;
+	c8_rand = fuzz_rand;
+	c8_sys_hook = NULL;
+
+	c8_reset();
+	pristine = malloc(c8_state_size());
+	if(!pristine) {
+		fprintf(stderr, "error: out of memory\n");
+		exit(1);
+	}
+	c8_save_state(pristine);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	size_t n, rom_size;
+	const uint8_t *script, *rom;
+	int frame, step, wait;
+
+	if(!pristine)
+		fuzz_init();
+
+	if(size < 2)
+		return 0;
+
+	n = data[1];
+	if(size < n + 2)
+		return 0;
+	script = data + 2;
+	rom = script + n;
+	rom_size = size - n - 2;
+	if(rom_size > TOTAL_RAM - PROG_OFFSET)
+		rom_size = TOTAL_RAM - PROG_OFFSET;
+
+	c8_load_state(pristine);
+	c8_set_quirks(data[0] & 0x3F);
+	c8_load_program((uint8_t *)rom, rom_size);
+	seed = size;
+
+	wait = n > 0 ? *script >> 5 : 0;
+	for(frame = 0; frame < MAX_FRAMES; frame++) {
+		while(n > 0 && wait == 0) {
+			if(*script & 0x10)
+				c8_key_down(*script & 0x0F);
+			else
+				c8_key_up(*script & 0x0F);
+			script++;
+			n--;
+			if(n > 0)
+				wait = *script >> 5;
+		}
+		if(wait > 0)
+			wait--;
+
+		for(step = 0; step < STEPS_PER_FRAME; step++) {
+			uint16_t pc = c8_get_pc();
+			if(c8_ended())
+				return 0;
+			if(c8_waitkey())
+				break;
+			HIT(pc_map[(pc & RAM_MASK) >> 1]);
+			HIT(op_map[OP_CLASS(c8_opcode(pc))]);
+			c8_step();
+			/* A `JP` to itself is the usual way for a program to halt */
+			if(c8_get_pc() == pc && (c8_opcode(pc) & 0xF000) == 0x1000)
+				return 0;
+		}
+		c8_60hz_tick();
+	}
+	return 0;
+}
+
+#ifndef C8_LIBFUZZER
+
+static uint8_t input[MAX_INPUT_SIZE];
+
+static size_t read_input(FILE *f) {
+	return fread(input, 1, sizeof input, f);
+}
+
+static int count_hits(const uint8_t *map, size_t n) {
+	int hits = 0;
+	size_t i;
+	for(i = 0; i < n; i++)
+		if(map[i])
+			hits++;
+	return hits;
+}
+
+int main(int argc, char *argv[]) {
+	int i;
+
+	fuzz_init();
+
+#ifdef __AFL_LOOP
+	while(__AFL_LOOP(100000)) {
+		size_t len = read_input(stdin);
+		LLVMFuzzerTestOneInput(input, len);
+	}
+	return 0;
+#endif
+
+	if(argc < 2) {
+		size_t len = read_input(stdin);
+		LLVMFuzzerTestOneInput(input, len);
+	}
+	for(i = 1; i < argc; i++) {
+		FILE *f = fopen(argv[i], "rb");
+		size_t len;
+		if(!f) {
+			fprintf(stderr, "error: unable to open %s\n", argv[i]);
+			return 1;
+		}
+		len = read_input(f);
+		fclose(f);
+		LLVMFuzzerTestOneInput(input, len);
+	}
+
+	printf("coverage: %d program counters, %d opcode classes\n",
+		count_hits(pc_map, sizeof pc_map), count_hits(op_map, sizeof op_map));
+	return 0;
+}
+
+#endif
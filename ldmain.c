@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "chip8.h"
+
+static void usage(const char *name) {
+	printf("usage: %s [options] infile.o...\n", name);
+	printf("where options are:\n");
+	printf(" -o outfile     : Output file\n");
+	printf(" -v             : Verbose mode\n");
+}
+
+int main(int argc, char *argv[]) {
+	int opt;
+	const char *outfile = "a.ch8";
+	static char buffer[4096];
+	static uint8_t prog[TOTAL_RAM - PROG_OFFSET];
+	c8_writer_t listing;
+	c8_asm_t a;
+
+	while((opt = getopt(argc, argv, "vo:?")) != -1) {
+		switch(opt) {
+			case 'v': {
+				c8_verbose++;
+			} break;
+			case 'o': {
+				outfile = optarg;
+			} break;
+			case '?' : {
+				usage(argv[0]);
+				return 1;
+			}
+		}
+	}
+	if(optind >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	const char *const *names = (const char *const *)argv + optind;
+	int n = argc - optind;
+	char **objects = calloc(n, sizeof *objects);
+	if(!objects) {
+		fprintf(stderr, "error: out of memory\n");
+		return 1;
+	}
+
+	int return_code = 1;
+	for(int i = 0; i < n; i++) {
+		if(c8_verbose)
+			printf("Reading input from '%s'...\n", names[i]);
+		objects[i] = c8_load_txt(names[i]);
+		if(!objects[i]) {
+			fprintf(stderr, "error: unable to read '%s'\n", names[i]);
+			goto done;
+		}
+	}
+
+	c8_asm_init(&a);
+	a.verbose = c8_verbose;
+	c8_writer_file(&listing, stdout, buffer, sizeof buffer);
+	a.listing = &listing;
+
+	int len = c8_link(&a, (const char *const *)objects, names, n, prog, sizeof prog);
+	for(int i = 0; i < a.ndiags; i++) {
+		const c8_diag_t *d = &a.diags[i];
+		if(d->file && d->line)
+			fprintf(stderr, "error:%s:%d: %s\n", d->file, d->line, d->message);
+		else if(d->file)
+			fprintf(stderr, "error:%s: %s\n", d->file, d->message);
+		else
+			fprintf(stderr, "error: %s\n", d->message);
+	}
+	c8_asm_free(&a);
+	if(len < 0)
+		goto done;
+
+	if(c8_verbose)
+		printf("Writing output to '%s'...\n", outfile);
+	c8_reset();
+	for(int i = 0; i < len; i++)
+		c8_set(PROG_OFFSET + i, prog[i]);
+	if(!c8_save_file(outfile)) {
+		fprintf(stderr, "error: unable to write output to '%s': %s\n", outfile, strerror(errno));
+		goto done;
+	}
+	if(c8_verbose)
+		printf("Success.\n");
+	return_code = 0;
+
+done:
+	for(int i = 0; i < n; i++)
+		free(objects[i]);
+	free(objects);
+	return return_code;
+}
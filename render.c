@@ -37,6 +37,28 @@ static int bg_color = 0x000055;
 /* Is the interpreter running? Set to 0 to enter "debug" mode */
 static int running = 1;
 
+/* Translate the program to native code? */
+static int use_jit = 0;
+
+/* Compile hot loops into traces? */
+static int use_traces = 0;
+
+/* File to save the coverage to, for `c8dasm -t` */
+static const char *coverage_file = NULL;
+
+/* Source map from `c8asm -g`, to show where the PC is in the source */
+static c8_srcmap_t *source_map = NULL;
+
+/* File to save the profile to, and the number of times the PC was sampled
+    at each address */
+static const char *profile_file = NULL;
+static unsigned long samples[TOTAL_RAM];
+static unsigned long total_samples = 0;
+
+/* Instructions between samples of the PC; a prime, so that the samples
+    don't keep falling on the same instructions of a loop */
+#define PROFILE_INTERVAL    17
+
 static Bitmap *chip8_screen;
 static Bitmap *hud;
 
@@ -87,6 +109,13 @@ static void usage() {
                 "  -b bg        : Background color\n"
                 "  -s spd       : Specify the speed\n"
                 "  -d           : Debug mode\n"
+                "  -j           : Use the JIT, where it is available\n"
+                "  -t           : Compile hot loops into traces\n"
+                "  -r file      : Record the code executed and the data drawn\n"
+                "                 to `file` for the disassembler\n"
+                "  -g map       : Load the source map written by `c8asm -g`\n"
+                "  -p file      : Profile the program and write the results\n"
+                "                 to `file`, by source line with -g\n"
                 "  -v           : increase verbosity\n"
                 "  -q quirks    : sets the quirks mode\n"
                 "      `quirks` can be a comma separated combination\n"
@@ -163,13 +192,22 @@ void init_game(int argc, char *argv[]) {
     bg_color = bm_byte_order(bg_color);
 
     int opt;
-    while((opt = getopt(argc, argv, "f:b:s:dvhq:m:")) != -1) {
+    while((opt = getopt(argc, argv, "f:b:s:djtr:g:p:vhq:m:")) != -1) {
         switch(opt) {
             case 'v': c8_verbose++; break;
             case 'f': fg_color = bm_atoi(optarg); break;
             case 'b': bg_color = bm_atoi(optarg); break;
             case 's': speed = atoi(optarg); if(speed < 1) speed = 10; break;
             case 'd': running = 0; break;
+            case 'j': use_jit = 1; break;
+            case 't': use_traces = 1; break;
+            case 'r': coverage_file = optarg; break;
+            case 'g': {
+                c8_srcmap_free(source_map);
+                if(!(source_map = c8_srcmap_load(optarg)))
+                    exit_error("Unable to load the source map '%s'\n", optarg);
+            } break;
+            case 'p': profile_file = optarg; break;
             case 'q': {
                 unsigned int quirks = 0;
                 char *token = strtok(optarg, ",");
@@ -223,6 +261,14 @@ void init_game(int argc, char *argv[]) {
 
     c8_sys_hook = example_sys_hook;
 
+    /* Let the interpreter derive the 60Hz timer ticks from the speed */
+    c8_set_tick_rate(speed, 60);
+
+    if(use_jit && !c8_jit_start())
+        rlog("The JIT is not available; using the interpreter");
+    else if(use_traces && !use_jit)
+        c8_trace_start();
+
 #ifdef __EMSCRIPTEN__
     em_ready = 0;
     rlog("emscripten_wget retrieving %s", infile);
@@ -235,6 +281,9 @@ void init_game(int argc, char *argv[]) {
     }
 #endif
 
+    if(coverage_file)
+        c8_coverage_start();
+
     bm_set_color(screen, 0x202020);
     bm_clear(screen);
 
@@ -269,7 +318,75 @@ void init_game(int argc, char *argv[]) {
     rlog("Initialized.");
 }
 
+/* A line of the profile: the samples at the addresses of one source line,
+    or at one address if there's no source map */
+typedef struct {
+    uint16_t addr;
+    int file, line;
+    unsigned long count;
+} ProfileLine;
+
+static int compare_source(const void *a, const void *b) {
+    const ProfileLine *x = a, *y = b;
+    if(x->file != y->file)
+        return x->file - y->file;
+    if(x->line != y->line)
+        return x->line - y->line;
+    return x->addr - y->addr;
+}
+
+static int compare_count(const void *a, const void *b) {
+    const ProfileLine *x = a, *y = b;
+    if(x->count != y->count)
+        return x->count < y->count ? 1 : -1;
+    return x->addr - y->addr;
+}
+
+static int save_profile(const char *fname) {
+    static ProfileLine lines[TOTAL_RAM];
+    int i, n = 0, m;
+    FILE *f;
+
+    for(i = 0; i < TOTAL_RAM; i++) {
+        if(!samples[i])
+            continue;
+        lines[n].addr = i;
+        lines[n].file = source_map ? source_map->file[i] : -1;
+        lines[n].line = source_map ? source_map->line[i] : 0;
+        lines[n++].count = samples[i];
+    }
+
+    /* Add up the addresses of each source line */
+    qsort(lines, n, sizeof *lines, compare_source);
+    for(i = 0, m = 0; i < n; i++) {
+        if(m > 0 && lines[i].file >= 0 && lines[i].file == lines[m-1].file && lines[i].line == lines[m-1].line)
+            lines[m-1].count += lines[i].count;
+        else
+            lines[m++] = lines[i];
+    }
+    qsort(lines, m, sizeof *lines, compare_count);
+
+    if(!(f = fopen(fname, "w")))
+        return 0;
+    fprintf(f, "# %lu samples, one every %d instructions\n", total_samples, PROFILE_INTERVAL);
+    fprintf(f, "# samples      %%  addr  source\n");
+    for(i = 0; i < m; i++) {
+        fprintf(f, "%9lu %6.2f  %03X", lines[i].count, 100.0 * lines[i].count / total_samples, lines[i].addr);
+        if(lines[i].file >= 0)
+            fprintf(f, "  %s:%d", source_map->files[lines[i].file], lines[i].line);
+        fputc('\n', f);
+    }
+    return !fclose(f);
+}
+
 void deinit_game() {
+    if(coverage_file && !c8_coverage_save(coverage_file))
+        rerror("Unable to save the coverage to %s", coverage_file);
+    if(profile_file && !save_profile(profile_file))
+        rerror("Unable to save the profile to %s", profile_file);
+    c8_srcmap_free(source_map);
+    c8_jit_stop();
+    c8_trace_stop();
     bm_free(hud);
     bm_free(chip8_screen);
     rlog("Done.");
@@ -388,7 +505,7 @@ void bm_blit_blend(Bitmap *dst, int dx, int dy, Bitmap *src, int sx, int sy, int
 
 
 void draw_hud() {
-    int i;
+    int i, line;
 
     // Bitmap hud;
     // static unsigned char hud_buffer[128 * 24 * 4];
@@ -399,7 +516,10 @@ void draw_hud() {
     bm_set_color(hud, 0x202020);
     bm_clear(hud);
     bm_set_color(hud, 0xFFFFFF);
-    bm_printf(hud, 1, 0, "%03X %04X", pc, opcode);
+    if(source_map && c8_srcmap_lookup(source_map, pc, &line))
+        bm_printf(hud, 1, 0, "%03X %04X L%d", pc, opcode, line);
+    else
+        bm_printf(hud, 1, 0, "%03X %04X", pc, opcode);
     for(i = 0; i < 16; i++) {
         bm_printf(hud, (i & 0x07) * 16, (i >> 3) * 8 + 8, "%02X", c8_get_reg(i));
     }
@@ -407,9 +527,27 @@ void draw_hud() {
     bm_blit_blend(screen, 0, bm_height(screen) - 24, hud, 0, 0, bm_width(hud), bm_height(hud));
 }
 
+/* Runs `n` instructions, sampling the PC every PROFILE_INTERVAL of them */
+static void run_profiled(int n) {
+    static int since_sample = 0;
+    while(n > 0) {
+        int count = PROFILE_INTERVAL - since_sample;
+        if(count > n)
+            count = n;
+        c8_run(count);
+        n -= count;
+        since_sample += count;
+        if(since_sample == PROFILE_INTERVAL) {
+            samples[c8_get_pc() & RAM_MASK]++;
+            total_samples++;
+            since_sample = 0;
+        }
+    }
+}
+
 int render(double elapsedSeconds) {
     int i;
-    static double timer = 0.0;
+    static double budget = 0.0;
 
 #ifdef __EMSCRIPTEN__
     if(!em_ready) return 1;
@@ -428,30 +566,31 @@ int render(double elapsedSeconds) {
             c8_key_up(i);
     }
 
-    timer += elapsedSeconds;
-    while(timer > 1.0/60.0) {
-        c8_60hz_tick();
-        timer -= 1.0/60.0;
-    }
-
     if(running) {
         /* F5 breaks the program and enters debugging mode */
         if(keys[KCODE(F5)])
             running = 0;
 
-        /* instructions per second * elapsed seconds = number of instructions to execute */
-        int count = speed * elapsedSeconds;
-        for(i = 0; i < count; i++) {
-            if(c8_ended())
-                return 0;
-            else if(c8_waitkey() && !key_pressed)
-                return 1;
-
-            c8_step();
+        /* instructions per second * elapsed seconds = number of instructions to execute.
+            The fractions are carried over to the next frame, because the timers are
+            derived from the number of instructions executed. */
+        budget += speed * elapsedSeconds;
+        int count = budget;
+        budget -= count;
+        if(c8_ended())
+            return 0;
 
-            if(c8_screen_updated())
-                draw_screen();
-        }
+        /* c8_run() keeps counting instructions while a `Fx0A` waits for
+            a key to be pressed, which keeps the timers running.
+            The debugging mode below uses c8_step() instead so that it
+            stops at every instruction. */
+        if(profile_file)
+            run_profiled(count);
+        else
+            c8_run(count);
+
+        if(c8_screen_updated())
+            draw_screen();
     } else {
         /* Debugging mode:
             F6 steps through the program
@@ -469,6 +608,12 @@ int render(double elapsedSeconds) {
             else if(c8_waitkey() && !key_pressed)
                 return 1;
             c8_step();
+            if(source_map) {
+                int line;
+                const char *file = c8_srcmap_lookup(source_map, c8_get_pc(), &line);
+                if(file)
+                    rlog("%03X: %s:%d", c8_get_pc(), file, line);
+            }
             if(c8_screen_updated()) {
                 draw_screen();
             }